@@ -0,0 +1,141 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "conversation-index.h"
+
+typedef struct {
+  /* Peer -> otrng_conversation_s */
+  GHashTable *by_peer;
+  /* Peer -> otrng_s, for the conversations that are encrypted */
+  GHashTable *encrypted;
+} conversation_index_s;
+
+/* otrng_client_s -> conversation_index_s */
+static GHashTable *indexes = NULL;
+
+static void conversation_index_free(gpointer data) {
+  conversation_index_s *index = data;
+
+  g_hash_table_destroy(index->by_peer);
+  g_hash_table_destroy(index->encrypted);
+  g_free(index);
+}
+
+static conversation_index_s *
+conversation_index_get(const otrng_client_s *client, gboolean create) {
+  conversation_index_s *index;
+
+  if (!indexes) {
+    if (!create) {
+      return NULL;
+    }
+    indexes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                    conversation_index_free);
+  }
+
+  index = g_hash_table_lookup(indexes, client);
+  if (!index && create) {
+    index = g_new(conversation_index_s, 1);
+    index->by_peer =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    index->encrypted =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_insert(indexes, (gpointer)client, index);
+  }
+
+  return index;
+}
+
+otrng_conversation_s *otrng_plugin_client_get_conversation(
+    int force_create, const char *peer, otrng_client_s *client) {
+  conversation_index_s *index;
+  otrng_conversation_s *conv;
+
+  if (!peer || !client) {
+    return NULL;
+  }
+
+  index = conversation_index_get(client, TRUE);
+  conv = g_hash_table_lookup(index->by_peer, peer);
+  if (conv) {
+    return conv;
+  }
+
+  /* Misses are not remembered: libotr-ng creates conversations on its own
+   * when messages arrive */
+  conv = otrng_client_get_conversation(force_create, peer, client);
+  if (conv) {
+    g_hash_table_insert(index->by_peer, g_strdup(peer), conv);
+  }
+
+  return conv;
+}
+
+void otrng_plugin_conversation_index_set_encrypted(const otrng_s *conn,
+                                                   gboolean encrypted) {
+  conversation_index_s *index;
+
+  if (!conn || !conn->client || !conn->peer) {
+    return;
+  }
+
+  index = conversation_index_get(conn->client, encrypted);
+  if (!index) {
+    return;
+  }
+
+  if (encrypted) {
+    g_hash_table_insert(index->encrypted, g_strdup(conn->peer),
+                        (gpointer)conn);
+  } else {
+    g_hash_table_remove(index->encrypted, conn->peer);
+  }
+}
+
+GList *otrng_plugin_client_encrypted_conversations(otrng_client_s *client) {
+  conversation_index_s *index = conversation_index_get(client, FALSE);
+
+  if (!index) {
+    return NULL;
+  }
+
+  return g_hash_table_get_values(index->encrypted);
+}
+
+void otrng_plugin_conversation_index_forget(otrng_client_s *client,
+                                            const char *peer) {
+  conversation_index_s *index = conversation_index_get(client, FALSE);
+
+  if (!index || !peer) {
+    return;
+  }
+
+  g_hash_table_remove(index->by_peer, peer);
+  g_hash_table_remove(index->encrypted, peer);
+}
+
+void otrng_plugin_conversation_index_clear(void) {
+  if (indexes) {
+    g_hash_table_destroy(indexes);
+    indexes = NULL;
+  }
+}
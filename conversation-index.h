@@ -0,0 +1,56 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef OTRNG_PIDGIN_CONVERSATION_INDEX
+#define OTRNG_PIDGIN_CONVERSATION_INDEX
+
+#include <glib.h>
+
+#include <libotr-ng/client.h>
+
+/* libotr-ng keeps the conversations of a client in a list, which it walks on
+ * every lookup. This indexes them by peer for the plugin, and keeps track of
+ * the ones that are encrypted. Conversations only go away when the plugin
+ * disconnects them or the global state is freed, so the index is told about
+ * the former and cleared on the latter. */
+
+/* Like otrng_client_get_conversation, but only the first lookup for a peer
+ * walks the conversations of client. */
+otrng_conversation_s *otrng_plugin_client_get_conversation(
+    int force_create, const char *peer, otrng_client_s *client);
+
+/* Records that conn went secure or insecure */
+void otrng_plugin_conversation_index_set_encrypted(const otrng_s *conn,
+                                                   gboolean encrypted);
+
+/* Returns a new list with the conversations of client that are encrypted, to
+ * be freed with g_list_free. The conversations are const otrng_s pointers. */
+GList *otrng_plugin_client_encrypted_conversations(otrng_client_s *client);
+
+/* Forgets the conversation of client with peer, before it is freed */
+void otrng_plugin_conversation_index_forget(otrng_client_s *client,
+                                            const char *peer);
+
+/* Forgets everything, once the clients are freed */
+void otrng_plugin_conversation_index_clear(void);
+
+#endif // OTRNG_PIDGIN_CONVERSATION_INDEX
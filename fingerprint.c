@@ -20,12 +20,16 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#include "conversation-index.h"
 #include "fingerprint.h"
+#include "hex-codec.h"
 #include "persistance.h"
 #include "pidgin-helpers.h"
 #include "plugin-conversation.h"
@@ -60,8 +64,93 @@ void write_fingerprints_cb_v3(void *opdata) {
 }
 
 void otrng_plugin_write_fingerprints(void) {
-  persistance_write_fingerprints_v3(otrng_state);
-  persistance_write_fingerprints_v4(otrng_state);
+  persistance_mark_dirty(otrng_state, NULL, PERSISTANCE_FINGERPRINTS_V3);
+  persistance_mark_dirty(otrng_state, NULL, PERSISTANCE_FINGERPRINTS_V4);
+}
+
+/* Journal records are tab separated:
+ *   op protocol account username fingerprint trusted
+ * where op is one of the JOURNAL_OP_* characters and fingerprint is hex. */
+#define JOURNAL_OP_ADD 'A'
+#define JOURNAL_OP_TRUST 'T'
+#define JOURNAL_OP_FORGET 'F'
+
+static void journal_fingerprint(otrng_client_s *client, char op,
+                                const otrng_known_fingerprint_s *fp) {
+  char hex[OTRNG_FPRINT_LEN_BYTES * 2 + 1];
+  char *record;
+
+  if (!client || !fp || !fp->username) {
+    return;
+  }
+
+  otrng_plugin_hex_encode(fp->fp, OTRNG_FPRINT_LEN_BYTES, hex);
+
+  record = g_strdup_printf("%c\t%s\t%s\t%s\t%s\t%d", op,
+                           client->client_id.protocol,
+                           client->client_id.account, fp->username, hex,
+                           fp->trusted ? 1 : 0);
+  persistance_journal_append(otrng_state, client, record);
+  g_free(record);
+}
+
+static gboolean journal_hex_to_fingerprint(const char *hex,
+                                           otrng_fingerprint fp) {
+  return strlen(hex) == OTRNG_FPRINT_LEN_BYTES * 2 &&
+         otrng_plugin_hex_decode(hex, OTRNG_FPRINT_LEN_BYTES, fp);
+}
+
+/* Records are replayed on top of the snapshot they were appended after, so
+ * applying one has to be idempotent. */
+static void journal_replay_cb(otrng_global_state_s *state,
+                              const char *record) {
+  otrng_known_fingerprint_s *known;
+  otrng_fingerprint fp;
+  otrng_client_s *client;
+  gchar **fields = g_strsplit(record, "\t", 6);
+
+  if (g_strv_length(fields) != 6 || strlen(fields[0]) != 1 ||
+      !journal_hex_to_fingerprint(fields[4], fp)) {
+    g_strfreev(fields);
+    return;
+  }
+
+  client = get_otrng_client(fields[1], fields[2]);
+  if (!client) {
+    g_strfreev(fields);
+    return;
+  }
+
+  known = otrng_fingerprint_get_by_fp(client, fp);
+
+  switch (fields[0][0]) {
+  case JOURNAL_OP_ADD:
+  case JOURNAL_OP_TRUST:
+    if (!known) {
+      known = otrng_fingerprint_add(client, fp, fields[3], otrng_false);
+    }
+    if (known) {
+      known->trusted = atoi(fields[5]) ? otrng_true : otrng_false;
+    }
+    break;
+  case JOURNAL_OP_FORGET:
+    if (known) {
+      otrng_fingerprint_forget(client, known);
+    }
+    break;
+  }
+
+  g_strfreev(fields);
+}
+
+void otrng_plugin_fingerprint_added(otrng_client_s *client,
+                                    otrng_known_fingerprint_s *fp) {
+  journal_fingerprint(client, JOURNAL_OP_ADD, fp);
+}
+
+void otrng_plugin_fingerprint_trust_changed(otrng_client_s *client,
+                                            otrng_known_fingerprint_s *fp) {
+  journal_fingerprint(client, JOURNAL_OP_TRUST, fp);
 }
 
 // TODO: OB - I think we should revisit how these fingerprint_seen callbacks
@@ -96,8 +185,9 @@ static void fingerprint_seen_v4(const otrng_fingerprint fp,
   int seen =
       otrng_fingerprint_get_by_username(cconv->client, conv->peer) != NULL;
 
-  otrng_fingerprint_add(cconv->client, fp, conv->peer, otrng_false);
-  otrng_plugin_write_fingerprints();
+  otrng_plugin_fingerprint_added(
+      cconv->client,
+      otrng_fingerprint_add(cconv->client, fp, conv->peer, otrng_false));
 
   char *buf;
   if (seen) {
@@ -128,7 +218,7 @@ otrng_plugin_fingerprint_to_otr_conversation(otrng_client_s *client,
     return NULL;
   }
 
-  return otrng_client_get_conversation(0, f->username, client);
+  return otrng_plugin_client_get_conversation(0, f->username, client);
 }
 
 otrng_conversation_s *otrng_plugin_fingerprint_v3_to_otr_conversation(
@@ -137,7 +227,7 @@ otrng_conversation_s *otrng_plugin_fingerprint_v3_to_otr_conversation(
     return NULL;
   }
 
-  return otrng_client_get_conversation(0, f->username, client);
+  return otrng_plugin_client_get_conversation(0, f->username, client);
 }
 
 otrng_known_fingerprint_s *
@@ -147,6 +237,7 @@ otrng_plugin_fingerprint_get_active(const otrng_plugin_conversation *conv) {
 
 void otrng_plugin_fingerprint_forget(otrng_client_s *client,
                                      otrng_known_fingerprint_s *fp) {
+  journal_fingerprint(client, JOURNAL_OP_FORGET, fp);
   otrng_fingerprint_forget(client, fp);
 }
 
@@ -156,20 +247,20 @@ void otrng_plugin_fingerprint_v3_forget(otrng_client_s *client,
 }
 
 static void fingerprint_store_v4(otrng_client_s *client) {
-  persistance_write_fingerprints_v4(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_FINGERPRINTS_V4);
 }
 
 static void fingerprint_store_v3(otrng_client_s *client) {
-  persistance_write_fingerprints_v3(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_FINGERPRINTS_V3);
 }
 
 static void fingerprint_load_v4(otrng_client_s *client) {
-  persistance_read_fingerprints_v4(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_FINGERPRINTS_V4);
   update_fingerprint();
 }
 
 static void fingerprint_load_v3(otrng_client_s *client) {
-  persistance_read_fingerprints_v3(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_FINGERPRINTS_V3);
   update_fingerprint();
 }
 
@@ -180,6 +271,8 @@ void otrng_fingerprints_set_callbacks(otrng_client_callbacks_s *cb) {
   cb->load_fingerprints_v4 = fingerprint_load_v4;
   cb->store_fingerprints_v3 = fingerprint_store_v3;
   cb->load_fingerprints_v3 = fingerprint_load_v3;
+
+  persistance_set_journal_handler(journal_replay_cb);
 }
 
 gboolean otrng_plugin_fingerprints_load(
@@ -53,6 +53,14 @@ otrng_plugin_fingerprint_get_active(const otrng_plugin_conversation *conv);
 void otrng_plugin_fingerprint_forget(otrng_client_s *client,
                                      otrng_known_fingerprint_s *fp);
 
+/* Record a change to a v4 fingerprint in the fingerprint journal, instead of
+ * rewriting the whole store */
+void otrng_plugin_fingerprint_added(otrng_client_s *client,
+                                    otrng_known_fingerprint_s *fp);
+
+void otrng_plugin_fingerprint_trust_changed(otrng_client_s *client,
+                                            otrng_known_fingerprint_s *fp);
+
 void otrng_plugin_fingerprint_v3_forget(otrng_client_s *client,
                                         otrng_known_fingerprint_v3_s *fp);
 
@@ -63,10 +63,13 @@
 #include <libotr/userstate.h>
 
 /* pidgin-otrng headers */
+#include "conversation-index.h"
 #include "gtk-dialog.h"
+#include "hex-codec.h"
 #include "otr-icons.h"
 #include "pidgin-helpers.h"
 #include "plugin-all.h"
+#include "trust-icons.h"
 #include "ui.h"
 
 static GHashTable *otr_win_menus = 0;
@@ -126,6 +129,19 @@ typedef struct {
   ConnContext *context;
 } ConvOrContext;
 
+/* The items of an OTR menu that follow the state of its conversation. They
+ * are kept with the menu, so that state changes update them in place
+ * instead of building the menu again. */
+typedef struct {
+  PurpleConversation *conv;
+  TrustLevel level;
+  GtkWidget *query;
+  GtkWidget *end;
+  GtkWidget *smp;
+  GtkWidget *buddy_status;
+  GtkWidget *status_icon;
+} OtrMenuItems;
+
 static void close_progress_window(SMPData *smp_data) {
   if (smp_data->smp_progress_dialog) {
     gtk_dialog_response(GTK_DIALOG(smp_data->smp_progress_dialog),
@@ -176,31 +192,13 @@ static SMPData *otrng_gtk_dialog_add_smp_data(PurpleConversation *conv) {
 
 static GtkWidget *otr_icon(GtkWidget *image, TrustLevel level,
                            gboolean sensitivity) {
-  const char **data = NULL;
-
-  switch (level) {
-  case TRUST_NOT_PRIVATE:
-    data = otrng_not_private_icon;
-    break;
-  case TRUST_UNVERIFIED:
-    data = otrng_unverified_icon;
-    break;
-  case TRUST_PRIVATE:
-    data = otrng_private_icon;
-    break;
-  case TRUST_FINISHED:
-    data = otrng_finished_icon;
-    break;
-  }
-
-  GdkPixbuf *pixbuf = gdk_pixbuf_new_from_xpm_data(data);
+  GdkPixbuf *pixbuf = otrng_trust_icon(level);
 
   if (image) {
     gtk_image_set_from_pixbuf(GTK_IMAGE(image), pixbuf);
   } else {
     image = gtk_image_new_from_pixbuf(pixbuf);
   }
-  g_object_unref(G_OBJECT(pixbuf));
 
   gtk_widget_set_sensitive(image, sensitivity);
 
@@ -243,6 +241,16 @@ static void plugin_fingerprint_set_trust(otrng_plugin_fingerprint_s *fprint,
   }
 }
 
+/* Persists a trust change made with plugin_fingerprint_set_trust */
+static void plugin_fingerprint_store_trust(vrfy_fingerprint_data *vfd) {
+  if (vfd->fprint->version == 3) {
+    otrng_plugin_write_fingerprints();
+  } else {
+    otrng_plugin_fingerprint_trust_changed(
+        get_otrng_client(vfd->protocol, vfd->accountname), vfd->fprint->v4);
+  }
+}
+
 /* Called when a button is pressed on the "progress bar" smp dialog */
 static void smp_progress_response_cb(GtkDialog *dialog, gint response,
                                      otrng_plugin_conversation *context) {
@@ -374,7 +382,7 @@ static void smp_secret_response_cb(GtkDialog *dialog, gint response,
 
       /* Write the new info to disk, redraw the ui, and redraw the
        * OTR buttons. */
-      otrng_plugin_write_fingerprints();
+      plugin_fingerprint_store_trust(smppair->vfd);
       otrng_ui_update_keylist();
       otrng_dialog_resensitize_all();
     }
@@ -720,8 +728,8 @@ static char *create_verify_fingerprint_label_v4(
   p = purple_find_prpl(protocol);
   proto_name = (p && p->info->name) ? p->info->name : _("Unknown");
 
-  otrng_fingerprint_hash_to_human(their_human_fprint, their_fprint->fp,
-                                  sizeof(their_fprint->fp));
+  otrng_plugin_fingerprint_to_human(their_human_fprint, their_fprint->fp,
+                                    sizeof(their_fprint->fp));
 
   label_text = g_strdup_printf(_("Fingerprint for you, %s (%s):\n%s\n\n"
                                  "Purported fingerprint for %s:\n%s\n"),
@@ -1197,11 +1205,8 @@ otrng_gtk_dialog_private_key_wait_start(const char *account,
   handle->dialog = dialog;
   handle->label = label;
 
-  /* Make sure the dialog is actually displayed before doing any
-   * compute-intensive stuff. */
-  while (gtk_events_pending()) {
-    gtk_main_iteration();
-  }
+  /* The key is generated off the main thread, so the dialog is drawn and
+   * closed by the main loop as usual */
 
   g_free(secondary);
 
@@ -1294,20 +1299,16 @@ otrng_gtk_dialog_unknown_fingerprint(OtrlUserState us, const char *accountname,
 
 static void otrng_gtk_dialog_clicked_connect(GtkWidget *widget, gpointer data);
 
-static void build_otr_menu(PurpleConversation *conv, GtkWidget *menu,
-                           TrustLevel level);
+static void otr_update_menu(PidginWindow *win, const ConvOrContext *convctx,
+                            GtkWidget *menu, TrustLevel level);
 static void otr_refresh_otr_buttons(PurpleConversation *conv);
-static void otr_destroy_top_menu_objects(PurpleConversation *conv);
-static void otr_add_top_otr_menu(PurpleConversation *conv);
+static void otr_update_top_otr_menu(PurpleConversation *conv,
+                                    TrustLevel level);
 
 static void destroy_menuitem(GtkWidget *widget, gpointer data) {
   gtk_widget_destroy(widget);
 }
 
-static void otr_build_status_submenu(PidginWindow *win,
-                                     const ConvOrContext *convctx,
-                                     GtkWidget *menu, TrustLevel level);
-
 static void otr_check_conv_status_change(PurpleConversation *conv) {
   PidginConversation *gtkconv = PIDGIN_CONVERSATION(conv);
 
@@ -1426,6 +1427,10 @@ static void dialog_update_label_conv(PurpleConversation *conv,
   purple_conversation_set_data(conv, "otr-finished",
                                level == TRUST_FINISHED ? conv : NULL);
 
+  /* Every trust change ends up here, so remember the level for the
+   * timestamp handler. It is stored plus one, so that NULL means unknown. */
+  purple_conversation_set_data(conv, "otr-trust", GINT_TO_POINTER(level + 1));
+
   conv_or_ctx_map = purple_conversation_get_data(conv, "otr-convorctx");
   convctx = g_hash_table_lookup(conv_or_ctx_map, conv);
 
@@ -1437,9 +1442,7 @@ static void dialog_update_label_conv(PurpleConversation *conv,
   convctx->convctx_type = convctx_conv;
   convctx->conv = conv;
 
-  build_otr_menu(conv, menu, level); // TODO: first call to build_otr_menu
-  otr_build_status_submenu(pidgin_conv_get_window(gtkconv), convctx, menu,
-                           level);
+  otr_update_menu(pidgin_conv_get_window(gtkconv), convctx, menu, level);
 
   conv = gtkconv->active_conv;
   otr_check_conv_status_change(conv);
@@ -1449,8 +1452,7 @@ static void dialog_update_label_conv(PurpleConversation *conv,
     return;
   }
 
-  otr_destroy_top_menu_objects(conv); // TODO: second call to build_otr_menu.
-  otr_add_top_otr_menu(conv);
+  otr_update_top_otr_menu(conv, level);
   otr_refresh_otr_buttons(conv);
 }
 
@@ -1590,7 +1592,7 @@ static void verify_fingerprint_response_cb(GtkDialog *dialog, gint response,
 
       /* Write the new info to disk, redraw the ui, and redraw the
        * OTR buttons. */
-      otrng_plugin_write_fingerprints();
+      plugin_fingerprint_store_trust(vfd);
       otrng_ui_update_keylist();
       otrng_dialog_resensitize_all();
     }
@@ -1720,7 +1722,8 @@ otrng_gtk_dialog_update_smp(const otrng_plugin_conversation *context,
           otrng_plugin_fingerprint_get_active(context);
       if (fp && !responder) {
         fp->trusted = otrng_true;
-        otrng_plugin_write_fingerprints();
+        otrng_plugin_fingerprint_trust_changed(
+            otrng_plugin_conversation_to_client(context), fp);
         otrng_ui_update_keylist();
         otrng_dialog_resensitize_all();
       }
@@ -2008,7 +2011,7 @@ static void otrng_gtk_dialog_clicked_connect(GtkWidget *widget, gpointer data) {
   }
 
   otrng_conversation_s *otr_conv =
-      otrng_client_get_conversation(0, peer, client);
+      otrng_plugin_client_get_conversation(0, peer, client);
 
   /* Don't send if we're already ENCRYPTED */
   // TODO: Implement the "Refresh private conversation" behavior
@@ -2497,8 +2500,11 @@ static void show_menu_authors_otrv4(GtkWidget *widget, gpointer data) {
 }
 
 static void menu_end_private_conversation(GtkWidget *widget, gpointer data) {
-  otrng_ui_disconnect_connection(data);
-  otrng_plugin_conversation_free(data);
+  otrng_plugin_conversation *plugin_conv =
+      purple_conversation_to_plugin_conversation(data);
+
+  otrng_ui_disconnect_connection(plugin_conv);
+  otrng_plugin_conversation_free(plugin_conv);
 }
 
 static void dialog_resensitize(PurpleConversation *conv);
@@ -2637,10 +2643,25 @@ static void force_deselect(GtkItem *item, gpointer data) {
   gtk_item_deselect(item);
 }
 
+static const char *otr_status_text(TrustLevel level) {
+  switch (level) {
+  case TRUST_NOT_PRIVATE:
+    return _("Not Private");
+  case TRUST_UNVERIFIED:
+    return _("Unverified");
+  case TRUST_PRIVATE:
+    return _("Private");
+  case TRUST_FINISHED:
+    return _("Finished");
+  }
+
+  return "";
+}
+
 static void otr_build_status_submenu(PidginWindow *win,
-                                     const ConvOrContext *convctx,
-                                     GtkWidget *menu, TrustLevel level) {
-  char *status = "";
+                                     PurpleConversation *conv,
+                                     GtkWidget *menu, TrustLevel level,
+                                     OtrMenuItems *items) {
   GtkWidget *image;
   GtkWidget *levelimage;
   GtkWidget *buddy_name;
@@ -2652,16 +2673,6 @@ static void otr_build_status_submenu(PidginWindow *win,
 
   gchar *text = NULL;
 
-  PurpleConversation *conv;
-
-  if (convctx->convctx_type == convctx_conv) {
-    conv = convctx->conv;
-  } else if (convctx->convctx_type == convctx_ctx) {
-    conv = otrng_plugin_context_to_conv(convctx->context, 0);
-  } else {
-    return;
-  }
-
   text = g_strdup_printf("%s (%s)", conv->name,
                          purple_account_get_username(conv->account));
 
@@ -2680,22 +2691,7 @@ static void otr_build_status_submenu(PidginWindow *win,
 
   gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(buddy_name), image);
 
-  switch (level) {
-  case TRUST_NOT_PRIVATE:
-    status = _("Not Private");
-    break;
-  case TRUST_UNVERIFIED:
-    status = _("Unverified");
-    break;
-  case TRUST_PRIVATE:
-    status = _("Private");
-    break;
-  case TRUST_FINISHED:
-    status = _("Finished");
-    break;
-  }
-
-  buddy_status = gtk_image_menu_item_new_with_label(status);
+  buddy_status = gtk_image_menu_item_new_with_label(otr_status_text(level));
 
   levelimage = otr_icon(NULL, level, 1);
 
@@ -2740,14 +2736,13 @@ static void otr_build_status_submenu(PidginWindow *win,
                      GTK_SIGNAL_FUNC(menu_understanding_otrv4), conv);
   gtk_signal_connect(GTK_OBJECT(authors), "activate",
                      GTK_SIGNAL_FUNC(show_menu_authors_otrv4), conv);
+
+  items->buddy_status = buddy_status;
+  items->status_icon = levelimage;
 }
 
 static void build_otr_menu(PurpleConversation *conv, GtkWidget *menu,
-                           TrustLevel level) {
-  if (!conv) {
-    return;
-  }
-
+                           OtrMenuItems *items) {
   GtkWidget *buddymenuquery =
       gtk_menu_item_new_with_mnemonic(_("Start _private conversation"));
   GtkWidget *buddymenuend =
@@ -2771,43 +2766,80 @@ static void build_otr_menu(PurpleConversation *conv, GtkWidget *menu,
   gtk_signal_connect(GTK_OBJECT(buddymenuquery), "activate",
                      GTK_SIGNAL_FUNC(otrng_gtk_dialog_clicked_connect), conv);
   gtk_signal_connect(GTK_OBJECT(buddymenuend), "activate",
-                     GTK_SIGNAL_FUNC(menu_end_private_conversation),
-                     purple_conversation_to_plugin_conversation(conv));
+                     GTK_SIGNAL_FUNC(menu_end_private_conversation), conv);
   gtk_signal_connect(GTK_OBJECT(buddymenusmp), "activate",
                      GTK_SIGNAL_FUNC(socialist_millionaires), (gpointer)conv);
+
+  items->query = buddymenuquery;
+  items->end = buddymenuend;
+  items->smp = buddymenusmp;
 }
 
-static void otr_add_top_otr_menu(PurpleConversation *conv) {
+/* Brings menu up to date with the conversation of convctx. The menu is only
+ * built when it is new or shows another conversation, otherwise the items
+ * that depend on the state are updated in place. */
+static void otr_update_menu(PidginWindow *win, const ConvOrContext *convctx,
+                            GtkWidget *menu, TrustLevel level) {
+  OtrMenuItems *items = g_object_get_data(G_OBJECT(menu), "otr-menu-items");
+  PurpleConversation *conv;
+
+  if (convctx->convctx_type == convctx_conv) {
+    conv = convctx->conv;
+  } else if (convctx->convctx_type == convctx_ctx) {
+    conv = otrng_plugin_context_to_conv(convctx->context, 0);
+  } else {
+    return;
+  }
+
+  if (!conv) {
+    return;
+  }
+
+  if (!items || items->conv != conv) {
+    items = g_new0(OtrMenuItems, 1);
+    items->conv = conv;
+    items->level = level;
+    build_otr_menu(conv, menu, items);
+    otr_build_status_submenu(win, conv, menu, level, items);
+    g_object_set_data_full(G_OBJECT(menu), "otr-menu-items", items, g_free);
+    return;
+  }
+
+  otr_set_menu_labels(conv, items->query, items->end, items->smp);
+
+  if (items->level != level) {
+    gtk_label_set_text(
+        GTK_LABEL(gtk_bin_get_child(GTK_BIN(items->buddy_status))),
+        otr_status_text(level));
+    otr_icon(items->status_icon, level, 1);
+    items->level = level;
+  }
+}
+
+/* Adds the OTR menu of the window of conv to its menu bar, or updates the
+ * one already there */
+static void otr_update_top_otr_menu(PurpleConversation *conv,
+                                    TrustLevel level) {
   PidginConversation *gtkconv = PIDGIN_CONVERSATION(conv);
   PidginWindow *win = pidgin_conv_get_window(gtkconv);
   GtkWidget *menu_bar = win->menu.menubar;
 
   GList *menu_list = g_hash_table_lookup(otr_win_menus, win);
+  GList *iter;
 
   GtkWidget *topmenu;
   GtkWidget *topmenuitem;
 
-  TrustLevel level = TRUST_NOT_PRIVATE;
-  otrng_plugin_conversation *plugin_conv =
-      purple_conversation_to_plugin_conversation(conv);
-  if (plugin_conv) {
-    level = otrng_plugin_conversation_to_trust(plugin_conv);
-  }
-  otrng_plugin_conversation_free(plugin_conv);
-
   ConvOrContext *convctx;
   GHashTable *conv_or_ctx_map =
       purple_conversation_get_data(conv, "otr-convorctx");
 
-  int pos = otr_get_menu_insert_pos(conv);
+  int pos;
 
   if (purple_conversation_get_type(conv) != PURPLE_CONV_TYPE_IM) {
     return;
   }
 
-  topmenuitem = gtk_menu_item_new_with_label("OTR");
-  topmenu = gtk_menu_new();
-
   convctx = g_hash_table_lookup(conv_or_ctx_map, conv);
 
   if (!convctx) {
@@ -2817,8 +2849,23 @@ static void otr_add_top_otr_menu(PurpleConversation *conv) {
 
   convctx->convctx_type = convctx_conv;
   convctx->conv = conv;
-  build_otr_menu(conv, topmenu, level);
-  otr_build_status_submenu(win, convctx, topmenu, level);
+
+  if (menu_list) {
+    for (iter = menu_list; iter; iter = iter->next) {
+      topmenu = gtk_menu_item_get_submenu(GTK_MENU_ITEM(iter->data));
+      if (topmenu) {
+        otr_update_menu(win, convctx, topmenu, level);
+      }
+    }
+    return;
+  }
+
+  pos = otr_get_menu_insert_pos(conv);
+
+  topmenuitem = gtk_menu_item_new_with_label("OTR");
+  topmenu = gtk_menu_new();
+
+  otr_update_menu(win, convctx, topmenu, level);
 
   gtk_menu_item_set_submenu(GTK_MENU_ITEM(topmenuitem), topmenu);
 
@@ -2897,6 +2944,7 @@ static void conversation_destroyed(PurpleConversation *conv, void *data) {
   g_hash_table_remove(conv->data, "otr-private");
   g_hash_table_remove(conv->data, "otr-authenticated");
   g_hash_table_remove(conv->data, "otr-finished");
+  g_hash_table_remove(conv->data, "otr-trust");
   g_hash_table_remove(conv->data, "otr-select_best");
   g_hash_table_remove(conv->data, "otr-select_recent");
   g_hash_table_remove(conv->data, "otr-convorctx");
@@ -3044,9 +3092,6 @@ static void otrng_gtk_dialog_new_purple_conv(PurpleConversation *conv) {
   convctx->convctx_type = convctx_conv;
   convctx->conv = conv;
   g_hash_table_replace(conv_or_ctx_map, conv, convctx);
-  build_otr_menu(conv, menu, TRUST_NOT_PRIVATE);
-  otr_build_status_submenu(pidgin_conv_get_window(gtkconv), convctx, menu,
-                           TRUST_NOT_PRIVATE);
 
   purple_conversation_set_data(conv, "otr-label", label);
   purple_conversation_set_data(conv, "otr-button", button);
@@ -3135,21 +3180,34 @@ static void foreach_free_lists(void *key, void *value, void *data) {
   otr_clear_win_menu_list(win);
 }
 
+/* Returns the trust level shown in the label of conv, only working it out
+ * for conversations that have no label */
+static TrustLevel conversation_trust(PurpleConversation *conv) {
+  gpointer cached = purple_conversation_get_data(conv, "otr-trust");
+  otrng_plugin_conversation *plugin_conv;
+  TrustLevel level;
+
+  if (cached) {
+    return GPOINTER_TO_INT(cached) - 1;
+  }
+
+  plugin_conv = purple_conversation_to_plugin_conversation(conv);
+  level = otrng_plugin_conversation_to_trust(plugin_conv);
+  otrng_plugin_conversation_free(plugin_conv);
+
+  return level;
+}
+
 static char *conversation_timestamp(PurpleConversation *conv, time_t mtime,
                                     gboolean show_date) {
 
   PidginConversation *gtkconv = PIDGIN_CONVERSATION(conv);
 
-  TrustLevel current_level = TRUST_NOT_PRIVATE;
+  TrustLevel current_level = conversation_trust(conv);
   TrustLevel *previous_level = NULL;
 
   int id = 0;
 
-  otrng_plugin_conversation *plugin_conv =
-      purple_conversation_to_plugin_conversation(conv);
-  current_level = otrng_plugin_conversation_to_trust(plugin_conv);
-  otrng_plugin_conversation_free(plugin_conv);
-
   previous_level = (TrustLevel *)g_hash_table_lookup(otr_win_status, gtkconv);
 
   if (!previous_level) {
@@ -3243,8 +3301,7 @@ static gboolean check_incoming_instance_change(PurpleAccount *account,
 static void connection_signing_off_cb(PurpleConnection *conn) {
   PurpleAccount *account;
   otrng_client_s *client = NULL;
-  list_element_s *el = NULL;
-  otrng_conversation_s *otr_conv = NULL;
+  GList *encrypted, *el;
   otrng_plugin_conversation *otr_plugin_conv = NULL;
 
   account = purple_connection_get_account(conn);
@@ -3257,24 +3314,18 @@ static void connection_signing_off_cb(PurpleConnection *conn) {
     return;
   }
 
-  for (el = client->conversations; el; el = el->next) {
-    otr_conv = el->data;
-    if (!otr_conv) {
-      continue;
-    }
-
-    if (!otrng_conversation_is_encrypted(otr_conv)) {
-      continue;
-    }
-
-    otr_plugin_conv =
-        client_conversation_to_plugin_conversation(otr_conv->conn);
+  /* Only the encrypted conversations need disconnecting. Disconnecting one
+   * frees it and takes it out of the index, so this walks a copy. */
+  encrypted = otrng_plugin_client_encrypted_conversations(client);
+  for (el = encrypted; el; el = el->next) {
+    otr_plugin_conv = client_conversation_to_plugin_conversation(el->data);
 
     if (otr_plugin_conv) {
       otrng_ui_disconnect_connection(otr_plugin_conv);
       otrng_plugin_conversation_free(otr_plugin_conv);
     }
   }
+  g_list_free(encrypted);
 }
 
 static void unref_img_by_id(int *id) {
@@ -3315,6 +3366,8 @@ static void otrng_gtk_dialog_init(void) {
   img_id_finished = purple_imgstore_add_with_id(
       g_memdup(finished_png, sizeof(finished_png)), sizeof(finished_png), "");
 
+  otrng_trust_icons_load();
+
   purple_signal_connect(pidgin_conversations_get_handle(),
                         "conversation-switched", otrng_plugin_handle,
                         PURPLE_CALLBACK(conversation_switched), NULL);
@@ -3374,6 +3427,9 @@ static void otrng_gtk_dialog_cleanup(void) {
   unref_img_by_id(&img_id_private);
   unref_img_by_id(&img_id_finished);
 
+  /* The icons shown keep their own references */
+  otrng_trust_icons_unload();
+
   g_hash_table_foreach(otr_win_menus, foreach_free_lists, NULL);
 
   g_hash_table_destroy(otr_win_menus);
@@ -0,0 +1,317 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gtk-keylist.h"
+#include "hex-codec.h"
+
+static otrng_known_fingerprint_v3_s *
+copy_known_fingerprint_v3(const otrng_known_fingerprint_v3_s *fp) {
+  otrng_known_fingerprint_v3_s *fp_new =
+      malloc(sizeof(otrng_known_fingerprint_v3_s));
+  fp_new->username = fp->username;
+  fp_new->fp = fp->fp;
+  return fp_new;
+}
+
+static void keylist_row_free(gpointer data) {
+  otrng_keylist_row_s *row = data;
+
+  free(row->fp_v3);
+  g_free(row->username);
+  g_free(row);
+}
+
+static const unsigned char *
+fingerprint_bytes(const otrng_known_fingerprint_s *fp_v4,
+                  const otrng_known_fingerprint_v3_s *fp_v3, size_t *len) {
+  if (fp_v4) {
+    *len = sizeof(fp_v4->fp);
+    return fp_v4->fp;
+  }
+
+  *len = 20;
+  return fp_v3->fp->fingerprint;
+}
+
+static gint keylist_compare(GtkTreeModel *model, GtkTreeIter *a,
+                            GtkTreeIter *b, gpointer data) {
+  otrng_keylist_row_s *row_a = NULL, *row_b = NULL;
+  gint result = 0;
+
+  gtk_tree_model_get(model, a, KEYLIST_COLUMN_ROW_DATA, &row_a, -1);
+  gtk_tree_model_get(model, b, KEYLIST_COLUMN_ROW_DATA, &row_b, -1);
+  if (!row_a || !row_b) {
+    return (row_a != NULL) - (row_b != NULL);
+  }
+
+  switch (GPOINTER_TO_INT(data)) {
+  case KEYLIST_COLUMN_USERNAME:
+    return g_utf8_collate(row_a->username, row_b->username);
+  case KEYLIST_COLUMN_STATUS:
+    return g_utf8_collate(row_a->status, row_b->status);
+  case KEYLIST_COLUMN_VERIFIED:
+    return g_utf8_collate(row_a->verified, row_b->verified);
+  case KEYLIST_COLUMN_VERSION:
+    return (row_a->fp_v4 != NULL) - (row_b->fp_v4 != NULL);
+  case KEYLIST_COLUMN_FINGERPRINT:
+    result = memcmp(row_a->fingerprint, row_b->fingerprint,
+                    MIN(row_a->fingerprint_len, row_b->fingerprint_len));
+    return result ? result
+                  : (gint)row_a->fingerprint_len - (gint)row_b->fingerprint_len;
+  case KEYLIST_COLUMN_ACCOUNT:
+    result = g_strcmp0(row_a->client_id.account, row_b->client_id.account);
+    return result ? result
+                  : g_strcmp0(row_a->client_id.protocol,
+                              row_b->client_id.protocol);
+  }
+
+  return result;
+}
+
+static gboolean keylist_row_visible(GtkTreeModel *model, GtkTreeIter *iter,
+                                    gpointer data) {
+  otrng_keylist_s *keylist = data;
+  otrng_keylist_row_s *row = NULL;
+
+  gtk_tree_model_get(model, iter, KEYLIST_COLUMN_ROW_DATA, &row, -1);
+  if (!row) {
+    return FALSE;
+  }
+
+  if (keylist->searching && row->search_stamp != keylist->search_stamp) {
+    return FALSE;
+  }
+
+  return !keylist->visible || keylist->visible(row, keylist->visible_data);
+}
+
+otrng_keylist_s *otrng_keylist_new(otrng_keylist_visible_fn visible,
+                                   void *visible_data) {
+  otrng_keylist_s *keylist = g_new0(otrng_keylist_s, 1);
+  int i;
+
+  keylist->store = gtk_list_store_new(
+      KEYLIST_COLUMNS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+      G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_POINTER);
+  for (i = 0; i < KEYLIST_COLUMN_ROW_DATA; i++) {
+    gtk_tree_sortable_set_sort_func(GTK_TREE_SORTABLE(keylist->store), i,
+                                    keylist_compare, GINT_TO_POINTER(i), NULL);
+  }
+  gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(keylist->store),
+                                       KEYLIST_COLUMN_USERNAME,
+                                       GTK_SORT_ASCENDING);
+  keylist->rows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                        keylist_row_free);
+  keylist->search = otrng_prefix_index_new();
+  keylist->visible = visible;
+  keylist->visible_data = visible_data;
+
+  keylist->filter =
+      gtk_tree_model_filter_new(GTK_TREE_MODEL(keylist->store), NULL);
+  gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(keylist->filter),
+                                         keylist_row_visible, keylist, NULL);
+
+  return keylist;
+}
+
+void otrng_keylist_free(otrng_keylist_s *keylist) {
+  if (!keylist) {
+    return;
+  }
+
+  g_object_unref(keylist->filter);
+  g_object_unref(keylist->store);
+  g_hash_table_destroy(keylist->rows);
+  otrng_prefix_index_free(keylist->search);
+  g_free(keylist->search_text);
+  g_free(keylist->search_hex);
+  g_free(keylist);
+}
+
+/* Adds or removes the keys of row in the search index */
+static void keylist_index_row(otrng_keylist_s *keylist,
+                              otrng_keylist_row_s *row, gboolean add) {
+  char hex[sizeof(row->fingerprint) * 2 + 1];
+
+  otrng_plugin_hex_encode(row->fingerprint, row->fingerprint_len, hex);
+  if (add) {
+    otrng_prefix_index_add(keylist->search, row->username, row);
+    otrng_prefix_index_add(keylist->search, hex, row);
+  } else {
+    otrng_prefix_index_remove(keylist->search, row->username, row);
+    otrng_prefix_index_remove(keylist->search, hex, row);
+  }
+}
+
+static void keylist_insert_row(otrng_keylist_s *keylist,
+                               otrng_keylist_row_s *row) {
+  const unsigned char *fingerprint;
+  char hex[sizeof(row->fingerprint) * 2 + 1];
+  size_t len;
+
+  fingerprint =
+      fingerprint_bytes(row->fp_v4, row->fp_v3, &row->fingerprint_len);
+  memcpy(row->fingerprint, fingerprint, row->fingerprint_len);
+  keylist_index_row(keylist, row, TRUE);
+
+  /* A row added while searching shows up if it matches */
+  if (keylist->searching) {
+    len = strlen(keylist->search_text);
+    otrng_plugin_hex_encode(row->fingerprint, row->fingerprint_len, hex);
+    if (g_ascii_strncasecmp(row->username, keylist->search_text, len) == 0 ||
+        g_ascii_strncasecmp(hex, keylist->search_hex,
+                            strlen(keylist->search_hex)) == 0) {
+      row->search_stamp = keylist->search_stamp;
+    }
+  }
+
+  gtk_list_store_insert_with_values(keylist->store, &row->iter, -1,
+                                    KEYLIST_COLUMN_STATUS, row->status,
+                                    KEYLIST_COLUMN_VERIFIED, row->verified,
+                                    KEYLIST_COLUMN_ROW_DATA, row, -1);
+}
+
+static void keylist_remove_row(otrng_keylist_s *keylist,
+                               otrng_keylist_row_s *row) {
+  keylist_index_row(keylist, row, FALSE);
+  gtk_list_store_remove(keylist->store, &row->iter);
+}
+
+void otrng_keylist_begin_update(otrng_keylist_s *keylist) {
+  keylist->generation++;
+}
+
+void otrng_keylist_update_row(otrng_keylist_s *keylist,
+                              otrng_client_id_s client_id, gconstpointer key,
+                              otrng_known_fingerprint_s *fp_v4,
+                              otrng_known_fingerprint_v3_s *fp_v3,
+                              const char *status, const char *verified) {
+  otrng_keylist_row_s *row = g_hash_table_lookup(keylist->rows, key);
+  const char *username = fp_v4 ? fp_v4->username : fp_v3->username;
+  const unsigned char *fingerprint;
+  size_t len;
+
+  if (row) {
+    fingerprint = fingerprint_bytes(fp_v4, fp_v3, &len);
+
+    if ((row->fp_v4 == NULL) != (fp_v4 == NULL) ||
+        strcmp(row->username, username) != 0 ||
+        memcmp(row->fingerprint, fingerprint, len) != 0) {
+      /* A new fingerprint took the place of a forgotten one */
+      keylist_remove_row(keylist, row);
+      g_hash_table_remove(keylist->rows, key);
+      row = NULL;
+    } else if (fp_v3) {
+      row->fp_v3->username = fp_v3->username;
+    }
+  }
+
+  if (!row) {
+    row = g_new0(otrng_keylist_row_s, 1);
+    row->client_id = client_id;
+    row->fp_v4 = fp_v4;
+    row->fp_v3 = fp_v3 ? copy_known_fingerprint_v3(fp_v3) : NULL;
+    row->username = g_strdup(username);
+    row->status = status;
+    row->verified = verified;
+    keylist_insert_row(keylist, row);
+    g_hash_table_insert(keylist->rows, (gpointer)key, row);
+  } else if (strcmp(row->status, status) != 0 ||
+             strcmp(row->verified, verified) != 0) {
+    row->status = status;
+    row->verified = verified;
+    gtk_list_store_set(keylist->store, &row->iter, KEYLIST_COLUMN_STATUS,
+                       status, KEYLIST_COLUMN_VERIFIED, verified, -1);
+  }
+
+  row->generation = keylist->generation;
+}
+
+static gboolean keylist_remove_stale_row(gpointer key, gpointer value,
+                                         gpointer data) {
+  otrng_keylist_s *keylist = data;
+  otrng_keylist_row_s *row = value;
+
+  if (row->generation == keylist->generation) {
+    return FALSE;
+  }
+
+  keylist_remove_row(keylist, row);
+  return TRUE;
+}
+
+void otrng_keylist_end_update(otrng_keylist_s *keylist) {
+  g_hash_table_foreach_remove(keylist->rows, keylist_remove_stale_row,
+                              keylist);
+}
+
+static void keylist_stamp_match(gpointer value, gpointer data) {
+  otrng_keylist_s *keylist = data;
+  otrng_keylist_row_s *row = value;
+
+  row->search_stamp = keylist->search_stamp;
+}
+
+/* Only the matching rows are touched before filtering */
+void otrng_keylist_search(otrng_keylist_s *keylist, const char *search) {
+  char *text = g_strstrip(g_strdup(search));
+  char *hex, *from, *to;
+
+  g_free(keylist->search_text);
+  g_free(keylist->search_hex);
+  keylist->search_text = NULL;
+  keylist->search_hex = NULL;
+  keylist->searching = text[0] != '\0';
+  keylist->search_stamp++;
+
+  if (keylist->searching) {
+    /* Fingerprints are written in groups, but indexed without spaces */
+    hex = g_strdup(text);
+    for (from = to = hex; *from; from++) {
+      if (*from != ' ') {
+        *to++ = *from;
+      }
+    }
+    *to = '\0';
+
+    otrng_prefix_index_search(keylist->search, text, keylist_stamp_match,
+                              keylist);
+    if (strcmp(hex, text) != 0) {
+      otrng_prefix_index_search(keylist->search, hex, keylist_stamp_match,
+                                keylist);
+    }
+
+    keylist->search_text = text;
+    keylist->search_hex = hex;
+  } else {
+    g_free(text);
+  }
+
+  otrng_keylist_refilter(keylist);
+}
+
+void otrng_keylist_refilter(otrng_keylist_s *keylist) {
+  gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(keylist->filter));
+}
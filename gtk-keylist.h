@@ -0,0 +1,119 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef OTRNG_PIDGIN_GTK_KEYLIST
+#define OTRNG_PIDGIN_GTK_KEYLIST
+
+#include <gtk/gtk.h>
+
+#include <libotr/privkey.h>
+
+#include <libotr-ng/client.h>
+
+#include "prefix-index.h"
+
+/* The model behind the list of known fingerprints of the fingerprint
+ * manager. Its rows are brought up to date in place on every update, and
+ * searched by username or fingerprint through a prefix index. */
+
+enum {
+  KEYLIST_COLUMN_USERNAME,
+  KEYLIST_COLUMN_STATUS,
+  KEYLIST_COLUMN_VERIFIED,
+  KEYLIST_COLUMN_VERSION,
+  KEYLIST_COLUMN_FINGERPRINT,
+  KEYLIST_COLUMN_ACCOUNT,
+  KEYLIST_COLUMN_ROW_DATA,
+  KEYLIST_COLUMNS
+};
+
+typedef struct otrng_keylist_row_s {
+  otrng_client_id_s client_id;
+  otrng_known_fingerprint_s *fp_v4;
+  otrng_known_fingerprint_v3_s *fp_v3;
+  /* What the row was built from, to tell if the fingerprint at the same
+   * address is still the same one */
+  char *username;
+  unsigned char fingerprint[56];
+  size_t fingerprint_len;
+  /* The columns that change with the state, as last shown */
+  const char *status;
+  const char *verified;
+  /* The last update of the keylist that saw the fingerprint */
+  unsigned int generation;
+  unsigned int search_stamp;
+  GtkTreeIter iter;
+} otrng_keylist_row_s;
+
+/* Tells if a row matching the search should be shown */
+typedef gboolean (*otrng_keylist_visible_fn)(const otrng_keylist_row_s *row,
+                                             void *data);
+
+typedef struct {
+  /* Only the columns that change with the state and the row data are
+   * stored. The others are worked out from the row when it is drawn. */
+  GtkListStore *store;
+  /* The rows of store that match the search and visible */
+  GtkTreeModel *filter;
+  /* Fingerprint -> otrng_keylist_row_s of its row in store */
+  GHashTable *rows;
+  unsigned int generation;
+  /* Usernames and fingerprints in hex -> otrng_keylist_row_s */
+  otrng_prefix_index_s *search;
+  /* Rows matching the current search are stamped with it */
+  unsigned int search_stamp;
+  gboolean searching;
+  char *search_text;
+  char *search_hex;
+  otrng_keylist_visible_fn visible;
+  void *visible_data;
+} otrng_keylist_s;
+
+/* Returns an empty keylist sorted by username. visible, if not NULL, can
+ * hide further rows, such as those of other accounts. */
+otrng_keylist_s *otrng_keylist_new(otrng_keylist_visible_fn visible,
+                                   void *visible_data);
+void otrng_keylist_free(otrng_keylist_s *keylist);
+
+/* An update goes through every known fingerprint with
+ * otrng_keylist_update_row, between these two. The rows of the fingerprints
+ * it did not go through are removed at the end. */
+void otrng_keylist_begin_update(otrng_keylist_s *keylist);
+void otrng_keylist_end_update(otrng_keylist_s *keylist);
+
+/* Brings the row of a fingerprint up to date, adding it if it is new. key
+ * identifies the fingerprint across updates. The columns that never change
+ * are only worked out when the row is added. */
+void otrng_keylist_update_row(otrng_keylist_s *keylist,
+                              otrng_client_id_s client_id, gconstpointer key,
+                              otrng_known_fingerprint_s *fp_v4,
+                              otrng_known_fingerprint_v3_s *fp_v3,
+                              const char *status, const char *verified);
+
+/* Shows the rows whose username or fingerprint starts with search, or every
+ * row if search is empty. Spaces in search are ignored for fingerprints. */
+void otrng_keylist_search(otrng_keylist_s *keylist, const char *search);
+
+/* Filters the rows again, after what visible decides on has changed */
+void otrng_keylist_refilter(otrng_keylist_s *keylist);
+
+#endif // OTRNG_PIDGIN_GTK_KEYLIST
@@ -49,7 +49,9 @@
 #endif
 
 /* pidgin-otrng headers */
+#include "conversation-index.h"
 #include "dialogs.h"
+#include "gtk-keylist.h"
 #include "long_term_keys.h"
 #include "pidgin-helpers.h"
 #include "plugin-all.h"
@@ -73,7 +75,11 @@ static struct {
   GtkWidget *generate_button;
   GtkWidget *scrollwin;
   GtkWidget *keylist;
-  gint sortcol, sortdir;
+  otrng_keylist_s *keys;
+  GtkWidget *search_entry;
+  GtkWidget *account_filter;
+  /* The PurpleAccount of each entry of account_filter after "All" */
+  GPtrArray *filter_accounts;
   otrng_client_id_s selected_client_id;
   otrng_known_fingerprint_s *selected_fprint_v4;
   otrng_known_fingerprint_v3_s *selected_fprint_v3;
@@ -88,12 +94,6 @@ static struct {
 static const gchar *trust_states[] = {N_("Not private"), N_("Unverified"),
                                       N_("Private"), N_("Finished")};
 
-typedef struct fingerprint_row_data {
-  otrng_client_id_s client_id;
-  otrng_known_fingerprint_s *fp_v4;
-  otrng_known_fingerprint_v3_s *fp_v3;
-} fingerprint_row_data;
-
 static void account_menu_changed_cb(GtkWidget *item, PurpleAccount *account,
                                     void *data) {
   GtkWidget *fprint = ui_layout.fprint_label;
@@ -139,11 +139,16 @@ static void otrng_gtk_ui_update_fingerprint(void) {
   }
 }
 
+static void keylist_fill_account_filter(void);
+
 static void account_menu_added_removed_cb(PurpleAccount *account, void *data) {
   otrng_gtk_ui_update_fingerprint();
+  if (ui_layout.account_filter) {
+    keylist_fill_account_filter();
+  }
 }
 
-static void clist_all_unselected(void) {
+static void keylist_all_unselected(void) {
   if (ui_layout.connect_button) {
     gtk_widget_set_sensitive(ui_layout.connect_button, 0);
   }
@@ -160,29 +165,12 @@ static void clist_all_unselected(void) {
   ui_layout.selected_fprint_v4 = NULL;
 }
 
-typedef struct keylist_all_ctx {
-  int selected_row;
-  GtkWidget *keylist;
-} keylist_all_ctx;
-
-static otrng_known_fingerprint_v3_s *
-copy_known_fingerprint_v3(const otrng_known_fingerprint_v3_s *fp) {
-  otrng_known_fingerprint_v3_s *fp_new =
-      malloc(sizeof(otrng_known_fingerprint_v3_s));
-  fp_new->username = fp->username;
-  fp_new->fp = fp->fp;
-  return fp_new;
-}
-
 static void keylist_all_do_v3(const otrng_client_s *client,
                               otrng_known_fingerprint_v3_s *fp, void *_ctx) {
-  keylist_all_ctx *ctx = _ctx;
   otrng_plugin_conversation plugin_conv;
   PurpleAccount *account = NULL;
   PurpleConversation *pconv = NULL;
-  int i;
-  char hash[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
-  gchar *titles[6];
+  const char *status;
 
   account = client_id_to_purple_account(client->client_id);
   if (account) {
@@ -190,63 +178,43 @@ static void keylist_all_do_v3(const otrng_client_s *client,
                                                   fp->username, account);
   }
 
-  otrng_conversation_s *otr_conv =
-      otrng_client_get_conversation(0, fp->username, (otrng_client_s *)client);
+  otrng_conversation_s *otr_conv = otrng_plugin_client_get_conversation(
+      0, fp->username, (otrng_client_s *)client);
   if (otr_conv != NULL && otr_conv->conn != NULL) {
     Fingerprint *current_fp = NULL;
     if (otr_conv->conn->v3_conn && otr_conv->conn->v3_conn->ctx) {
       current_fp = otr_conv->conn->v3_conn->ctx->active_fingerprint;
     }
-    plugin_conv.account = g_strdup(client->client_id.account);
-    plugin_conv.protocol = g_strdup(client->client_id.protocol);
+    plugin_conv.account = (char *)client->client_id.account;
+    plugin_conv.protocol = (char *)client->client_id.protocol;
     plugin_conv.peer = fp->username;
     plugin_conv.conv = otr_conv->conn;
     if (current_fp && current_fp->fingerprint &&
         memcmp(fp->fp->fingerprint, current_fp->fingerprint, 20) == 0) {
-      titles[1] = (gchar *)_(
-          trust_states[otrng_plugin_conversation_to_trust(&plugin_conv)]);
+      status =
+          _(trust_states[otrng_plugin_conversation_to_trust(&plugin_conv)]);
     } else {
-      titles[1] = (gchar *)_(N_("No conversation"));
+      status = _(N_("No conversation"));
     }
-    g_free(plugin_conv.account);
-    g_free(plugin_conv.protocol);
   } else {
     if (pconv) {
-      titles[1] = (gchar *)_(trust_states[TRUST_NOT_PRIVATE]);
+      status = _(trust_states[TRUST_NOT_PRIVATE]);
     } else {
-      titles[1] = (gchar *)_(N_("No conversation"));
+      status = _(N_("No conversation"));
     }
   }
 
-  titles[0] = fp->username;
-  titles[2] = (fp->fp->trust && fp->fp->trust[0]) ? _("Yes") : _("No");
-  titles[3] = "v3";
-  otrl_privkey_hash_to_human(hash, fp->fp->fingerprint);
-  titles[4] = hash;
-  titles[5] = g_strdup_printf("%s (%s)", client->client_id.account,
-                              client->client_id.protocol);
-
-  i = gtk_clist_append(GTK_CLIST(ctx->keylist), titles);
-  g_free(titles[5]);
-  fingerprint_row_data *row_data = malloc(sizeof(fingerprint_row_data));
-  row_data->fp_v4 = NULL;
-  row_data->fp_v3 = copy_known_fingerprint_v3(fp);
-  row_data->client_id = client->client_id;
-  gtk_clist_set_row_data(GTK_CLIST(ctx->keylist), i, row_data);
-  if (ui_layout.selected_fprint_v3 != NULL &&
-      ui_layout.selected_fprint_v3->fp == fp->fp) {
-    ctx->selected_row = i;
-  }
+  otrng_keylist_update_row(
+      ui_layout.keys, client->client_id, fp->fp, NULL, fp, status,
+      (fp->fp->trust && fp->fp->trust[0]) ? _("Yes") : _("No"));
 }
 
 static void keylist_all_do_v4(const otrng_client_s *client,
                               otrng_known_fingerprint_s *fp, void *_ctx) {
-  keylist_all_ctx *ctx = _ctx;
   otrng_plugin_conversation plugin_conv;
   PurpleAccount *account = NULL;
   PurpleConversation *pconv = NULL;
-  int i;
-  gchar *titles[6];
+  const char *status;
 
   account = client_id_to_purple_account(client->client_id);
   if (account) {
@@ -254,86 +222,167 @@ static void keylist_all_do_v4(const otrng_client_s *client,
                                                   fp->username, account);
   }
 
-  otrng_conversation_s *otr_conv =
-      otrng_client_get_conversation(0, fp->username, (otrng_client_s *)client);
+  otrng_conversation_s *otr_conv = otrng_plugin_client_get_conversation(
+      0, fp->username, (otrng_client_s *)client);
   if (otr_conv != NULL && otr_conv->conn != NULL) {
     otrng_known_fingerprint_s *current_fp;
 
-    plugin_conv.account = g_strdup(client->client_id.account);
-    plugin_conv.protocol = g_strdup(client->client_id.protocol);
+    plugin_conv.account = (char *)client->client_id.account;
+    plugin_conv.protocol = (char *)client->client_id.protocol;
     plugin_conv.peer = fp->username;
     plugin_conv.conv = otr_conv->conn;
 
     current_fp = otrng_plugin_fingerprint_get_active(&plugin_conv);
     if (current_fp && memcmp(fp->fp, current_fp->fp, FPRINT_LEN_BYTES) == 0) {
-      titles[1] = (gchar *)_(
-          trust_states[otrng_plugin_conversation_to_trust(&plugin_conv)]);
+      status =
+          _(trust_states[otrng_plugin_conversation_to_trust(&plugin_conv)]);
     } else {
-      titles[1] = (gchar *)_(N_("No conversation"));
+      status = _(N_("No conversation"));
     }
-    g_free(plugin_conv.account);
-    g_free(plugin_conv.protocol);
   } else {
     if (pconv) {
-      titles[1] = (gchar *)_(trust_states[TRUST_NOT_PRIVATE]);
+      status = _(trust_states[TRUST_NOT_PRIVATE]);
     } else {
-      titles[1] = (gchar *)_(N_("No conversation"));
+      status = _(N_("No conversation"));
     }
   }
 
-  titles[0] = fp->username;
-  titles[2] = (fp->trusted) ? _("Yes") : _("No");
-  titles[3] = "v4";
+  otrng_keylist_update_row(ui_layout.keys, client->client_id, fp, fp, NULL,
+                           status, fp->trusted ? _("Yes") : _("No"));
+}
+
+static void keylist_cell_data(GtkTreeViewColumn *column, GtkCellRenderer *cell,
+                              GtkTreeModel *model, GtkTreeIter *iter,
+                              gpointer data) {
+  char human[OTRNG_FPRINT_HUMAN_LEN];
+  otrng_keylist_row_s *row = NULL;
+  gchar *account = NULL;
+  const char *text = NULL;
 
-  char *fphuman = malloc(OTRNG_FPRINT_HUMAN_LEN);
-  if (!fphuman) {
+  gtk_tree_model_get(model, iter, KEYLIST_COLUMN_ROW_DATA, &row, -1);
+  if (!row) {
     return;
   }
-  otrng_fingerprint_hash_to_human(fphuman, fp->fp, sizeof(fp->fp));
-  titles[4] = fphuman;
-  titles[5] = g_strdup_printf("%s (%s)", client->client_id.account,
-                              client->client_id.protocol);
-
-  i = gtk_clist_append(GTK_CLIST(ctx->keylist), titles);
-  free(fphuman);
-  g_free(titles[5]);
-  fingerprint_row_data *row_data = malloc(sizeof(fingerprint_row_data));
-  row_data->fp_v4 = fp;
-  row_data->fp_v3 = NULL;
-  row_data->client_id = client->client_id;
-  gtk_clist_set_row_data(GTK_CLIST(ctx->keylist), i, row_data);
-  if (ui_layout.selected_fprint_v4 == fp) {
-    ctx->selected_row = i;
+
+  switch (GPOINTER_TO_INT(data)) {
+  case KEYLIST_COLUMN_USERNAME:
+    text = row->username;
+    break;
+  case KEYLIST_COLUMN_STATUS:
+    text = row->status;
+    break;
+  case KEYLIST_COLUMN_VERIFIED:
+    text = row->verified;
+    break;
+  case KEYLIST_COLUMN_VERSION:
+    text = row->fp_v4 ? "v4" : "v3";
+    break;
+  case KEYLIST_COLUMN_FINGERPRINT:
+    otrng_plugin_fingerprint_to_human(human, row->fingerprint,
+                                      row->fingerprint_len);
+    text = human;
+    break;
+  case KEYLIST_COLUMN_ACCOUNT:
+    account = g_strdup_printf("%s (%s)", row->client_id.account,
+                              row->client_id.protocol);
+    text = account;
+    break;
   }
+
+  g_object_set(cell, "text", text, NULL);
+  g_free(account);
 }
 
-/* Update the keylist, if it's visible */
-static void otrng_gtk_ui_update_keylist(void) {
-  GtkWidget *keylist = ui_layout.keylist;
+static void keylist_column_clicked(GtkTreeViewColumn *column, gpointer data) {
+  GtkTreeSortable *sortable = GTK_TREE_SORTABLE(ui_layout.keys->store);
+  gint sort_column = GPOINTER_TO_INT(data), current;
+  GtkSortType order = GTK_SORT_ASCENDING;
+  GList *columns, *iter;
 
-  if (keylist == NULL) {
-    return;
+  if (gtk_tree_sortable_get_sort_column_id(sortable, &current, &order) &&
+      current == sort_column) {
+    order = order == GTK_SORT_ASCENDING ? GTK_SORT_DESCENDING
+                                        : GTK_SORT_ASCENDING;
+  } else {
+    order = GTK_SORT_ASCENDING;
   }
 
-  gtk_clist_freeze(GTK_CLIST(keylist));
-  gtk_clist_clear(GTK_CLIST(keylist));
+  gtk_tree_sortable_set_sort_column_id(sortable, sort_column, order);
 
-  keylist_all_ctx kac;
-  kac.selected_row = -1;
-  kac.keylist = keylist;
+  columns = gtk_tree_view_get_columns(GTK_TREE_VIEW(ui_layout.keylist));
+  for (iter = columns; iter; iter = iter->next) {
+    gtk_tree_view_column_set_sort_indicator(iter->data, iter->data == column);
+  }
+  g_list_free(columns);
+  gtk_tree_view_column_set_sort_order(column, order);
+}
 
-  otrng_global_state_do_all_fingerprints(otrng_state, keylist_all_do_v4, &kac);
-  otrng_global_state_do_all_fingerprints_v3(otrng_state, keylist_all_do_v3,
-                                            &kac);
+/* Hides the rows of the accounts other than the one picked in the account
+ * filter, if any */
+static gboolean keylist_row_visible(const otrng_keylist_row_s *row,
+                                    void *data) {
+  gint account_index;
+  PurpleAccount *account;
 
-  if (kac.selected_row >= 0) {
-    gtk_clist_select_row(GTK_CLIST(keylist), kac.selected_row, 0);
-  } else {
-    clist_all_unselected();
+  account_index =
+      gtk_combo_box_get_active(GTK_COMBO_BOX(ui_layout.account_filter));
+  if (account_index <= 0 ||
+      account_index > (gint)ui_layout.filter_accounts->len) {
+    return TRUE;
   }
 
-  gtk_clist_sort(GTK_CLIST(keylist));
-  gtk_clist_thaw(GTK_CLIST(keylist));
+  account = g_ptr_array_index(ui_layout.filter_accounts, account_index - 1);
+  return g_strcmp0(purple_account_get_protocol_id(account),
+                   row->client_id.protocol) == 0 &&
+         g_strcmp0(purple_normalize(account,
+                                    purple_account_get_username(account)),
+                   row->client_id.account) == 0;
+}
+
+static void keylist_search_changed(GtkEditable *editable, gpointer data) {
+  otrng_keylist_search(ui_layout.keys,
+                       gtk_entry_get_text(GTK_ENTRY(editable)));
+}
+
+static void keylist_account_filter_changed(GtkComboBox *combo, gpointer data) {
+  otrng_keylist_refilter(ui_layout.keys);
+}
+
+static void keylist_fill_account_filter(void) {
+  GtkComboBox *combo = GTK_COMBO_BOX(ui_layout.account_filter);
+  GList *iter;
+
+  while (gtk_tree_model_iter_n_children(gtk_combo_box_get_model(combo), NULL)) {
+    gtk_combo_box_remove_text(combo, 0);
+  }
+  g_ptr_array_set_size(ui_layout.filter_accounts, 0);
+
+  gtk_combo_box_append_text(combo, _("All accounts"));
+  for (iter = purple_accounts_get_all(); iter; iter = iter->next) {
+    PurpleAccount *account = iter->data;
+    gchar *text = g_strdup_printf("%s (%s)",
+                                  purple_account_get_username(account),
+                                  purple_account_get_protocol_name(account));
+
+    gtk_combo_box_append_text(combo, text);
+    g_ptr_array_add(ui_layout.filter_accounts, account);
+    g_free(text);
+  }
+  gtk_combo_box_set_active(combo, 0);
+}
+
+/* Update the keylist, if it's visible. Rows are added, changed and removed
+ * in place, and the store keeps them sorted as they change. */
+static void otrng_gtk_ui_update_keylist(void) {
+  if (ui_layout.keylist == NULL) {
+    return;
+  }
+
+  otrng_keylist_begin_update(ui_layout.keys);
+  otrng_global_state_do_all_fingerprints(otrng_state, keylist_all_do_v4, NULL);
+  otrng_global_state_do_all_fingerprints_v3(otrng_state, keylist_all_do_v3,
+                                            NULL);
+  otrng_keylist_end_update(ui_layout.keys);
 }
 
 static void generate(GtkWidget *widget, gpointer data) {
@@ -345,8 +394,7 @@ static void generate(GtkWidget *widget, gpointer data) {
   }
 
   // Do we actually have to create both keys at the same time?
-  long_term_keys_create_privkey_v4(purple_account_to_otrng_client(account));
-  long_term_keys_create_private_key_v3(purple_account_to_otrng_client(account));
+  long_term_keys_generate(purple_account_to_otrng_client(account));
 }
 
 static void ui_destroyed(GtkObject *object) {
@@ -357,6 +405,14 @@ static void ui_destroyed(GtkObject *object) {
   ui_layout.generate_button = NULL;
   ui_layout.scrollwin = NULL;
   ui_layout.keylist = NULL;
+  otrng_keylist_free(ui_layout.keys);
+  ui_layout.keys = NULL;
+  ui_layout.search_entry = NULL;
+  ui_layout.account_filter = NULL;
+  if (ui_layout.filter_accounts) {
+    g_ptr_array_free(ui_layout.filter_accounts, TRUE);
+    ui_layout.filter_accounts = NULL;
+  }
   ui_layout.selected_fprint_v3 = NULL;
   ui_layout.selected_fprint_v4 = NULL;
   ui_layout.connect_button = NULL;
@@ -368,14 +424,11 @@ static void ui_destroyed(GtkObject *object) {
   ui_layout.os.onlyprivatebox = NULL;
 }
 
-static void clist_selected(GtkWidget *widget, gint row, gint column,
-                           GdkEventButton *event, gpointer data) {
+static void keylist_selected(otrng_keylist_row_s *rfp) {
   int connect_sensitive = 0;
   int disconnect_sensitive = 0;
   int forget_sensitive = 0;
   int verify_sensitive = 0;
-  fingerprint_row_data *rfp =
-      gtk_clist_get_row_data(GTK_CLIST(ui_layout.keylist), row);
   // ConnContext *context_iter;
   otrng_conversation_s *otr_conv = NULL;
   if (rfp) {
@@ -421,26 +474,23 @@ static void clist_selected(GtkWidget *widget, gint row, gint column,
   ui_layout.selected_fprint_v4 = rfp->fp_v4;
 }
 
-static void clist_unselected(GtkWidget *widget, gint row, gint column,
-                             GdkEventButton *event, gpointer data) {
-  clist_all_unselected();
-}
+static void keylist_selection_changed(GtkTreeSelection *selection,
+                                      gpointer data) {
+  GtkTreeModel *model;
+  GtkTreeIter iter;
+  otrng_keylist_row_s *rfp = NULL;
 
-static void clist_click_column(GtkCList *clist, gint column, gpointer data) {
-  if (ui_layout.sortcol == column) {
-    ui_layout.sortdir = -(ui_layout.sortdir);
-  } else {
-    ui_layout.sortcol = column;
-    ui_layout.sortdir = 1;
+  if (!gtk_tree_selection_get_selected(selection, &model, &iter)) {
+    keylist_all_unselected();
+    return;
   }
 
-  gtk_clist_set_sort_column(clist, ui_layout.sortcol);
-  gtk_clist_set_sort_type(clist, ui_layout.sortdir == 1 ? GTK_SORT_ASCENDING
-                                                        : GTK_SORT_DESCENDING);
-  /* Just use the default compare function for the rest of the
-   * columns */
-  gtk_clist_set_compare_func(clist, NULL);
-  gtk_clist_sort(clist);
+  gtk_tree_model_get(model, &iter, KEYLIST_COLUMN_ROW_DATA, &rfp, -1);
+  if (rfp) {
+    keylist_selected(rfp);
+  } else {
+    keylist_all_unselected();
+  }
 }
 
 /* Send an OTR Query Message to attempt to start a connection */
@@ -452,7 +502,7 @@ static void connect_connection_ui(otrng_plugin_conversation *conv) {
   }
 
   otrng_conversation_s *otr_conv =
-      otrng_client_get_conversation(0, conv->peer, client);
+      otrng_plugin_client_get_conversation(0, conv->peer, client);
 
   /* Don't send if we're already ENCRYPTED */
   // TODO: Implement the "Refresh private conversation" behavior
@@ -907,6 +957,8 @@ static void make_fingerprints_ui(GtkWidget *vbox) {
   GtkWidget *table;
   GtkWidget *label;
   char *titles[6];
+  static const gint widths[6] = {90, 90, 60, 30, 950, 200};
+  int i;
 
   titles[0] = _("Screenname");
   titles[1] = _("Status");
@@ -919,17 +971,48 @@ static void make_fingerprints_ui(GtkWidget *vbox) {
   gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(ui_layout.scrollwin),
                                  GTK_POLICY_ALWAYS, GTK_POLICY_ALWAYS);
 
-  ui_layout.keylist = gtk_clist_new_with_titles(6, titles);
-  gtk_clist_set_column_width(GTK_CLIST(ui_layout.keylist), 0, 90);
-  gtk_clist_set_column_width(GTK_CLIST(ui_layout.keylist), 1, 90);
-  gtk_clist_set_column_width(GTK_CLIST(ui_layout.keylist), 2, 60);
-  gtk_clist_set_column_width(GTK_CLIST(ui_layout.keylist), 3, 30);
-  gtk_clist_set_column_width(GTK_CLIST(ui_layout.keylist), 4, 950);
-  gtk_clist_set_column_width(GTK_CLIST(ui_layout.keylist), 5, 200);
-  gtk_clist_set_row_height(GTK_CLIST(ui_layout.keylist), 30);
-  gtk_clist_set_selection_mode(GTK_CLIST(ui_layout.keylist),
-                               GTK_SELECTION_SINGLE);
-  gtk_clist_column_titles_active(GTK_CLIST(ui_layout.keylist));
+  /* Search by username or fingerprint, and filter by account */
+  hbox = gtk_hbox_new(FALSE, 5);
+  gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
+  gtk_box_pack_start(GTK_BOX(hbox), gtk_label_new(_("Search:")), FALSE,
+                     FALSE, 0);
+  ui_layout.search_entry = gtk_entry_new();
+  gtk_box_pack_start(GTK_BOX(hbox), ui_layout.search_entry, TRUE, TRUE, 0);
+  ui_layout.account_filter = gtk_combo_box_new_text();
+  gtk_box_pack_start(GTK_BOX(hbox), ui_layout.account_filter, FALSE, FALSE,
+                     0);
+  ui_layout.filter_accounts = g_ptr_array_new();
+  keylist_fill_account_filter();
+
+  ui_layout.keys = otrng_keylist_new(keylist_row_visible, NULL);
+  ui_layout.keylist = gtk_tree_view_new_with_model(ui_layout.keys->filter);
+
+  for (i = 0; i < KEYLIST_COLUMN_ROW_DATA; i++) {
+    GtkTreeViewColumn *column = gtk_tree_view_column_new();
+    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+
+    gtk_tree_view_column_set_title(column, titles[i]);
+    gtk_tree_view_column_pack_start(column, renderer, TRUE);
+    /* Rows only hold their state: the text is made when a row is drawn,
+     * and the view only draws the rows on screen */
+    gtk_tree_view_column_set_cell_data_func(column, renderer, keylist_cell_data,
+                                            GINT_TO_POINTER(i), NULL);
+
+    /* Fixed sizes let the view skip measuring every row */
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, widths[i]);
+    gtk_tree_view_column_set_resizable(column, TRUE);
+    gtk_tree_view_column_set_clickable(column, TRUE);
+    gtk_tree_view_column_set_sort_indicator(column,
+                                            i == KEYLIST_COLUMN_USERNAME);
+    g_signal_connect(G_OBJECT(column), "clicked",
+                     G_CALLBACK(keylist_column_clicked), GINT_TO_POINTER(i));
+    gtk_tree_view_append_column(GTK_TREE_VIEW(ui_layout.keylist), column);
+  }
+  gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(ui_layout.keylist), TRUE);
+  gtk_tree_selection_set_mode(
+      gtk_tree_view_get_selection(GTK_TREE_VIEW(ui_layout.keylist)),
+      GTK_SELECTION_SINGLE);
 
   gtk_container_add(GTK_CONTAINER(ui_layout.scrollwin), ui_layout.keylist);
   gtk_box_pack_start(GTK_BOX(vbox), ui_layout.scrollwin, TRUE, TRUE, 0);
@@ -982,19 +1065,17 @@ static void make_fingerprints_ui(GtkWidget *vbox) {
   gtk_signal_connect(GTK_OBJECT(vbox), "destroy", GTK_SIGNAL_FUNC(ui_destroyed),
                      NULL);
 
+  g_signal_connect(G_OBJECT(ui_layout.search_entry), "changed",
+                   G_CALLBACK(keylist_search_changed), NULL);
+  g_signal_connect(G_OBJECT(ui_layout.account_filter), "changed",
+                   G_CALLBACK(keylist_account_filter_changed), NULL);
+
   /* Handle selections and deselections */
-  gtk_signal_connect(GTK_OBJECT(ui_layout.keylist), "select_row",
-                     GTK_SIGNAL_FUNC(clist_selected), NULL);
-  gtk_signal_connect(GTK_OBJECT(ui_layout.keylist), "unselect_row",
-                     GTK_SIGNAL_FUNC(clist_unselected), NULL);
-
-  /* Handle column sorting */
-  gtk_signal_connect(GTK_OBJECT(ui_layout.keylist), "click-column",
-                     GTK_SIGNAL_FUNC(clist_click_column), NULL);
-  ui_layout.sortcol = 0;
-  ui_layout.sortdir = 1;
-
-  clist_all_unselected();
+  g_signal_connect(
+      G_OBJECT(gtk_tree_view_get_selection(GTK_TREE_VIEW(ui_layout.keylist))),
+      "changed", G_CALLBACK(keylist_selection_changed), NULL);
+
+  keylist_all_unselected();
 }
 
 /* Construct the OTR UI widget */
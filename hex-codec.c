@@ -0,0 +1,83 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "hex-codec.h"
+
+/* Value of every hex digit plus one, so that the zero filled entries mark
+ * everything else, the NUL terminator included */
+static const uint8_t hex_values[256] = {
+    ['0'] = 1,   ['1'] = 2,   ['2'] = 3,   ['3'] = 4,   ['4'] = 5,
+    ['5'] = 6,   ['6'] = 7,   ['7'] = 8,   ['8'] = 9,   ['9'] = 10,
+    ['a'] = 11,  ['b'] = 12,  ['c'] = 13,  ['d'] = 14,  ['e'] = 15,
+    ['f'] = 16,  ['A'] = 11,  ['B'] = 12,  ['C'] = 13,  ['D'] = 14,
+    ['E'] = 15,  ['F'] = 16};
+
+static const char hex_lower[16] = "0123456789abcdef";
+static const char hex_upper[16] = "0123456789ABCDEF";
+
+gboolean otrng_plugin_hex_decode(const char *hex, size_t len, uint8_t *out) {
+  const unsigned char *in = (const unsigned char *)hex;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    uint8_t high = hex_values[in[2 * i]];
+    uint8_t low;
+
+    /* Checked before reading on, so a short string is never overrun */
+    if (!high) {
+      return FALSE;
+    }
+    low = hex_values[in[2 * i + 1]];
+    if (!low) {
+      return FALSE;
+    }
+
+    out[i] = (uint8_t)(((high - 1) << 4) | (low - 1));
+  }
+
+  return TRUE;
+}
+
+void otrng_plugin_hex_encode(const uint8_t *in, size_t len, char *out) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    out[2 * i] = hex_lower[in[i] >> 4];
+    out[2 * i + 1] = hex_lower[in[i] & 0x0f];
+  }
+  out[2 * len] = '\0';
+}
+
+void otrng_plugin_fingerprint_to_human(char *human, const uint8_t *fp,
+                                       size_t len) {
+  char *p = human;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (i > 0 && i % 4 == 0) {
+      *p++ = ' ';
+    }
+    *p++ = hex_upper[fp[i] >> 4];
+    *p++ = hex_upper[fp[i] & 0x0f];
+  }
+  *p = '\0';
+}
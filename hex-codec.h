@@ -0,0 +1,52 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef OTRNG_PIDGIN_HEX_CODEC
+#define OTRNG_PIDGIN_HEX_CODEC
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+/* Length of the buffer otrng_plugin_fingerprint_to_human needs for a
+ * fingerprint of len bytes: two digits per byte, a space between groups of
+ * four bytes and the terminating NUL */
+#define OTRNG_PLUGIN_HUMAN_LEN(len) ((len)*2 + ((len) + 3) / 4)
+
+/* Decodes the first 2 * len characters of hex into len bytes at out, through
+ * a lookup table. Both cases are accepted. Returns FALSE as soon as anything
+ * but a hex digit is found, including the end of the string, in which case
+ * the contents of out are undefined. */
+gboolean otrng_plugin_hex_decode(const char *hex, size_t len, uint8_t *out);
+
+/* Encodes len bytes as 2 * len lowercase hex digits at out, followed by a
+ * NUL. out must hold 2 * len + 1 characters. */
+void otrng_plugin_hex_encode(const uint8_t *in, size_t len, char *out);
+
+/* Formats a fingerprint like otrng_fingerprint_hash_to_human does: upper
+ * case digits, in groups of four bytes separated by spaces. human must hold
+ * OTRNG_PLUGIN_HUMAN_LEN(len) characters. */
+void otrng_plugin_fingerprint_to_human(char *human, const uint8_t *fp,
+                                       size_t len);
+
+#endif // OTRNG_PIDGIN_HEX_CODEC
@@ -21,12 +21,23 @@
  */
 
 #include <account.h>
+#include <util.h>
+
+#include <glib.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include <libotr/privkey.h>
 
 #include "long_term_keys.h"
 
 #include <libotr-ng/client.h>
+#include <libotr-ng/keys.h>
 #include <libotr-ng/messaging.h>
 
+#include "dialogs.h"
 #include "gtk-dialog.h"
 #include "persistance.h"
 #include "pidgin-helpers.h"
@@ -34,48 +45,435 @@
 
 extern otrng_global_state_s *otrng_state;
 
-/* Generate a private key for the given accountname/protocol */
-void long_term_keys_create_privkey_v4(otrng_client_s *client) {
-  PurpleAccount *account = client_id_to_purple_account(client->client_id);
-  if (otrng_succeeded(otrng_global_state_generate_private_key(
-          otrng_state, purple_account_to_client_id(account)))) {
+/* Keys asked for from the UI are generated on a pool of worker threads, so
+ * that neither the UI nor other accounts have to wait for them. The workers
+ * only compute the key material; libotr-ng state is touched on the main
+ * thread alone, when the results are picked up from an idle callback.
+ *
+ * libotr-ng itself asks for a missing key from its key getters and uses the
+ * key right after, so its callbacks generate the key before returning. If the
+ * same key is already on the pool, they take the job over, or wait for it. */
+
+typedef enum {
+  KEYGEN_PRIVKEY_V4,
+  KEYGEN_FORGING_KEY,
+  KEYGEN_PRIVKEY_V3,
+  KEYGEN_KINDS
+} keygen_kind;
+
+typedef enum {
+  KEYGEN_QUEUED,
+  KEYGEN_RUNNING,
+  KEYGEN_DONE,
+  /* Installed by a libotr-ng callback, the worker only hands it back */
+  KEYGEN_TAKEN
+} keygen_state;
+
+typedef struct {
+  keygen_kind kind;
+  keygen_state state;
+  otrng_client_s *client;
+  OtrgDialogWaitHandle wait;
+  uint8_t sym[ED448_PRIVATE_BYTES];
+  otrng_keypair_s *forging;
+  void *newkey_v3;
+  gboolean failed;
+} keygen_job;
+
+static GThreadPool *keygen_pool = NULL;
+/* otrng_client_s * -> keygen_job *[KEYGEN_KINDS] of the jobs on the pool */
+static GHashTable *keygen_pending = NULL;
+static GAsyncQueue *keygen_done = NULL;
+/* Guards the state of the jobs */
+static GMutex keygen_lock;
+static GCond keygen_cond;
+static GMutex keygen_idle_lock;
+static guint keygen_idle_id = 0;
+
+static keygen_job *keygen_job_new(otrng_client_s *client, keygen_kind kind,
+                                  gboolean wait_dialog) {
+  keygen_job *job = g_new0(keygen_job, 1);
+
+  job->kind = kind;
+  job->client = client;
+
+  if (kind == KEYGEN_PRIVKEY_V3 &&
+      otrl_privkey_generate_start(
+          otrng_state->user_state_v3, client->client_id.account,
+          client->client_id.protocol, &job->newkey_v3) != 0) {
+    /* Another generation for this account is already running */
+    g_free(job);
+    return NULL;
+  }
+
+  if (wait_dialog && kind != KEYGEN_FORGING_KEY) {
+    job->wait = otrng_dialog_private_key_wait_start(
+        client->client_id.account, client->client_id.protocol);
+  }
+
+  return job;
+}
+
+static void keygen_job_free(keygen_job *job) {
+  /* The private key was made from these. Written through a volatile pointer,
+   * so that the compiler can not drop the stores before the free. */
+  volatile uint8_t *sym = job->sym;
+  size_t i;
+
+  for (i = 0; i < sizeof(job->sym); i++) {
+    sym[i] = 0;
+  }
+
+  if (job->forging) {
+    otrng_keypair_free(job->forging);
+  }
+
+  if (job->newkey_v3) {
+    otrl_privkey_generate_cancelled(otrng_state->user_state_v3,
+                                    job->newkey_v3);
+  }
+
+  if (job->wait) {
+    otrng_dialog_private_key_wait_done(job->wait);
+  }
+
+  g_free(job);
+}
+
+/* Computes the key material. Runs on a worker thread, or on the main thread
+ * when a libotr-ng callback needs the key right away. */
+static void keygen_compute(keygen_job *job) {
+  switch (job->kind) {
+  case KEYGEN_PRIVKEY_V4:
+    gcry_randomize(job->sym, ED448_PRIVATE_BYTES, GCRY_VERY_STRONG_RANDOM);
+    break;
+  case KEYGEN_FORGING_KEY:
+    gcry_randomize(job->sym, ED448_PRIVATE_BYTES, GCRY_VERY_STRONG_RANDOM);
+    job->forging = otrng_keypair_new();
+    job->failed = !job->forging ||
+                  otrng_failed(otrng_keypair_generate(job->forging, job->sym));
+    break;
+  case KEYGEN_PRIVKEY_V3:
+    job->failed = otrl_privkey_generate_calculate(job->newkey_v3) != 0;
+    break;
+  case KEYGEN_KINDS:
+    break;
+  }
+}
+
+/* libotr writes out every v3 key while finishing a new one, so it is given
+ * the real store, through a temporary file that replaces it once complete */
+static int keygen_finish_v3(keygen_job *job) {
+  gchar *filename, *tmp = NULL;
+  gcry_error_t err;
+  int result;
+  FILE *fp;
+
+  /* The keys on disk have to be in memory, or they would be dropped */
+  persistance_read_store(otrng_state, job->client, PERSISTANCE_PRIVKEY_V3);
+
+  filename = g_build_filename(purple_user_dir(), PRIVKEY_FILE_NAME_V3, NULL);
+  fp = persistance_open_temp(filename, &tmp);
+  if (!fp) {
+    g_free(filename);
+    return -1;
+  }
+
+  err = otrl_privkey_generate_finish_FILEp(otrng_state->user_state_v3,
+                                           job->newkey_v3, fp);
+  job->newkey_v3 = NULL;
+
+  result = persistance_commit_temp(fp, tmp, filename, err != 0);
+  g_free(filename);
+
+  return result;
+}
+
+static void keygen_install(keygen_job *job) {
+  otrng_client_s *client = job->client;
+
+  switch (job->kind) {
+  case KEYGEN_PRIVKEY_V4:
+    if (otrng_succeeded(otrng_global_state_add_private_key_v4(
+            otrng_state, client->client_id, job->sym))) {
+      persistance_mark_dirty(otrng_state, client, PERSISTANCE_PRIVKEY_V4);
+    }
+    break;
+  case KEYGEN_FORGING_KEY:
+    if (otrng_succeeded(otrng_global_state_add_forging_key(
+            otrng_state, client->client_id, &job->forging->pub))) {
+      persistance_mark_dirty(otrng_state, client, PERSISTANCE_FORGING_KEY);
+    }
+    break;
+  case KEYGEN_PRIVKEY_V3:
+    keygen_finish_v3(job);
+    break;
+  case KEYGEN_KINDS:
+    break;
+  }
+}
+
+static keygen_job **keygen_pending_jobs(otrng_client_s *client) {
+  if (!keygen_pending) {
+    return NULL;
+  }
+
+  return g_hash_table_lookup(keygen_pending, client);
+}
+
+/* Installs the key of a finished job, on the main thread. Returns TRUE if
+ * that was the last key the client was waiting for. */
+static gboolean keygen_finish(keygen_job *job) {
+  keygen_job **jobs = keygen_pending_jobs(job->client);
+  int i;
+
+  if (jobs && jobs[job->kind] == job) {
+    jobs[job->kind] = NULL;
+
+    for (i = 0; i < KEYGEN_KINDS; i++) {
+      if (jobs[i]) {
+        break;
+      }
+    }
+    if (i == KEYGEN_KINDS) {
+      g_hash_table_remove(keygen_pending, job->client);
+    }
+  }
+
+  if (job->wait) {
+    otrng_dialog_private_key_wait_done(job->wait);
+    job->wait = NULL;
+  }
+
+  if (job->failed) {
+    return FALSE;
+  }
+
+  keygen_install(job);
+  return keygen_pending_jobs(job->client) == NULL;
+}
+
+/* Continues what was waiting for the key, now that it is there */
+static void keygen_installed(otrng_client_s *client) {
+  otrng_client_ensure_correct_state(client);
+  otrng_ui_update_fingerprint();
+  otrng_dialog_resensitize_all();
+}
+
+/* Installs every key the workers are done with */
+static void keygen_drain(void) {
+  keygen_job *job;
+
+  if (!keygen_done) {
+    return;
+  }
+
+  while ((job = g_async_queue_try_pop(keygen_done))) {
+    otrng_client_s *client = job->client;
+    gboolean complete = FALSE;
+
+    /* A taken job was already installed by the callback */
+    if (job->state != KEYGEN_TAKEN) {
+      complete = keygen_finish(job);
+    }
+    keygen_job_free(job);
+
+    if (complete) {
+      keygen_installed(client);
+    }
+  }
+}
+
+static gboolean keygen_done_cb(gpointer data) {
+  g_mutex_lock(&keygen_idle_lock);
+  keygen_idle_id = 0;
+  g_mutex_unlock(&keygen_idle_lock);
+
+  keygen_drain();
+
+  return FALSE;
+}
+
+/* Runs on a worker thread */
+static void keygen_run(gpointer data, gpointer user_data) {
+  keygen_job *job = data;
+  gboolean taken;
+
+  g_mutex_lock(&keygen_lock);
+  taken = job->state == KEYGEN_TAKEN;
+  if (!taken) {
+    job->state = KEYGEN_RUNNING;
+  }
+  g_mutex_unlock(&keygen_lock);
+
+  if (!taken) {
+    keygen_compute(job);
+
+    g_mutex_lock(&keygen_lock);
+    job->state = KEYGEN_DONE;
+    g_cond_broadcast(&keygen_cond);
+    g_mutex_unlock(&keygen_lock);
+  }
+
+  /* The main thread frees the job once it is queued, so it is not touched
+   * after this */
+  g_async_queue_push(keygen_done, job);
+
+  g_mutex_lock(&keygen_idle_lock);
+  if (!keygen_idle_id) {
+    keygen_idle_id = g_idle_add(keygen_done_cb, NULL);
+  }
+  g_mutex_unlock(&keygen_idle_lock);
+}
+
+static void keygen_start(otrng_client_s *client, keygen_kind kind) {
+  keygen_job **jobs;
+  keygen_job *job;
+
+  if (!keygen_pool) {
+    keygen_pool = g_thread_pool_new(keygen_run, NULL, g_get_num_processors(),
+                                    FALSE, NULL);
+    keygen_pending =
+        g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    keygen_done = g_async_queue_new();
+  }
+
+  jobs = keygen_pending_jobs(client);
+  if (jobs && jobs[kind]) {
+    return;
+  }
+
+  job = keygen_job_new(client, kind, TRUE);
+  if (!job) {
+    return;
+  }
+
+  if (!jobs) {
+    jobs = g_new0(keygen_job *, KEYGEN_KINDS);
+    g_hash_table_insert(keygen_pending, client, jobs);
+  }
+  jobs[kind] = job;
+
+  g_thread_pool_push(keygen_pool, job, NULL);
+}
+
+/* Makes the key for a libotr-ng callback, which uses it right after */
+static void keygen_now(otrng_client_s *client, keygen_kind kind) {
+  keygen_job **jobs = keygen_pending_jobs(client);
+  keygen_job *job = jobs ? jobs[kind] : NULL;
+
+  if (job) {
+    g_mutex_lock(&keygen_lock);
+    if (job->state == KEYGEN_QUEUED) {
+      /* Not started yet: do it here, the worker only hands it back */
+      job->state = KEYGEN_TAKEN;
+      g_mutex_unlock(&keygen_lock);
+
+      keygen_compute(job);
+      if (keygen_finish(job)) {
+        otrng_ui_update_fingerprint();
+      }
+      return;
+    }
+
+    while (job->state != KEYGEN_DONE) {
+      g_cond_wait(&keygen_cond, &keygen_lock);
+    }
+    /* The worker may not have queued it yet, so it is installed here and
+     * only freed once it comes out of the queue */
+    job->state = KEYGEN_TAKEN;
+    g_mutex_unlock(&keygen_lock);
+
+    if (keygen_finish(job)) {
+      otrng_ui_update_fingerprint();
+    }
+    return;
+  }
+
+  job = keygen_job_new(client, kind, FALSE);
+  if (!job) {
+    return;
+  }
+
+  keygen_compute(job);
+  if (keygen_finish(job)) {
     otrng_ui_update_fingerprint();
   }
+  keygen_job_free(job);
+}
+
+void long_term_keys_generate(otrng_client_s *client) {
+  if (!client) {
+    return;
+  }
+
+  keygen_start(client, KEYGEN_PRIVKEY_V4);
+  keygen_start(client, KEYGEN_PRIVKEY_V3);
+}
+
+void long_term_keys_shutdown(void) {
+  keygen_job *job;
+
+  if (!keygen_pool) {
+    return;
+  }
+
+  /* Let the queued jobs finish, their results are dropped below */
+  g_thread_pool_free(keygen_pool, FALSE, TRUE);
+  keygen_pool = NULL;
+
+  g_mutex_lock(&keygen_idle_lock);
+  if (keygen_idle_id) {
+    g_source_remove(keygen_idle_id);
+    keygen_idle_id = 0;
+  }
+  g_mutex_unlock(&keygen_idle_lock);
+
+  while ((job = g_async_queue_try_pop(keygen_done))) {
+    keygen_job_free(job);
+  }
+
+  g_async_queue_unref(keygen_done);
+  keygen_done = NULL;
+  g_hash_table_destroy(keygen_pending);
+  keygen_pending = NULL;
+}
+
+/* Generate a private key for the given accountname/protocol */
+void long_term_keys_create_privkey_v4(otrng_client_s *client) {
+  keygen_now(client, KEYGEN_PRIVKEY_V4);
 }
 
 static void load_private_key_v4(otrng_client_s *client) {
-  persistance_read_private_keys_v4(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_PRIVKEY_V4);
 }
 
 static void store_private_key_v4(otrng_client_s *client) {
-  persistance_write_privkey_v4_FILEp(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_PRIVKEY_V4);
 }
 
 static void create_forging_key(otrng_client_s *client) {
-  otrng_global_state_generate_forging_key(otrng_state, client->client_id);
+  keygen_now(client, KEYGEN_FORGING_KEY);
 }
 
 static void load_forging_key(struct otrng_client_s *client) {
-  persistance_read_forging_key(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_FORGING_KEY);
 }
 
 static void store_forging_key(struct otrng_client_s *client) {
-  persistance_write_forging_key(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_FORGING_KEY);
 }
 
 void long_term_keys_create_private_key_v3(otrng_client_s *client) {
-  if (otrng_succeeded(otrng_global_state_generate_private_key_v3(
-          otrng_state, client->client_id))) {
-    otrng_ui_update_fingerprint();
-  }
+  keygen_now(client, KEYGEN_PRIVKEY_V3);
 }
 
 static void load_private_key_v3(otrng_client_s *client) {
-  persistance_read_private_keys_v3(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_PRIVKEY_V3);
 }
 
 static void store_private_key_v3(otrng_client_s *client) {
-  persistance_write_private_keys_v3(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_PRIVKEY_V3);
 }
 
 void long_term_keys_set_callbacks(otrng_client_callbacks_s *callbacks) {
@@ -34,4 +34,11 @@ void long_term_keys_set_callbacks(otrng_client_callbacks_s *);
 
 void long_term_keys_create_private_key_v3(otrng_client_s *client);
 
+/* Generates new v4 and v3 private keys for client in the background, showing
+ * a dialog until they are in */
+void long_term_keys_generate(otrng_client_s *client);
+
+/* Waits for the key generations in progress and drops their results */
+void long_term_keys_shutdown(void);
+
 #endif
@@ -508,8 +508,3 @@ static const char finished_png[] =
     "\x91\x4e\xf3\x57\xd5\x02\x54\xa1\xfe\x1d\x7c\xf6\xaf\x48\xff\x00"
     "\x4c\x71\x67\x27\xb5\xdd\x3f\xef\x00\x00\x00\x00\x49\x45\x4e\x44"
     "\xae\x42\x60\x82";
-
-#include "icons/finished.xpm"
-#include "icons/not_private.xpm"
-#include "icons/private.xpm"
-#include "icons/unverified.xpm"
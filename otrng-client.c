@@ -24,8 +24,13 @@
 
 #include <libotr-ng/client.h>
 
+#include "hex-codec.h"
 #include "otrng-client.h"
 
+/* Fingerprints are formatted into buffers sized for libotr-ng's own format */
+G_STATIC_ASSERT(OTRNG_PLUGIN_HUMAN_LEN(OTRNG_FPRINT_LEN_BYTES) <=
+                OTRNG_FPRINT_HUMAN_LEN);
+
 char *otrv4_client_adapter_privkey_fingerprint(const otrng_client_s *client) {
   char *ret = NULL;
 
@@ -39,6 +44,6 @@ char *otrv4_client_adapter_privkey_fingerprint(const otrng_client_s *client) {
     return NULL;
   }
 
-  otrng_fingerprint_hash_to_human(ret, our_fp, sizeof(our_fp));
+  otrng_plugin_fingerprint_to_human(ret, our_fp, sizeof(our_fp));
   return ret;
 }
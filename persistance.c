@@ -22,9 +22,19 @@
 
 #include <stdlib.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* WIN32 */
+
 #include <glib.h>
 #include <glib/gstdio.h>
 
+/* purple headers */
+#include <eventloop.h>
+#include <prefs.h>
+#include <util.h>
+
 #include <libotr-ng/messaging.h>
 
 #include "persistance.h"
@@ -40,7 +50,13 @@
 #define N_(x) (x)
 #endif
 
-static FILE *open_file_write_mode(gchar *filename) {
+static persistance_sync_policy sync_policy = PERSISTANCE_SYNC_FSYNC;
+
+void persistance_set_sync_policy(persistance_sync_policy policy) {
+  sync_policy = policy;
+}
+
+static FILE *open_private_file(gchar *filename, const char *mode) {
   FILE *f;
 #ifndef WIN32
   mode_t mask;
@@ -50,7 +66,7 @@ static FILE *open_file_write_mode(gchar *filename) {
   mask = umask(0077);
 #endif /* WIN32 */
 
-  f = g_fopen(filename, "w+b");
+  f = g_fopen(filename, mode);
 
 #ifndef WIN32
   umask(mask);
@@ -59,9 +75,112 @@ static FILE *open_file_write_mode(gchar *filename) {
   return f;
 }
 
-#define PERSISTANCE_READ(filename, fn)                                         \
+/* Pushes the contents of fp down to the disk, according to the configured
+ * sync policy. */
+static int sync_file(FILE *fp) {
+  if (fflush(fp) != 0) {
+    return -1;
+  }
+
+#ifndef WIN32
+  switch (sync_policy) {
+  case PERSISTANCE_SYNC_NONE:
+    break;
+  case PERSISTANCE_SYNC_DATA:
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+    if (fdatasync(fileno(fp)) != 0) {
+      return -1;
+    }
+    break;
+#endif
+    /* fall through when fdatasync is not available */
+  case PERSISTANCE_SYNC_FSYNC:
+    if (fsync(fileno(fp)) != 0) {
+      return -1;
+    }
+    break;
+  }
+#endif /* WIN32 */
+
+  return 0;
+}
+
+/* Makes the rename itself durable by syncing the containing directory. */
+static void sync_parent_directory(const gchar *filename) {
+#ifndef WIN32
+  gchar *dir;
+  int fd;
+
+  if (sync_policy != PERSISTANCE_SYNC_FSYNC) {
+    return;
+  }
+
+  dir = g_path_get_dirname(filename);
+  fd = open(dir, O_RDONLY);
+  g_free(dir);
+
+  if (fd < 0) {
+    return;
+  }
+
+  fsync(fd);
+  close(fd);
+#endif /* WIN32 */
+}
+
+FILE *persistance_open_temp(const gchar *filename, gchar **tmp_filename) {
+  FILE *fp;
+  gchar *tmp = g_strconcat(filename, ".tmp", NULL);
+
+  fp = open_private_file(tmp, "w+b");
+  if (!fp) {
+    g_free(tmp);
+    *tmp_filename = NULL;
+    return NULL;
+  }
+
+  *tmp_filename = tmp;
+  return fp;
+}
+
+int persistance_commit_temp(FILE *fp, gchar *tmp_filename,
+                            const gchar *filename, int failed) {
+  int err = failed ? -1 : 0;
+
+  if (!err && sync_file(fp) != 0) {
+    err = -1;
+  }
+
+  if (fclose(fp) != 0) {
+    err = -1;
+  }
+
+  if (err) {
+    /* Leave the previous version of the store untouched */
+    g_unlink(tmp_filename);
+    g_free(tmp_filename);
+    return err;
+  }
+
+#ifdef WIN32
+  /* rename() does not replace existing files on Windows */
+  g_unlink(filename);
+#endif /* WIN32 */
+
+  if (g_rename(tmp_filename, filename) != 0) {
+    g_unlink(tmp_filename);
+    err = -1;
+  } else {
+    sync_parent_directory(filename);
+  }
+
+  g_free(tmp_filename);
+  return err;
+}
+
+#define PERSISTANCE_READ_FROM(path, fn)                                        \
   do {                                                                         \
-    gchar *f = g_build_filename(purple_user_dir(), filename, NULL);            \
+    gchar *f = path;                                                           \
     if (!f) {                                                                  \
       return;                                                                  \
     }                                                                          \
@@ -75,28 +194,69 @@ static FILE *open_file_write_mode(gchar *filename) {
     }                                                                          \
   } while (0);
 
-#define PERSISTANCE_WRITE(filename, fn)                                        \
+#define PERSISTANCE_WRITE_TO(path, write_call)                                 \
   do {                                                                         \
     FILE *fp;                                                                  \
+    gchar *tmp = NULL;                                                         \
     int err = 0;                                                               \
-    gchar *f = g_build_filename(purple_user_dir(), filename, NULL);            \
+    gchar *f = path;                                                           \
     if (!f) {                                                                  \
       return -1;                                                               \
     }                                                                          \
                                                                                \
-    fp = open_file_write_mode(f);                                              \
-    g_free(f);                                                                 \
-                                                                               \
-    if (otrng_failed(fn(otrng_state, fp))) {                                   \
-      err = -1;                                                                \
-    }                                                                          \
-    if (fp) {                                                                  \
-      fclose(fp);                                                              \
+    fp = persistance_open_temp(f, &tmp);                                       \
+    if (!fp) {                                                                 \
+      g_free(f);                                                               \
+      return -1;                                                               \
     }                                                                          \
                                                                                \
+    err = persistance_commit_temp(fp, tmp, f, otrng_failed(write_call));       \
+    g_free(f);                                                                 \
+                                                                               \
     return err;                                                                \
   } while (0);
 
+#define PERSISTANCE_READ(filename, fn)                                         \
+  PERSISTANCE_READ_FROM(g_build_filename(purple_user_dir(), filename, NULL), fn)
+
+#define PERSISTANCE_WRITE(filename, fn)                                        \
+  PERSISTANCE_WRITE_TO(g_build_filename(purple_user_dir(), filename, NULL),    \
+                       fn(otrng_state, fp))
+
+/* The shards use the same format as the single files, they just contain one
+ * account each, so they can be read back with the global readers. */
+#define PERSISTANCE_READ_SHARD(filename, fn)                                   \
+  PERSISTANCE_READ_FROM(shard_filename(client, filename, FALSE), fn)
+
+#define PERSISTANCE_WRITE_SHARD(filename, fn)                                  \
+  PERSISTANCE_WRITE_TO(shard_filename(client, filename, TRUE), fn(client, fp))
+
+/* Returns the path of the given store for a client, under
+ * purple_user_dir()/otr4/<protocol>/<account>/ */
+static gchar *shard_filename(const otrng_client_s *client,
+                             const char *filename, gboolean create) {
+  gchar *protocol, *account, *dir;
+  gchar *result = NULL;
+
+  /* purple_escape_filename returns a static buffer */
+  protocol = g_strdup(purple_escape_filename(client->client_id.protocol));
+  account = g_strdup(purple_escape_filename(client->client_id.account));
+  dir = g_build_filename(purple_user_dir(), PERSISTANCE_SHARD_DIR_NAME,
+                         protocol, account, NULL);
+  g_free(protocol);
+  g_free(account);
+
+  if (create && g_mkdir_with_parents(dir, 0700) != 0) {
+    g_free(dir);
+    return NULL;
+  }
+
+  result = g_build_filename(dir, filename, NULL);
+  g_free(dir);
+
+  return result;
+}
+
 int persistance_write_privkey_v4_FILEp(otrng_global_state_s *otrng_state) {
   PERSISTANCE_WRITE(PRIVKEY_FILE_NAME_V4,
                     otrng_global_state_private_key_v4_write_to);
@@ -199,3 +359,758 @@ void persistance_read_fingerprints_v3(otrng_global_state_s *otrng_state) {
   PERSISTANCE_READ(FINGERPRINT_STORE_FILE_NAME_V3,
                    otrng_global_state_fingerprints_v3_read_from);
 }
+
+static void read_privkey_v4_shard(otrng_global_state_s *otrng_state,
+                                  otrng_client_s *client) {
+  PERSISTANCE_READ_SHARD(PRIVKEY_FILE_NAME_V4,
+                         otrng_global_state_private_key_v4_read_from);
+}
+
+static int write_privkey_v4_shard(otrng_global_state_s *otrng_state,
+                                  otrng_client_s *client) {
+  PERSISTANCE_WRITE_SHARD(PRIVKEY_FILE_NAME_V4,
+                          otrng_client_private_key_v4_write_to);
+}
+
+static void read_client_profile_shard(otrng_global_state_s *otrng_state,
+                                      otrng_client_s *client) {
+  PERSISTANCE_READ_SHARD(CLIENT_PROFILE_FILE_NAME,
+                         otrng_global_state_client_profile_read_from);
+}
+
+static int write_client_profile_shard(otrng_global_state_s *otrng_state,
+                                      otrng_client_s *client) {
+  PERSISTANCE_WRITE_SHARD(CLIENT_PROFILE_FILE_NAME,
+                          otrng_client_client_profile_write_to);
+}
+
+static void read_prekey_profile_shard(otrng_global_state_s *otrng_state,
+                                      otrng_client_s *client) {
+  PERSISTANCE_READ_SHARD(PREKEY_PROFILE_FILE_NAME,
+                         otrng_global_state_prekey_profile_read_from);
+}
+
+static int write_prekey_profile_shard(otrng_global_state_s *otrng_state,
+                                      otrng_client_s *client) {
+  PERSISTANCE_WRITE_SHARD(PREKEY_PROFILE_FILE_NAME,
+                          otrng_client_prekey_profile_write_to);
+}
+
+static void read_prekey_messages_shard(otrng_global_state_s *otrng_state,
+                                       otrng_client_s *client) {
+  PERSISTANCE_READ_SHARD(PREKEYS_FILE_NAME,
+                         otrng_global_state_prekeys_read_from);
+}
+
+static int write_prekey_messages_shard(otrng_global_state_s *otrng_state,
+                                       otrng_client_s *client) {
+  PERSISTANCE_WRITE_SHARD(PREKEYS_FILE_NAME,
+                          otrng_client_prekey_messages_write_to);
+}
+
+static void read_forging_key_shard(otrng_global_state_s *otrng_state,
+                                   otrng_client_s *client) {
+  PERSISTANCE_READ_SHARD(FORGING_KEY_FILE_NAME,
+                         otrng_global_state_forging_key_read_from);
+}
+
+static int write_forging_key_shard(otrng_global_state_s *otrng_state,
+                                   otrng_client_s *client) {
+  PERSISTANCE_WRITE_SHARD(FORGING_KEY_FILE_NAME,
+                          otrng_client_forging_key_write_to);
+}
+
+static void
+read_expired_client_profile_shard(otrng_global_state_s *otrng_state,
+                                  otrng_client_s *client) {
+  PERSISTANCE_READ_SHARD(EXP_CLIENT_PROFILE_FILE_NAME,
+                         otrng_global_state_expired_client_profile_read_from);
+}
+
+static int
+write_expired_client_profile_shard(otrng_global_state_s *otrng_state,
+                                   otrng_client_s *client) {
+  PERSISTANCE_WRITE_SHARD(EXP_CLIENT_PROFILE_FILE_NAME,
+                          otrng_client_expired_client_profile_write_to);
+}
+
+static void
+read_expired_prekey_profile_shard(otrng_global_state_s *otrng_state,
+                                  otrng_client_s *client) {
+  PERSISTANCE_READ_SHARD(EXP_PREKEY_PROFILE_FILE_NAME,
+                         otrng_global_state_expired_prekey_profile_read_from);
+}
+
+static int
+write_expired_prekey_profile_shard(otrng_global_state_s *otrng_state,
+                                   otrng_client_s *client) {
+  PERSISTANCE_WRITE_SHARD(EXP_PREKEY_PROFILE_FILE_NAME,
+                          otrng_client_expired_prekey_profile_write_to);
+}
+
+static void read_fingerprints_v4_shard(otrng_global_state_s *otrng_state,
+                                       otrng_client_s *client) {
+  PERSISTANCE_READ_SHARD(FINGERPRINT_STORE_FILE_NAME_V4,
+                         otrng_global_state_fingerprints_v4_read_from);
+}
+
+static int write_fingerprints_v4_shard(otrng_global_state_s *otrng_state,
+                                       otrng_client_s *client) {
+  PERSISTANCE_WRITE_SHARD(FINGERPRINT_STORE_FILE_NAME_V4,
+                          otrng_client_fingerprints_v4_write_to);
+}
+
+typedef struct {
+  const char *filename;
+  int (*write)(otrng_global_state_s *otrng_state);
+  void (*read)(otrng_global_state_s *otrng_state);
+  /* NULL for the stores that can only be kept in a single file */
+  int (*write_shard)(otrng_global_state_s *otrng_state,
+                     otrng_client_s *client);
+  void (*read_shard)(otrng_global_state_s *otrng_state,
+                     otrng_client_s *client);
+} persistance_store_ops;
+
+/* The v3 stores are serialized by libotr, which only knows about a single
+ * file for every account, so they are never sharded. */
+static const persistance_store_ops store_ops[PERSISTANCE_STORE_COUNT] = {
+    [PERSISTANCE_PRIVKEY_V4] = {PRIVKEY_FILE_NAME_V4,
+                                persistance_write_privkey_v4_FILEp,
+                                persistance_read_private_keys_v4,
+                                write_privkey_v4_shard, read_privkey_v4_shard},
+    [PERSISTANCE_PRIVKEY_V3] = {PRIVKEY_FILE_NAME_V3,
+                                persistance_write_private_keys_v3,
+                                persistance_read_private_keys_v3, NULL, NULL},
+    [PERSISTANCE_CLIENT_PROFILE] = {CLIENT_PROFILE_FILE_NAME,
+                                    persistance_write_client_profile_FILEp,
+                                    persistance_read_client_profile,
+                                    write_client_profile_shard,
+                                    read_client_profile_shard},
+    [PERSISTANCE_PREKEY_PROFILE] = {PREKEY_PROFILE_FILE_NAME,
+                                    persistance_write_prekey_profile_FILEp,
+                                    persistance_read_prekey_profile,
+                                    write_prekey_profile_shard,
+                                    read_prekey_profile_shard},
+    [PERSISTANCE_PREKEY_MESSAGES] = {PREKEYS_FILE_NAME,
+                                     persistance_write_prekey_messages,
+                                     persistance_read_prekey_messages,
+                                     write_prekey_messages_shard,
+                                     read_prekey_messages_shard},
+    [PERSISTANCE_FORGING_KEY] = {FORGING_KEY_FILE_NAME,
+                                 persistance_write_forging_key,
+                                 persistance_read_forging_key,
+                                 write_forging_key_shard,
+                                 read_forging_key_shard},
+    [PERSISTANCE_EXP_CLIENT_PROFILE] =
+        {EXP_CLIENT_PROFILE_FILE_NAME, persistance_write_expired_client_profile,
+         persistance_read_expired_client_profile,
+         write_expired_client_profile_shard, read_expired_client_profile_shard},
+    [PERSISTANCE_EXP_PREKEY_PROFILE] =
+        {EXP_PREKEY_PROFILE_FILE_NAME, persistance_write_expired_prekey_profile,
+         persistance_read_expired_prekey_profile,
+         write_expired_prekey_profile_shard, read_expired_prekey_profile_shard},
+    [PERSISTANCE_FINGERPRINTS_V4] = {FINGERPRINT_STORE_FILE_NAME_V4,
+                                     persistance_write_fingerprints_v4,
+                                     persistance_read_fingerprints_v4,
+                                     write_fingerprints_v4_shard,
+                                     read_fingerprints_v4_shard},
+    [PERSISTANCE_FINGERPRINTS_V3] = {FINGERPRINT_STORE_FILE_NAME_V3,
+                                     persistance_write_fingerprints_v3,
+                                     persistance_read_fingerprints_v3, NULL,
+                                     NULL},
+};
+
+static otrng_global_state_s *scheduled_state = NULL;
+/* Stores that have to be written out completely */
+static gboolean dirty_stores[PERSISTANCE_STORE_COUNT];
+/* otrng_client_s * -> bitmask of stores with a dirty shard for that client */
+static GHashTable *dirty_shards = NULL;
+/* otrng_client_s * -> bitmask of stores whose shard has already been read */
+static GHashTable *loaded_shards = NULL;
+static persistance_stats_s store_stats[PERSISTANCE_STORE_COUNT];
+static guint flush_timer = 0;
+static guint debounce_ms = PERSISTANCE_DEFAULT_DEBOUNCE_MS;
+static gboolean scheduler_running = FALSE;
+static gboolean sharded = FALSE;
+static gboolean lazy = FALSE;
+/* Set from the start of the scheduler until persistance_startup_done() */
+static gboolean starting_up = FALSE;
+/* Clients whose stores were loaded, in lazy mode */
+static GHashTable *touched_clients = NULL;
+/* Stores asked for during startup, per client, in lazy mode */
+static GHashTable *pending_loads = NULL;
+/* Single file stores that were read already, in lazy mode */
+static guint global_loaded = 0;
+static persistance_journal_handler journal_handler = NULL;
+/* Journal records appended or replayed since the last snapshot */
+static unsigned long journal_records = 0;
+
+#define STORE_BIT(store) (1u << (store))
+
+/* The stores whose reads can be put off during startup. libotr-ng takes a
+ * missing key or profile as one that was never made and creates a new one,
+ * so those are always read as soon as they are asked for. */
+#define DEFERRABLE_STORES                                                      \
+  (STORE_BIT(PERSISTANCE_PREKEY_MESSAGES) |                                    \
+   STORE_BIT(PERSISTANCE_FINGERPRINTS_V4) |                                    \
+   STORE_BIT(PERSISTANCE_FINGERPRINTS_V3))
+
+static guint persistance_debounce_pref(void) {
+  if (!purple_prefs_exists("/OTR")) {
+    purple_prefs_add_none("/OTR");
+  }
+
+  if (!purple_prefs_exists("/OTR/persistance_debounce_ms")) {
+    purple_prefs_add_int("/OTR/persistance_debounce_ms",
+                         PERSISTANCE_DEFAULT_DEBOUNCE_MS);
+    return PERSISTANCE_DEFAULT_DEBOUNCE_MS;
+  }
+
+  int value = purple_prefs_get_int("/OTR/persistance_debounce_ms");
+  if (value < 0) {
+    return PERSISTANCE_DEFAULT_DEBOUNCE_MS;
+  }
+
+  return value;
+}
+
+static persistance_sync_policy persistance_sync_pref(void) {
+  if (!purple_prefs_exists("/OTR/persistance_sync")) {
+    purple_prefs_add_int("/OTR/persistance_sync", PERSISTANCE_SYNC_FSYNC);
+    return PERSISTANCE_SYNC_FSYNC;
+  }
+
+  switch (purple_prefs_get_int("/OTR/persistance_sync")) {
+  case PERSISTANCE_SYNC_NONE:
+    return PERSISTANCE_SYNC_NONE;
+  case PERSISTANCE_SYNC_DATA:
+    return PERSISTANCE_SYNC_DATA;
+  default:
+    return PERSISTANCE_SYNC_FSYNC;
+  }
+}
+
+static gboolean persistance_sharded_pref(void) {
+  if (!purple_prefs_exists("/OTR/sharded_stores")) {
+    purple_prefs_add_bool("/OTR/sharded_stores", FALSE);
+    return FALSE;
+  }
+
+  return purple_prefs_get_bool("/OTR/sharded_stores");
+}
+
+static gboolean persistance_lazy_pref(void) {
+  if (!purple_prefs_exists("/OTR/lazy_load")) {
+    purple_prefs_add_bool("/OTR/lazy_load", TRUE);
+    return TRUE;
+  }
+
+  return purple_prefs_get_bool("/OTR/lazy_load");
+}
+
+static gboolean is_sharded(persistance_store store) {
+  return sharded && store_ops[store].write_shard != NULL;
+}
+
+static guint shard_mask(GHashTable *table, const otrng_client_s *client) {
+  if (!table) {
+    return 0;
+  }
+
+  return GPOINTER_TO_UINT(g_hash_table_lookup(table, client));
+}
+
+static void set_shard_bit(GHashTable *table, otrng_client_s *client,
+                          persistance_store store) {
+  guint mask = shard_mask(table, client) | STORE_BIT(store);
+  g_hash_table_insert(table, client, GUINT_TO_POINTER(mask));
+}
+
+static gchar *journal_filename(otrng_client_s *client, gboolean create) {
+  if (client && is_sharded(PERSISTANCE_FINGERPRINTS_V4)) {
+    return shard_filename(client, FINGERPRINT_JOURNAL_FILE_NAME_V4, create);
+  }
+
+  return g_build_filename(purple_user_dir(), FINGERPRINT_JOURNAL_FILE_NAME_V4,
+                          NULL);
+}
+
+/* Called once a snapshot containing every journaled change has been
+ * written */
+static void truncate_journal(otrng_client_s *client) {
+  gchar *f = journal_filename(client, FALSE);
+  if (f) {
+    g_unlink(f);
+    g_free(f);
+  }
+}
+
+static int write_shard(otrng_global_state_s *otrng_state,
+                       otrng_client_s *client, persistance_store store) {
+  if (store_ops[store].write_shard(otrng_state, client) != 0) {
+    return -1;
+  }
+
+  if (store == PERSISTANCE_FINGERPRINTS_V4) {
+    truncate_journal(client);
+  }
+
+  return 0;
+}
+
+/* Shards that were never read have not changed in memory either, so they are
+ * left alone instead of being clobbered. */
+static int write_all_shards(otrng_global_state_s *otrng_state,
+                            persistance_store store) {
+  list_element_s *el;
+  int err = 0;
+
+  for (el = otrng_state->clients; el; el = el->next) {
+    if (!el->data ||
+        !(shard_mask(loaded_shards, el->data) & STORE_BIT(store))) {
+      continue;
+    }
+
+    if (write_shard(otrng_state, el->data, store) != 0) {
+      err = -1;
+    }
+  }
+
+  return err;
+}
+
+static void read_store_now(otrng_global_state_s *otrng_state,
+                           otrng_client_s *client, persistance_store store);
+
+/* Writes the store out right now. In sharded mode a NULL client means all of
+ * the shards of the store. */
+static int write_store(otrng_global_state_s *otrng_state,
+                       otrng_client_s *client, persistance_store store) {
+  int err;
+
+  store_stats[store].written++;
+
+  /* A store that was never read would be written back without the entries
+   * that are still only on disk */
+  if (lazy && !is_sharded(store)) {
+    read_store_now(otrng_state, NULL, store);
+  } else if (client && is_sharded(store)) {
+    read_store_now(otrng_state, client, store);
+  }
+
+  if (!is_sharded(store)) {
+    err = store_ops[store].write(otrng_state);
+    if (!err && store == PERSISTANCE_FINGERPRINTS_V4) {
+      truncate_journal(NULL);
+      journal_records = 0;
+    }
+    return err;
+  }
+
+  if (client) {
+    return write_shard(otrng_state, client, store);
+  }
+
+  err = write_all_shards(otrng_state, store);
+  if (!err && store == PERSISTANCE_FINGERPRINTS_V4) {
+    journal_records = 0;
+  }
+
+  return err;
+}
+
+static gboolean flush_timer_fired_cb(gpointer data);
+
+int persistance_flush(void) {
+  gboolean written[PERSISTANCE_STORE_COUNT] = {FALSE};
+  GHashTableIter iter;
+  gpointer key, value;
+  int err = 0;
+  int i;
+
+  if (flush_timer) {
+    purple_timeout_remove(flush_timer);
+    flush_timer = 0;
+  }
+
+  if (!scheduled_state) {
+    return 0;
+  }
+
+  for (i = 0; i < PERSISTANCE_STORE_COUNT; i++) {
+    if (!dirty_stores[i]) {
+      continue;
+    }
+
+    /* Cleared first so that changes made while writing are not lost, and
+     * set again if the write failed, so that it is retried */
+    dirty_stores[i] = FALSE;
+    written[i] = TRUE;
+
+    if (write_store(scheduled_state, NULL, i) != 0) {
+      dirty_stores[i] = TRUE;
+      err = -1;
+    }
+
+    otrng_debug_fprintf(stderr,
+                        "persistance: store %d written (%lu requested, %lu "
+                        "written, %lu coalesced)\n",
+                        i, store_stats[i].requested, store_stats[i].written,
+                        store_stats[i].coalesced);
+  }
+
+  if (dirty_shards) {
+    g_hash_table_iter_init(&iter, dirty_shards);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      guint mask = GPOINTER_TO_UINT(value);
+      guint failed = 0;
+
+      for (i = 0; i < PERSISTANCE_STORE_COUNT; i++) {
+        /* Already covered by writing out every shard above */
+        if (!(mask & STORE_BIT(i)) || written[i]) {
+          continue;
+        }
+
+        if (write_store(scheduled_state, key, i) != 0) {
+          failed |= STORE_BIT(i);
+          err = -1;
+        }
+      }
+
+      /* Failed shards stay dirty */
+      if (failed) {
+        g_hash_table_iter_replace(&iter, GUINT_TO_POINTER(failed));
+      } else {
+        g_hash_table_iter_remove(&iter);
+      }
+    }
+  }
+
+  if (err && scheduler_running && !flush_timer) {
+    flush_timer = purple_timeout_add(debounce_ms, flush_timer_fired_cb, NULL);
+  }
+
+  return err;
+}
+
+/* Called by the glib main loop once the debounce window has passed */
+static gboolean flush_timer_fired_cb(gpointer data) {
+  (void)data;
+  flush_timer = 0;
+  persistance_flush();
+  return FALSE;
+}
+
+void persistance_mark_dirty(otrng_global_state_s *otrng_state,
+                            otrng_client_s *client, persistance_store store) {
+  if (store >= PERSISTANCE_STORE_COUNT) {
+    return;
+  }
+
+  store_stats[store].requested++;
+
+  if (!scheduler_running || debounce_ms == 0) {
+    write_store(otrng_state, client, store);
+    return;
+  }
+
+  scheduled_state = otrng_state;
+
+  if (dirty_stores[store] ||
+      (client && is_sharded(store) &&
+       shard_mask(dirty_shards, client) & STORE_BIT(store))) {
+    store_stats[store].coalesced++;
+    return;
+  }
+
+  if (client && is_sharded(store)) {
+    set_shard_bit(dirty_shards, client, store);
+  } else {
+    dirty_stores[store] = TRUE;
+  }
+
+  if (!flush_timer) {
+    flush_timer = purple_timeout_add(debounce_ms, flush_timer_fired_cb, NULL);
+  }
+}
+
+void persistance_set_journal_handler(persistance_journal_handler handler) {
+  journal_handler = handler;
+}
+
+/* Replays the journal of client, or the single journal when client is NULL or
+ * the stores are not sharded. */
+static void replay_journal(otrng_global_state_s *otrng_state,
+                           otrng_client_s *client) {
+  gchar *contents = NULL;
+  gchar **lines;
+  gchar *f;
+  int i;
+
+  if (!journal_handler) {
+    return;
+  }
+
+  f = client ? journal_filename(client, FALSE)
+             : g_build_filename(purple_user_dir(),
+                                FINGERPRINT_JOURNAL_FILE_NAME_V4, NULL);
+  if (!f) {
+    return;
+  }
+
+  /* The journal is bounded by the compaction threshold */
+  if (!g_file_get_contents(f, &contents, NULL, NULL)) {
+    g_free(f);
+    return;
+  }
+  g_free(f);
+
+  lines = g_strsplit(contents, "\n", -1);
+  g_free(contents);
+
+  for (i = 0; lines[i]; i++) {
+    if (lines[i][0] == '\0') {
+      continue;
+    }
+
+    journal_handler(otrng_state, lines[i]);
+    journal_records++;
+  }
+
+  g_strfreev(lines);
+}
+
+static void read_store_now(otrng_global_state_s *otrng_state,
+                           otrng_client_s *client, persistance_store store) {
+  if (!client || !is_sharded(store)) {
+    /* A single file has the entries of every account, so in lazy mode it is
+     * only parsed once */
+    if (lazy && (global_loaded & STORE_BIT(store))) {
+      return;
+    }
+
+    global_loaded |= STORE_BIT(store);
+    store_stats[store].read++;
+    store_ops[store].read(otrng_state);
+    if (store == PERSISTANCE_FINGERPRINTS_V4) {
+      journal_records = 0;
+      replay_journal(otrng_state, NULL);
+    }
+    return;
+  }
+
+  if (shard_mask(loaded_shards, client) & STORE_BIT(store)) {
+    return;
+  }
+
+  set_shard_bit(loaded_shards, client, store);
+  store_stats[store].read++;
+  store_ops[store].read_shard(otrng_state, client);
+  if (store == PERSISTANCE_FINGERPRINTS_V4) {
+    replay_journal(otrng_state, client);
+  }
+}
+
+void persistance_read_store(otrng_global_state_s *otrng_state,
+                            otrng_client_s *client, persistance_store store) {
+  if (store >= PERSISTANCE_STORE_COUNT) {
+    return;
+  }
+
+  if (lazy && client && touched_clients &&
+      !g_hash_table_contains(touched_clients, client)) {
+    if (starting_up && (STORE_BIT(store) & DEFERRABLE_STORES)) {
+      store_stats[store].deferred++;
+      set_shard_bit(pending_loads, client, store);
+      return;
+    }
+
+    persistance_load_client(otrng_state, client);
+  }
+
+  read_store_now(otrng_state, client, store);
+}
+
+void persistance_load_client(otrng_global_state_s *otrng_state,
+                             otrng_client_s *client) {
+  guint pending = 0;
+  int i;
+
+  if (!client || (!sharded && !lazy)) {
+    return;
+  }
+
+  if (lazy && touched_clients) {
+    if (g_hash_table_contains(touched_clients, client)) {
+      return;
+    }
+
+    g_hash_table_add(touched_clients, client);
+    pending = shard_mask(pending_loads, client);
+    g_hash_table_remove(pending_loads, client);
+  }
+
+  for (i = 0; i < PERSISTANCE_STORE_COUNT; i++) {
+    if (is_sharded(i) || (pending & STORE_BIT(i))) {
+      read_store_now(otrng_state, client, i);
+    }
+  }
+}
+
+void persistance_startup_done(void) { starting_up = FALSE; }
+
+int persistance_journal_append(otrng_global_state_s *otrng_state,
+                               otrng_client_s *client, const char *record) {
+  int err = 0;
+  FILE *fp = NULL;
+  gchar *f = journal_filename(client, TRUE);
+
+  if (f) {
+    fp = open_private_file(f, "ab");
+    g_free(f);
+  }
+
+  if (fp) {
+    if (fprintf(fp, "%s\n", record) < 0 || sync_file(fp) != 0) {
+      err = -1;
+    }
+    if (fclose(fp) != 0) {
+      err = -1;
+    }
+  } else {
+    err = -1;
+  }
+
+  if (err) {
+    /* Fall back to writing the whole store */
+    persistance_mark_dirty(otrng_state, client, PERSISTANCE_FINGERPRINTS_V4);
+    return err;
+  }
+
+  journal_records++;
+  if (journal_records >= PERSISTANCE_JOURNAL_COMPACT_THRESHOLD) {
+    persistance_mark_dirty(otrng_state, NULL, PERSISTANCE_FINGERPRINTS_V4);
+  }
+
+  return 0;
+}
+
+/* Moves the stores that still live in a single file into per account shards.
+ * The old file is kept around with a ".migrated" suffix. */
+static void migrate_to_shards(otrng_global_state_s *otrng_state) {
+  list_element_s *el;
+  int i;
+
+  for (i = 0; i < PERSISTANCE_STORE_COUNT; i++) {
+    if (!is_sharded(i)) {
+      continue;
+    }
+
+    gchar *legacy =
+        g_build_filename(purple_user_dir(), store_ops[i].filename, NULL);
+    if (!g_file_test(legacy, G_FILE_TEST_EXISTS)) {
+      g_free(legacy);
+      continue;
+    }
+
+    store_ops[i].read(otrng_state);
+    if (i == PERSISTANCE_FINGERPRINTS_V4) {
+      replay_journal(otrng_state, NULL);
+    }
+
+    for (el = otrng_state->clients; el; el = el->next) {
+      if (el->data) {
+        set_shard_bit(loaded_shards, el->data, i);
+      }
+    }
+
+    if (write_all_shards(otrng_state, i) != 0) {
+      otrng_debug_fprintf(stderr, "persistance: could not migrate %s\n",
+                          store_ops[i].filename);
+      g_free(legacy);
+      continue;
+    }
+
+    if (i == PERSISTANCE_FINGERPRINTS_V4) {
+      gchar *journal = g_build_filename(
+          purple_user_dir(), FINGERPRINT_JOURNAL_FILE_NAME_V4, NULL);
+      g_unlink(journal);
+      g_free(journal);
+      journal_records = 0;
+    }
+
+    gchar *migrated = g_strconcat(legacy, ".migrated", NULL);
+    g_rename(legacy, migrated);
+    g_free(migrated);
+    g_free(legacy);
+  }
+}
+
+void persistance_scheduler_start(otrng_global_state_s *otrng_state) {
+  scheduled_state = otrng_state;
+  debounce_ms = persistance_debounce_pref();
+  sync_policy = persistance_sync_pref();
+  sharded = persistance_sharded_pref();
+  lazy = persistance_lazy_pref();
+  starting_up = lazy;
+  global_loaded = 0;
+
+  dirty_shards = g_hash_table_new(g_direct_hash, g_direct_equal);
+  loaded_shards = g_hash_table_new(g_direct_hash, g_direct_equal);
+  touched_clients = g_hash_table_new(g_direct_hash, g_direct_equal);
+  pending_loads = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  if (sharded) {
+    migrate_to_shards(otrng_state);
+  }
+
+  scheduler_running = TRUE;
+}
+
+void persistance_scheduler_stop(void) {
+  /* Compact the fingerprint journal into the snapshot on the way out */
+  if (journal_records > 0 && scheduled_state) {
+    persistance_mark_dirty(scheduled_state, NULL, PERSISTANCE_FINGERPRINTS_V4);
+  }
+
+  persistance_flush();
+  scheduler_running = FALSE;
+  scheduled_state = NULL;
+
+  /* Nothing is left to retry a failed write on */
+  if (flush_timer) {
+    purple_timeout_remove(flush_timer);
+    flush_timer = 0;
+  }
+
+  if (dirty_shards) {
+    g_hash_table_destroy(dirty_shards);
+    dirty_shards = NULL;
+  }
+
+  if (loaded_shards) {
+    g_hash_table_destroy(loaded_shards);
+    loaded_shards = NULL;
+  }
+
+  if (touched_clients) {
+    g_hash_table_destroy(touched_clients);
+    touched_clients = NULL;
+  }
+
+  if (pending_loads) {
+    g_hash_table_destroy(pending_loads);
+    pending_loads = NULL;
+  }
+
+  starting_up = FALSE;
+}
+
+void persistance_get_stats(persistance_store store,
+                           persistance_stats_s *stats) {
+  if (store >= PERSISTANCE_STORE_COUNT || !stats) {
+    return;
+  }
+
+  *stats = store_stats[store];
+}
@@ -23,6 +23,10 @@
 #ifndef __OTRNG_PERSISTANCE_H__
 #define __OTRNG_PERSISTANCE_H__
 
+#include <stdio.h>
+
+#include <glib.h>
+
 #include <libotr-ng/messaging.h>
 
 #define PRIVKEY_FILE_NAME_V4 "otr4.private_key"
@@ -35,6 +39,119 @@
 #define EXP_PREKEY_PROFILE_FILE_NAME "otr4.exp_prekey_profile"
 #define FINGERPRINT_STORE_FILE_NAME_V4 "otr4.fingerprints"
 #define FINGERPRINT_STORE_FILE_NAME_V3 "otr.fingerprints"
+#define FINGERPRINT_JOURNAL_FILE_NAME_V4 "otr4.fingerprints.journal"
+
+/* Number of journal records after which the v4 fingerprint journal is
+ * compacted into a new snapshot of the store */
+#define PERSISTANCE_JOURNAL_COMPACT_THRESHOLD 256
+
+/* Directory under purple_user_dir() holding the per account stores, when
+ * /OTR/sharded_stores is enabled */
+#define PERSISTANCE_SHARD_DIR_NAME "otr4"
+
+/* How long (in milliseconds) a dirty store waits before it gets written. Can
+ * be overridden with the /OTR/persistance_debounce_ms preference. */
+#define PERSISTANCE_DEFAULT_DEBOUNCE_MS 2000
+
+/* What to do to get a store on disk before it replaces the previous one.
+ * Configured with the /OTR/persistance_sync preference. */
+typedef enum {
+  PERSISTANCE_SYNC_NONE = 0,
+  PERSISTANCE_SYNC_DATA = 1,
+  PERSISTANCE_SYNC_FSYNC = 2
+} persistance_sync_policy;
+
+typedef enum {
+  PERSISTANCE_PRIVKEY_V4,
+  PERSISTANCE_PRIVKEY_V3,
+  PERSISTANCE_CLIENT_PROFILE,
+  PERSISTANCE_PREKEY_PROFILE,
+  PERSISTANCE_PREKEY_MESSAGES,
+  PERSISTANCE_FORGING_KEY,
+  PERSISTANCE_EXP_CLIENT_PROFILE,
+  PERSISTANCE_EXP_PREKEY_PROFILE,
+  PERSISTANCE_FINGERPRINTS_V4,
+  PERSISTANCE_FINGERPRINTS_V3,
+  PERSISTANCE_STORE_COUNT
+} persistance_store;
+
+typedef struct {
+  /* Number of times the store was marked dirty */
+  unsigned long requested;
+  /* Number of times the store was actually written to disk */
+  unsigned long written;
+  /* Number of requests that were folded into an already pending write */
+  unsigned long coalesced;
+  /* Number of times the store was parsed from disk */
+  unsigned long read;
+  /* Number of reads put off until the account was first used */
+  unsigned long deferred;
+} persistance_stats_s;
+
+/* Starts the persistance scheduler. Stores marked dirty after this will be
+ * written from the main loop once per debounce window. If sharded stores are
+ * enabled, existing single file stores are migrated here. */
+void persistance_scheduler_start(otrng_global_state_s *otrng_state);
+
+/* Flushes every dirty store and stops the scheduler. */
+void persistance_scheduler_stop(void);
+
+/* Marks the given store as dirty for client. A NULL client means the store
+ * changed for every account. If the scheduler is not running, the store is
+ * written immediately. */
+void persistance_mark_dirty(otrng_global_state_s *otrng_state,
+                            otrng_client_s *client, persistance_store store);
+
+/* Reads the given store. With sharded stores only the shard belonging to
+ * client is read, and only the first time it is asked for.
+ *
+ * With /OTR/lazy_load, reads of fingerprints and prekey messages asked for
+ * while the plugin is starting up are deferred until the client is first
+ * used, and single file stores are parsed only once. Keys and profiles are
+ * always read right away. */
+void persistance_read_store(otrng_global_state_s *otrng_state,
+                            otrng_client_s *client, persistance_store store);
+
+/* Reads every shard of the given client that has not been read yet, and in
+ * lazy mode every store that was deferred for it. Call this before the client
+ * is first used. Does nothing unless sharded stores or lazy loading are
+ * enabled. */
+void persistance_load_client(otrng_global_state_s *otrng_state,
+                             otrng_client_s *client);
+
+/* Ends the startup window during which lazy mode defers reads. Reads asked
+ * for after this load the client right away. */
+void persistance_startup_done(void);
+
+/* Writes every dirty store right away. Returns -1 if any write failed. */
+int persistance_flush(void);
+
+/* Applies a single journal record, as given to persistance_journal_append */
+typedef void (*persistance_journal_handler)(otrng_global_state_s *otrng_state,
+                                            const char *record);
+
+void persistance_set_journal_handler(persistance_journal_handler handler);
+
+/* Appends a record to the v4 fingerprint journal of client. This is O(1) I/O,
+ * the snapshot of the store is only rewritten when the journal grows past
+ * PERSISTANCE_JOURNAL_COMPACT_THRESHOLD. */
+int persistance_journal_append(otrng_global_state_s *otrng_state,
+                               otrng_client_s *client, const char *record);
+
+void persistance_get_stats(persistance_store store,
+                           persistance_stats_s *stats);
+
+void persistance_set_sync_policy(persistance_sync_policy policy);
+
+/* Opens a temporary file next to filename to write a new version of a store
+ * into. The name of the temporary file is returned in tmp_filename. */
+FILE *persistance_open_temp(const gchar *filename, gchar **tmp_filename);
+
+/* Syncs and closes fp and, unless failed is set, renames the temporary file
+ * over filename. Takes ownership of fp and tmp_filename. Returns -1 on
+ * failure, in which case the previous version of filename is left intact. */
+int persistance_commit_temp(FILE *fp, gchar *tmp_filename,
+                            const gchar *filename, int failed);
 
 int persistance_write_privkey_v4_FILEp(otrng_global_state_s *otrng_state);
 
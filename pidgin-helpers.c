@@ -22,9 +22,13 @@
 
 #include <account.h>
 #include <assert.h>
+#include <connection.h>
 #include <glib.h>
 #include <gtkconv.h>
+#include <signals.h>
+#include <string.h>
 
+#include "conversation-index.h"
 #include "fingerprint.h"
 #include "pidgin-helpers.h"
 
@@ -45,15 +49,165 @@ otrng_client_id_s protocol_and_account_to_client_id(const char *protocol,
   return result;
 }
 
-otrng_client_id_s purple_account_to_client_id(const PurpleAccount *account) {
-  const char *protocol, *accountname;
+typedef struct {
+  otrng_client_id_s id;
+  /* Resolved on first use, and dropped whenever it may have gone stale */
+  otrng_client_s *client;
+} account_entry_s;
+
+/* PurpleAccount -> account_entry_s. The names in the ids are interned and
+ * never freed: libotr-ng keeps the id a client was created with for as long
+ * as the client lives, and there is only one per account name. */
+static GHashTable *account_entries = NULL;
+
+/* Interned account name -> GSList of the account_entry_s using it, to find
+ * clients by id without going through the global state */
+static GHashTable *entries_by_name = NULL;
+
+static void account_entry_free(gpointer data) {
+  account_entry_s *entry = data;
+  GSList *same_name =
+      g_hash_table_lookup(entries_by_name, entry->id.account);
+
+  same_name = g_slist_remove(same_name, entry);
+  if (same_name) {
+    g_hash_table_insert(entries_by_name, (gpointer)entry->id.account,
+                        same_name);
+  } else {
+    g_hash_table_remove(entries_by_name, entry->id.account);
+  }
+
+  g_free(entry);
+}
+
+static account_entry_s *account_entry(const PurpleAccount *account) {
+  account_entry_s *entry;
+
+  if (!account_entries) {
+    account_entries = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, account_entry_free);
+    entries_by_name = g_hash_table_new(g_direct_hash, g_direct_equal);
+  }
+
+  entry = g_hash_table_lookup(account_entries, account);
+  if (!entry) {
+    GSList *same_name;
+
+    entry = g_new0(account_entry_s, 1);
+    entry->id.protocol =
+        g_intern_string(purple_account_get_protocol_id(account));
+    entry->id.account = g_intern_string(
+        purple_normalize(account, purple_account_get_username(account)));
+    g_hash_table_insert(account_entries, (gpointer)account, entry);
+
+    same_name = g_hash_table_lookup(entries_by_name, entry->id.account);
+    g_hash_table_insert(entries_by_name, (gpointer)entry->id.account,
+                        g_slist_prepend(same_name, entry));
+  }
+
+  return entry;
+}
+
+/* Finds the entry of a known account by id, without allocating. Names that
+ * were never interned can not belong to a known account. */
+static account_entry_s *account_entry_by_id(otrng_client_id_s client_id) {
+  GQuark name = g_quark_try_string(client_id.account);
+  GSList *l;
+
+  if (!name || !entries_by_name) {
+    return NULL;
+  }
+
+  for (l = g_hash_table_lookup(entries_by_name, g_quark_to_string(name)); l;
+       l = l->next) {
+    account_entry_s *entry = l->data;
+    if (strcmp(entry->id.protocol, client_id.protocol) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+static otrng_client_s *account_entry_client(account_entry_s *entry) {
+  if (!entry->client) {
+    entry->client = otrng_client_get(otrng_state, entry->id);
+  }
+  return entry->client;
+}
 
+otrng_client_id_s purple_account_to_client_id(const PurpleAccount *account) {
   assert(account != NULL);
 
-  protocol = purple_account_get_protocol_id(account);
-  accountname =
-      g_strdup(purple_normalize(account, purple_account_get_username(account)));
-  return protocol_and_account_to_client_id(protocol, accountname);
+  return account_entry(account)->id;
+}
+
+static void forget_account(PurpleAccount *account) {
+  if (account_entries) {
+    g_hash_table_remove(account_entries, account);
+  }
+}
+
+static void account_added_cb(PurpleAccount *account, gpointer data) {
+  /* A new account may reuse the address of one removed earlier */
+  forget_account(account);
+}
+
+static void account_username_changed_cb(PurpleAccount *account,
+                                        const char *old, gpointer data) {
+  forget_account(account);
+}
+
+static void account_removed_cb(PurpleAccount *account, gpointer data) {
+  forget_account(account);
+}
+
+static void signed_off_cb(PurpleConnection *conn, gpointer data) {
+  account_entry_s *entry;
+
+  if (!account_entries) {
+    return;
+  }
+
+  entry = g_hash_table_lookup(account_entries,
+                              purple_connection_get_account(conn));
+  if (entry) {
+    entry->client = NULL;
+  }
+}
+
+void otrng_plugin_client_ids_load(PurplePlugin *handle) {
+  void *accounts_handle = purple_accounts_get_handle();
+
+  purple_signal_connect(accounts_handle, "account-added", handle,
+                        PURPLE_CALLBACK(account_added_cb), NULL);
+  purple_signal_connect(accounts_handle, "account-username-changed", handle,
+                        PURPLE_CALLBACK(account_username_changed_cb), NULL);
+  purple_signal_connect(accounts_handle, "account-removed", handle,
+                        PURPLE_CALLBACK(account_removed_cb), NULL);
+  purple_signal_connect(purple_connections_get_handle(), "signed-off", handle,
+                        PURPLE_CALLBACK(signed_off_cb), NULL);
+}
+
+void otrng_plugin_client_ids_unload(PurplePlugin *handle) {
+  void *accounts_handle = purple_accounts_get_handle();
+
+  purple_signal_disconnect(accounts_handle, "account-added", handle,
+                           PURPLE_CALLBACK(account_added_cb));
+  purple_signal_disconnect(accounts_handle, "account-username-changed",
+                           handle,
+                           PURPLE_CALLBACK(account_username_changed_cb));
+  purple_signal_disconnect(accounts_handle, "account-removed", handle,
+                           PURPLE_CALLBACK(account_removed_cb));
+  purple_signal_disconnect(purple_connections_get_handle(), "signed-off",
+                           handle, PURPLE_CALLBACK(signed_off_cb));
+
+  if (account_entries) {
+    g_hash_table_destroy(account_entries);
+    account_entries = NULL;
+    g_hash_table_destroy(entries_by_name);
+    entries_by_name = NULL;
+  }
 }
 
 PurpleAccount *protocol_and_account_to_purple_account(const char *protocol,
@@ -77,21 +231,26 @@ PurpleAccount *client_id_to_purple_account(const otrng_client_id_s client_id) {
 
 otrng_client_s *get_otrng_client(const char *protocol,
                                  const char *accountname) {
-  return get_otrng_client_from_id(
-      protocol_and_account_to_client_id(protocol, accountname));
+  /* A client created here keeps the id it was created with, and callers
+   * pass strings that do not outlive the call */
+  return get_otrng_client_from_id(protocol_and_account_to_client_id(
+      g_intern_string(protocol), g_intern_string(accountname)));
 }
 
 otrng_client_s *get_otrng_client_from_id(const otrng_client_id_s client_id) {
-  otrng_client_s *result = otrng_client_get(otrng_state, client_id);
+  account_entry_s *entry = account_entry_by_id(client_id);
+  otrng_client_s *result = entry ? account_entry_client(entry)
+                                 : otrng_client_get(otrng_state, client_id);
   assert(result != NULL);
   return result;
 }
 
-// TODO: REMOVE
 otrng_client_s *purple_account_to_otrng_client(const PurpleAccount *account) {
-  otrng_client_s *client =
-      otrng_client_get(otrng_state, purple_account_to_client_id(account));
+  otrng_client_s *client;
+
+  assert(account != NULL);
 
+  client = account_entry_client(account_entry(account));
   assert(client != NULL);
 
   /* You can set some configurations here */
@@ -114,11 +273,10 @@ purple_conversation_to_otrng_conversation(const PurpleConversation *conv) {
   recipient =
       g_strdup(purple_normalize(account, purple_conversation_get_name(conv)));
 
-  otrng_client_s *client =
-      otrng_client_get(otrng_state, purple_account_to_client_id(account));
+  otrng_client_s *client = purple_account_to_otrng_client(account);
 
   otrng_conversation_s *result =
-      otrng_client_get_conversation(1, recipient, client);
+      otrng_plugin_client_get_conversation(1, recipient, client);
   free(recipient);
 
   assert(result != NULL);
@@ -27,6 +27,7 @@
 
 /* Purple headers */
 #include <account.h>
+#include <plugin.h>
 
 #include <libotr-ng/messaging.h>
 
@@ -35,16 +36,29 @@
 otrng_client_id_s protocol_and_account_to_client_id(const char *protocol,
                                                     const char *account);
 
+/* Returns the client id of account. Ids are kept per account, so this only
+ * allocates the first time an account is seen. The strings in the result
+ * stay valid for the life of the process. */
 otrng_client_id_s purple_account_to_client_id(const PurpleAccount *account);
 
+/* Watches for accounts being added, renamed or removed and for connections
+ * signing off, to drop their cached ids and clients. Unloading forgets every
+ * cached client, so it must happen once the global state is gone. */
+void otrng_plugin_client_ids_load(PurplePlugin *handle);
+void otrng_plugin_client_ids_unload(PurplePlugin *handle);
+
 PurpleAccount *protocol_and_account_to_purple_account(const char *protocol,
                                                       const char *accountname);
 
 PurpleAccount *client_id_to_purple_account(const otrng_client_id_s client_id);
 
+/* Returns the client for protocol and accountname, creating it if needed.
+ * The names are interned, so they do not need to outlive the call. */
 otrng_client_s *get_otrng_client(const char *protocol, const char *accountname);
 otrng_client_s *get_otrng_client_from_id(const otrng_client_id_s client_id);
 
+/* Returns the client of account, only going through the global state the
+ * first time it is needed after the account was seen or signed off. */
 otrng_client_s *purple_account_to_otrng_client(const PurpleAccount *account);
 
 otrng_conversation_s *
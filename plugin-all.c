@@ -61,6 +61,7 @@
 /* pidgin-otrng headers */
 #include "persistance.h"
 #include "plugin-all.h"
+#include "plugin-messages.h"
 #include "prekey-plugin.h"
 #include "prekeys.h"
 #include "profiles.h"
@@ -70,6 +71,7 @@
 #include <glib.h>
 
 /* pidgin-otrng GTK headers */
+#include "conversation-index.h"
 #include "fingerprint.h"
 #include "gtk-dialog.h"
 #include "gtk-ui.h"
@@ -118,7 +120,7 @@ GHashTable *otrng_max_message_size_table = NULL;
 static void otrng_plugin_read_instance_tags_FILEp(FILE *instagf) {
   if (otrng_failed(
           otrng_global_state_instance_tags_read_from(otrng_state, instagf))) {
-    // TODO: react better on failure
+    fprintf(stderr, _("Could not read instance tag file\n"));
     return;
   }
 }
@@ -618,72 +620,241 @@ static gboolean timer_fired_cb(gpointer data) {
   return TRUE;
 }
 
-typedef struct {
-  char *username;
-  char **message;
-} prekey_client_offline_message_ctx_s;
-
 int otrng_plugin_buddy_is_offline(PurpleAccount *account, PurpleBuddy *buddy) {
   return buddy && purple_account_supports_offline_message(account, buddy) &&
          !PURPLE_BUDDY_IS_ONLINE(buddy);
 }
 
-static void start_process_retrieving_prekey_ensembles(PurpleAccount *account,
-                                                      otrng_client_s *client,
-                                                      void *xctx) {
-  prekey_client_offline_message_ctx_s *c = xctx;
-  char *send_to_prekey_server = NULL;
-  char *domain;
+/* Prekey ensemble retrievals are collected for this many milliseconds, so
+ * retrievals going to the same prekey server can be sent in one burst. */
+#define OTRNG_PREKEY_RETRIEVAL_WINDOW_MS 50
 
-  otrng_debug_fprintf(stderr,
-                      "Start process of retrieving a prekey ensemble for %s\n",
-                      c->username);
+typedef struct {
+  char *username;
+  char *message;
+} prekey_retrieval_s;
 
-  otrng_prekey_plugin_add_to_mapped_prekey_ensembles_responses(
-      client, account, *c->message, c->username);
+typedef struct {
+  PurpleAccount *account;
+  char *domain;
+  GQueue retrievals;
+} prekey_retrieval_batch_s;
+
+static GList *pending_retrieval_batches = NULL;
+static guint retrieval_flush_timer = 0;
+
+static void prekey_retrieval_free(prekey_retrieval_s *r) {
+  g_free(r->username);
+  g_free(r->message);
+  g_free(r);
+}
+
+static void prekey_retrieval_batch_free(prekey_retrieval_batch_s *batch) {
+  prekey_retrieval_s *r;
+
+  while ((r = g_queue_pop_head(&batch->retrievals)) != NULL) {
+    prekey_retrieval_free(r);
+  }
+  g_free(batch->domain);
+  g_free(batch);
+}
+
+/* Tells the user about every message of the batch, which could not be sent
+ * for lack of a prekey server, and frees the batch */
+static void retrieve_batch_failed(PurpleAccount *account,
+                                  otrng_client_s *client, void *xctx) {
+  prekey_retrieval_batch_s *batch = xctx;
+  prekey_retrieval_s *r;
+
+  while ((r = g_queue_pop_head(&batch->retrievals)) != NULL) {
+    /* Empty messages only start an offline conversation */
+    if (r->message[0] != '\0') {
+      char *msg = g_strdup_printf(
+          _("The offline message to %s could not be sent: no prekey server "
+            "was found for %s."),
+          r->username, batch->domain);
+      otrng_dialog_display_otr_message(
+          purple_account_get_username(account),
+          purple_account_get_protocol_id(account), r->username, msg, 1);
+      g_free(msg);
+    }
+    prekey_retrieval_free(r);
+  }
+
+  prekey_retrieval_batch_free(batch);
+}
 
-  otrng_prekey_retrieve_prekeys(&send_to_prekey_server, client, c->username,
-                                "4");
-  /* This can't fail, since we check this before going down the path */
-  domain = otrng_plugin_prekey_domain_for(account, c->username);
+static void retrieve_batch_after_server_identity(PurpleAccount *account,
+                                                 otrng_client_s *client,
+                                                 void *xctx) {
+  prekey_retrieval_batch_s *batch = xctx;
   otrng_prekey_server_s *si =
-      otrng_prekey_get_server_identity_for(client, domain);
-  g_free(domain);
-  otrng_plugin_inject_message(account, si->identity, send_to_prekey_server);
-  free(send_to_prekey_server);
+      otrng_prekey_get_server_identity_for(client, batch->domain);
+  GPtrArray *queries;
+  GHashTable *queried;
+  prekey_retrieval_s *r;
+  guint i;
+
+  if (!si) {
+    retrieve_batch_failed(account, client, batch);
+    return;
+  }
+
+  otrng_debug_fprintf(
+      stderr, "Start process of retrieving %u prekey ensembles from %s\n",
+      g_queue_get_length(&batch->retrievals), si->identity);
+
+  /* Every query is built before any is sent, so the server sees them back to
+   * back. Responses come back in the same order and are matched to the waiting
+   * messages in the order they were added. */
+  queries = g_ptr_array_new();
+  queried = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  while ((r = g_queue_pop_head(&batch->retrievals)) != NULL) {
+    char *send_to_prekey_server = NULL;
+
+    /* One response delivers every message waiting for the recipient */
+    if (!g_hash_table_contains(queried, r->username)) {
+      g_hash_table_add(queried, g_strdup(r->username));
+      otrng_prekey_retrieve_prekeys(&send_to_prekey_server, client,
+                                    r->username, "4");
+    }
+    if (send_to_prekey_server) {
+      g_ptr_array_add(queries, send_to_prekey_server);
+    }
+
+    /* The waiting message takes ownership of the username */
+    otrng_prekey_plugin_add_to_mapped_prekey_ensembles_responses(
+        client, account, r->message, r->username);
+    g_free(r->message);
+    g_free(r);
+  }
+  g_hash_table_destroy(queried);
+
+  for (i = 0; i < queries->len; i++) {
+    otrng_plugin_inject_message(account, si->identity,
+                                g_ptr_array_index(queries, i));
+    free(g_ptr_array_index(queries, i));
+  }
+  g_ptr_array_free(queries, TRUE);
+
+  prekey_retrieval_batch_free(batch);
+}
+
+static gboolean flush_retrievals_cb(gpointer data) {
+  GList *batches = pending_retrieval_batches;
+  GList *l;
+
+  pending_retrieval_batches = NULL;
+  retrieval_flush_timer = 0;
+
+  for (l = batches; l; l = l->next) {
+    prekey_retrieval_batch_s *batch = l->data;
+    prekey_retrieval_s *first = g_queue_peek_head(&batch->retrievals);
+
+    otrng_plugin_ensure_server_identity(batch->account, first->username,
+                                        retrieve_batch_after_server_identity,
+                                        retrieve_batch_failed, batch);
+  }
+  g_list_free(batches);
+
+  return FALSE;
 }
 
-static void send_offline_message(char **message, const char *username,
+static prekey_retrieval_batch_s *
+find_retrieval_batch(PurpleAccount *account, const char *domain) {
+  GList *l;
+
+  for (l = pending_retrieval_batches; l; l = l->next) {
+    prekey_retrieval_batch_s *batch = l->data;
+    if (batch->account == account && g_strcmp0(batch->domain, domain) == 0) {
+      return batch;
+    }
+  }
+
+  return NULL;
+}
+
+static void send_offline_message(const char *message, const char *username,
                                  PurpleAccount *account) {
-  prekey_client_offline_message_ctx_s *ctx =
-      malloc(sizeof(prekey_client_offline_message_ctx_s));
-  if (!ctx) {
+  prekey_retrieval_batch_s *batch;
+  prekey_retrieval_s *r;
+  char *domain;
+
+  r = g_new0(prekey_retrieval_s, 1);
+  r->username = g_strdup(purple_normalize(account, username));
+
+  if (otrng_prekey_plugin_send_with_cached_ensembles(
+          purple_account_to_otrng_client(account), account, r->username,
+          message)) {
+    prekey_retrieval_free(r);
     return;
   }
-  ctx->username = g_strdup(purple_normalize(account, username));
-  ctx->message = message;
-  otrng_plugin_ensure_server_identity(
-      account, ctx->username, start_process_retrieving_prekey_ensembles, ctx);
+  r->message = g_strdup(message);
+
+  domain = otrng_plugin_prekey_domain_for(account, r->username);
+  if (!domain) {
+    domain = g_strdup("");
+  }
+
+  batch = find_retrieval_batch(account, domain);
+  if (!batch) {
+    batch = g_new0(prekey_retrieval_batch_s, 1);
+    batch->account = account;
+    batch->domain = domain;
+    g_queue_init(&batch->retrievals);
+    pending_retrieval_batches =
+        g_list_append(pending_retrieval_batches, batch);
+  } else {
+    g_free(domain);
+  }
+  g_queue_push_tail(&batch->retrievals, r);
+
+  if (!retrieval_flush_timer) {
+    retrieval_flush_timer = purple_timeout_add(
+        OTRNG_PREKEY_RETRIEVAL_WINDOW_MS, flush_retrievals_cb, NULL);
+  }
+}
+
+static void cancel_pending_retrievals(void) {
+  if (retrieval_flush_timer) {
+    purple_timeout_remove(retrieval_flush_timer);
+    retrieval_flush_timer = 0;
+  }
+  g_list_free_full(pending_retrieval_batches,
+                   (GDestroyNotify)prekey_retrieval_batch_free);
+  pending_retrieval_batches = NULL;
 }
 
 void otrng_plugin_send_non_interactive_auth(const char *username,
                                             PurpleAccount *account) {
-  char **message = malloc(sizeof(char *));
-  if (!message) {
-    return;
+  send_offline_message("", username, account);
+}
+
+static gboolean send_if_offline(PurpleAccount *account,
+                                otrng_client_s *client, const char *username,
+                                const char *message) {
+  otrng_conversation_s *otr_conv =
+      otrng_plugin_client_get_conversation(0, username, client);
+  PurpleBuddy *buddy = purple_find_buddy(account, username);
+
+  if (!otrng_plugin_buddy_is_offline(account, buddy) ||
+      otrng_conversation_is_encrypted(otr_conv)) {
+    return FALSE;
   }
 
-  *message = "\0";
   send_offline_message(message, username, account);
-
-  return;
+  return TRUE;
 }
 
+static const otrng_plugin_message_ops_s otrng_plugin_message_ops = {
+    otrng_client_receive,
+    otrng_plugin_inject_message,
+    otrng_client_send,
+    send_if_offline,
+};
+
 static void process_sending_im(PurpleAccount *account, char *who,
                                char **message, void *ctx) {
-  char *newmessage = NULL;
-  char *username = NULL;
-
   // const char *accountname = purple_account_get_username(account);
   // const char *protocol = purple_account_get_protocol_id(account);
   // PurpleConversation * conv = NULL;
@@ -696,49 +867,14 @@ static void process_sending_im(PurpleAccount *account, char *who,
   // conv = otrng_plugin_userinfo_to_conv(accountname, protocol, username, 1);
   // instance = otrng_plugin_conv_to_selected_instag(conv, OTRL_INSTAG_BEST);
 
-  username = g_strdup(purple_normalize(account, who));
-
   otrng_client_s *client = purple_account_to_otrng_client(account);
+  persistance_load_client(otrng_state, client);
   otrng_client_ensure_correct_state(client);
   trigger_potential_publishing(client);
 
-  otrng_conversation_s *otr_conv =
-      otrng_client_get_conversation(0, username, client);
-  PurpleBuddy *buddy = purple_find_buddy(account, username);
-
-  if (otrng_plugin_buddy_is_offline(account, buddy) &&
-      !otrng_conversation_is_encrypted(otr_conv)) {
-    send_offline_message(message, username, account);
-    return;
-  }
-
-  otrng_result result =
-      otrng_client_send(&newmessage, *message, username, client);
-
-  // TODO: this message should be stored for retransmission
-  // TODO: this will never be true - we need to change otrng_client_send to
-  // accomodate this
-  /* if (result == OTRNG_CLIENT_RESULT_ERROR_NOT_ENCRYPTED) { */
-  /*   return; */
-  /* } */
-
-  // TODO: if require encription
-  // if (err == ???) {
-  //    /* Do not send out plain text */
-  //    char *ourm = g_strdup("");
-  //    free(*message);
-  //    *message = ourm;
-  //}
-
-  if (otrng_succeeded(result)) {
-    free(*message);
-    *message = g_strdup(newmessage);
-  }
-
-  // TODO: This is probably because libotr use a different mechanism to allocate
-  // memory securely
-  otrl_message_free(newmessage);
-  g_free(username);
+  /* Normalized only now, since looking the client up may normalize too */
+  otrng_plugin_message_send(&otrng_plugin_message_ops, account, client, who,
+                            purple_normalize(account, who), message);
 }
 
 /* Abort the SMP protocol.  Used when malformed or unexpected messages
@@ -907,11 +1043,6 @@ void otrng_plugin_send_default_query_conv(PurpleConversation *conv) {
 static gboolean process_receiving_im(PurpleAccount *account, char **who,
                                      char **message, PurpleConversation *conv,
                                      PurpleMessageFlags *flags) {
-  char *username = NULL;
-  char *tosend = NULL;
-  char *todisplay = NULL;
-  otrng_bool should_ignore = otrng_false;
-
   // OtrlTLV *tlvs = NULL;
   // OtrlTLV *tlv = NULL;
   // const char *accountname;
@@ -921,41 +1052,13 @@ static gboolean process_receiving_im(PurpleAccount *account, char **who,
     return 0;
   }
 
-  username = g_strdup(purple_normalize(account, *who));
-
   otrng_client_s *client = purple_account_to_otrng_client(account);
+  persistance_load_client(otrng_state, client);
 
-  otrng_client_receive(&tosend, &todisplay, *message, username, client,
-                       &should_ignore);
-
-  // TODO: client might optionally pass a warning here
-  // TODO: this will likely not work correctly at all, since otrng_result
-  // doesn't have that kind of result
-  /* if (res == OTRNG_CLIENT_RESULT_ERROR_NOT_ENCRYPTED) { */
-  /*   // TODO: Needs to free tosend AND todisplay */
-  /*   return 1; */
-  /* } */
-
-  if (tosend) {
-    // TODO: Should this send to the original who or to the normalized who?
-    otrng_plugin_inject_message(account, username, tosend);
-    free(tosend);
-  }
-
-  if (todisplay) {
-    free(*message);
-    *message = g_strdup(todisplay);
-  } else {
-    /* If we're supposed to ignore this incoming message (because it's a
-     * protocol message), set it to NULL, so that other plugins that
-     * catch receiving-im-msg don't return 0, and cause it to be
-     * displayed anyway. */
-    free(*message);
-    *message = NULL;
-  }
-
-  free(username);
-  return should_ignore == otrng_true;
+  /* Normalized only now, since looking the client up may normalize too */
+  return otrng_plugin_message_receive(&otrng_plugin_message_ops, account,
+                                      client, *who,
+                                      purple_normalize(account, *who), message);
 }
 
 // TODO: Remove me
@@ -1081,6 +1184,17 @@ static void process_connection_change(PurpleConnection *conn, void *data) {
   otrng_dialog_resensitize_all();
 }
 
+static void process_signed_on(PurpleConnection *conn, void *data) {
+  PurpleAccount *account = purple_connection_get_account(conn);
+
+  /* With sharded stores or lazy loading, an account's stores are only read
+   * once it is used */
+  persistance_load_client(otrng_state,
+                          purple_account_to_otrng_client(account));
+
+  process_connection_change(conn, data);
+}
+
 static void otr_options_cb(PurpleBlistNode *node, gpointer user_data) {
   /* We've already checked PURPLE_BLIST_NODE_IS_BUDDY(node) */
   PurpleBuddy *buddy = (PurpleBuddy *)node;
@@ -1145,6 +1259,8 @@ void otrng_plugin_disconnect(otrng_plugin_conversation *conv) {
                                             conv->peer, 1);
   account = purple_conversation_get_account(purp_conv);
 
+  /* libotr-ng frees the conversation when disconnecting it */
+  otrng_plugin_conversation_index_forget(client, conv->peer);
   if (otrng_succeeded(otrng_client_disconnect(&msg, conv->peer, client))) {
     otrng_plugin_inject_message(account, conv->peer, msg);
   }
@@ -1173,7 +1289,7 @@ otrng_plugin_conversation_to_trust(const otrng_plugin_conversation *conv) {
   }
 
   otrng_conversation_s *otr_conv =
-      otrng_client_get_conversation(1, conv->peer, client);
+      otrng_plugin_client_get_conversation(1, conv->peer, client);
 
   if (!otr_conv) {
     return level;
@@ -1237,6 +1353,9 @@ static void process_quitting(void) {
     }
     context = next;
   }
+
+  /* Make sure nothing pending is lost when Pidgin goes away */
+  persistance_flush();
 }
 
 /* Read the maxmsgsizes from a FILE* into the given GHashTable.
@@ -1341,6 +1460,7 @@ static void gone_secure_v4(const otrng_s *cconv) {
     return;
   }
 
+  otrng_plugin_conversation_index_set_encrypted(cconv, TRUE);
   otrng_dialog_conversation_connected(conv);
   otrng_plugin_conversation_free(conv);
 }
@@ -1353,6 +1473,7 @@ static void gone_insecure_v4(const otrng_s *cconv) {
   }
 
   // TODO: ensure otrng_ui_update_keylist() is called here.
+  otrng_plugin_conversation_index_set_encrypted(cconv, FALSE);
   otrng_dialog_conversation_disconnected(conv);
   otrng_plugin_conversation_free(conv);
 }
@@ -1575,6 +1696,7 @@ static int otrng_plugin_init_userstate(void) {
   otrng_fingerprints_set_callbacks(callbacks);
 
   otrng_state = otrng_global_state_new(callbacks, otrng_true);
+  persistance_scheduler_start(otrng_state);
 
   /* Read instance tags to both V4 and V3 libraries' storage */
   otrng_plugin_read_instance_tags_FILEp(instagf);
@@ -1676,7 +1798,7 @@ static void otrng_plugin_watch_libpurple_events(void) {
                         otrng_plugin_handle,
                         PURPLE_CALLBACK(process_conv_destroyed), NULL);
   purple_signal_connect(conn_handle, "signed-on", otrng_plugin_handle,
-                        PURPLE_CALLBACK(process_connection_change), NULL);
+                        PURPLE_CALLBACK(process_signed_on), NULL);
   purple_signal_connect(conn_handle, "signed-off", otrng_plugin_handle,
                         PURPLE_CALLBACK(process_connection_change), NULL);
   purple_signal_connect(blist_handle, "blist-node-extended-menu",
@@ -1706,7 +1828,7 @@ static void otrng_plugin_unwatch_libpurple_events(void) {
                            otrng_plugin_handle,
                            PURPLE_CALLBACK(process_conv_destroyed));
   purple_signal_disconnect(conn_handle, "signed-on", otrng_plugin_handle,
-                           PURPLE_CALLBACK(process_connection_change));
+                           PURPLE_CALLBACK(process_signed_on));
   purple_signal_disconnect(conn_handle, "signed-off", otrng_plugin_handle,
                            PURPLE_CALLBACK(process_connection_change));
   purple_signal_disconnect(blist_handle, "blist-node-extended-menu",
@@ -1814,7 +1936,25 @@ static void teardown_polling_functions(void) {
   otrng_debug_exit("teardown_polling_functions");
 }
 
+static void report_startup_time(GTimer *timer) {
+  persistance_stats_s stats;
+  unsigned long read = 0, deferred = 0;
+  int i;
+
+  for (i = 0; i < PERSISTANCE_STORE_COUNT; i++) {
+    persistance_get_stats(i, &stats);
+    read += stats.read;
+    deferred += stats.deferred;
+  }
+
+  purple_debug_info("otr",
+                    "plugin loaded in %.1f ms, %lu stores read, "
+                    "%lu deferred\n",
+                    g_timer_elapsed(timer, NULL) * 1000, read, deferred);
+}
+
 gboolean otrng_plugin_load(PurplePlugin *handle) {
+  GTimer *startup_timer;
   PurplePlugin *plug = purple_plugins_find_with_id("otr");
   if (plug != NULL && purple_plugin_is_loaded(plug)) {
 #if defined USING_GTK
@@ -1823,18 +1963,24 @@ gboolean otrng_plugin_load(PurplePlugin *handle) {
     return FALSE;
   }
 
+  startup_timer = g_timer_new();
+
   if (otrng_plugin_init_userstate()) {
+    g_timer_destroy(startup_timer);
     return FALSE;
   }
 
 #if BETA_DIALOG && defined USING_GTK /* Only for beta */
-  if (build_beta_dialog())
+  if (build_beta_dialog()) {
+    g_timer_destroy(startup_timer);
     return FALSE;
+  }
 #endif
 
   otrng_init_mms_table();
   otrng_plugin_handle = handle;
   otrng_plugin_timerid = 0;
+  otrng_plugin_client_ids_load(handle);
 
   otrng_ui_init();
   otrng_dialog_init();
@@ -1852,18 +1998,25 @@ gboolean otrng_plugin_load(PurplePlugin *handle) {
 
   setup_polling_functions();
 
+  persistance_startup_done();
+  report_startup_time(startup_timer);
+  g_timer_destroy(startup_timer);
+
   return TRUE;
 }
 
 gboolean otrng_plugin_unload(PurplePlugin *handle) {
   teardown_polling_functions();
+  cancel_pending_retrievals();
+  long_term_keys_shutdown();
+  /* Drops the unpublished prekey messages, before the stores are flushed */
+  otrng_prekey_plugin_unload(handle);
+  persistance_scheduler_stop();
 
   otrng_plugin_fingerprints_unload(handle);
 
   otrng_plugin_prekey_discovery_unload(handle);
 
-  otrng_prekey_plugin_unload(handle);
-
   otrng_plugin_unwatch_libpurple_events();
 
   /* Clean up all of our state. */
@@ -1879,6 +2032,8 @@ gboolean otrng_plugin_unload(PurplePlugin *handle) {
   otrng_free_mms_table();
 
   otrng_plugin_cleanup_userstate();
+  otrng_plugin_conversation_index_clear();
+  otrng_plugin_client_ids_unload(handle);
 
   return TRUE;
 }
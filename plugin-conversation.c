@@ -22,20 +22,47 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <glib.h>
 
 #include "plugin-conversation.h"
 
+/* Copies src, if any, to *dst and returns where the next string goes */
+static char *copy_string(char **dst, const char *src, char *to) {
+  size_t len;
+
+  if (!src) {
+    *dst = NULL;
+    return to;
+  }
+
+  len = strlen(src) + 1;
+  *dst = memcpy(to, src, len);
+  return to + len;
+}
+
 otrng_plugin_conversation *otrng_plugin_conversation_new(const otrng_s *from) {
-  otrng_plugin_conversation *ret = malloc(sizeof(otrng_plugin_conversation));
+  const otrng_client_id_s *id = &from->client->client_id;
+  size_t size = sizeof(otrng_plugin_conversation);
+  otrng_plugin_conversation *ret;
+  char *strings;
+
+  /* The strings are stored right after the struct, so that a conversation
+   * created for every callback is a single allocation */
+  size += id->account ? strlen(id->account) + 1 : 0;
+  size += id->protocol ? strlen(id->protocol) + 1 : 0;
+  size += from->peer ? strlen(from->peer) + 1 : 0;
+
+  ret = malloc(size);
   if (!ret) {
     return ret;
   }
 
-  ret->account = g_strdup(from->client->client_id.account);
-  ret->protocol = g_strdup(from->client->client_id.protocol);
-  ret->peer = g_strdup(from->peer);
+  strings = (char *)(ret + 1);
+  strings = copy_string(&ret->account, id->account, strings);
+  strings = copy_string(&ret->protocol, id->protocol, strings);
+  copy_string(&ret->peer, from->peer, strings);
   ret->their_instance_tag = 0;
   ret->our_instance_tag = 0;
   ret->conv = from;
@@ -44,13 +71,7 @@ otrng_plugin_conversation *otrng_plugin_conversation_new(const otrng_s *from) {
 }
 
 void otrng_plugin_conversation_free(otrng_plugin_conversation *conv) {
-  if (!conv) {
-    return;
-  }
-
-  g_free(conv->account);
-  g_free(conv->protocol);
-  g_free(conv->peer);
-
+  /* The strings live in the same allocation, or are borrowed for the ones
+   * not created by otrng_plugin_conversation_new */
   free(conv);
 }
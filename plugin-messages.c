@@ -0,0 +1,145 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "plugin-messages.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static otrng_plugin_message_stats_s stats;
+
+const char *otrng_plugin_message_peer(const char *who, const char *normalized,
+                                      char **copy) {
+  *copy = NULL;
+
+  if (!normalized || strcmp(who, normalized) == 0) {
+    return who;
+  }
+
+  /* normalized usually lives in a static buffer of libpurple, which anything
+   * libotr-ng calls back into may overwrite */
+  *copy = g_strdup(normalized);
+
+  return *copy;
+}
+
+void otrng_plugin_message_replace(char **message, char *out) {
+  if (out && *message && strcmp(out, *message) == 0) {
+    free(out);
+    stats.passed_through++;
+    return;
+  }
+
+  free(*message);
+  *message = out;
+  stats.adopted++;
+}
+
+gboolean otrng_plugin_message_receive(const otrng_plugin_message_ops_s *ops,
+                                      PurpleAccount *account,
+                                      otrng_client_s *client, const char *who,
+                                      const char *normalized, char **message) {
+  const char *username = NULL;
+  char *username_copy = NULL;
+  char *tosend = NULL;
+  char *todisplay = NULL;
+  otrng_bool should_ignore = otrng_false;
+
+  username = otrng_plugin_message_peer(who, normalized, &username_copy);
+
+  ops->receive(&tosend, &todisplay, *message, username, client,
+               &should_ignore);
+
+  // TODO: client might optionally pass a warning here
+  // TODO: this will likely not work correctly at all, since otrng_result
+  // doesn't have that kind of result
+  /* if (res == OTRNG_CLIENT_RESULT_ERROR_NOT_ENCRYPTED) { */
+  /*   // TODO: Needs to free tosend AND todisplay */
+  /*   return 1; */
+  /* } */
+
+  if (tosend) {
+    // TODO: Should this send to the original who or to the normalized who?
+    ops->inject(account, username, tosend);
+    free(tosend);
+  }
+
+  /* The buffer libotr-ng decrypted into is handed to libpurple as is. If
+   * we're supposed to ignore this incoming message (because it's a protocol
+   * message), todisplay is NULL and the message is set to NULL, so that other
+   * plugins that catch receiving-im-msg don't return 0, and cause it to be
+   * displayed anyway. */
+  otrng_plugin_message_replace(message, todisplay);
+
+  g_free(username_copy);
+  return should_ignore == otrng_true;
+}
+
+void otrng_plugin_message_send(const otrng_plugin_message_ops_s *ops,
+                               PurpleAccount *account, otrng_client_s *client,
+                               const char *who, const char *normalized,
+                               char **message) {
+  char *newmessage = NULL;
+  const char *username = NULL;
+  char *username_copy = NULL;
+
+  username = otrng_plugin_message_peer(who, normalized, &username_copy);
+
+  if (ops->send_offline(account, client, username, *message)) {
+    g_free(username_copy);
+    return;
+  }
+
+  otrng_result result = ops->send(&newmessage, *message, username, client);
+
+  // TODO: this message should be stored for retransmission
+  // TODO: this will never be true - we need to change otrng_client_send to
+  // accomodate this
+  /* if (result == OTRNG_CLIENT_RESULT_ERROR_NOT_ENCRYPTED) { */
+  /*   return; */
+  /* } */
+
+  // TODO: if require encription
+  // if (err == ???) {
+  //    /* Do not send out plain text */
+  //    char *ourm = g_strdup("");
+  //    free(*message);
+  //    *message = ourm;
+  //}
+
+  /* The encoded message is handed to libpurple as is */
+  if (otrng_succeeded(result)) {
+    otrng_plugin_message_replace(message, newmessage);
+  } else {
+    free(newmessage);
+  }
+
+  g_free(username_copy);
+}
+
+void otrng_plugin_message_get_stats(otrng_plugin_message_stats_s *result) {
+  *result = stats;
+}
+
+void otrng_plugin_message_reset_stats(void) {
+  memset(&stats, 0, sizeof(stats));
+}
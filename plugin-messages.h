@@ -0,0 +1,89 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef OTRNG_PIDGIN_PLUGIN_MESSAGES
+#define OTRNG_PIDGIN_PLUGIN_MESSAGES
+
+#include <account.h>
+#include <glib.h>
+
+#include <libotr-ng/client.h>
+
+/* Ownership of the message buffers passed between libpurple and libotr-ng.
+ * Both allocate with the system allocator, so a buffer produced by one can
+ * be handed to the other as is. */
+
+typedef struct {
+  /* Number of messages whose buffer was replaced by one from libotr-ng */
+  unsigned long adopted;
+  /* Number of messages left untouched */
+  unsigned long passed_through;
+} otrng_plugin_message_stats_s;
+
+/* Returns who if it is already in its canonical form, that is if it equals
+ * normalized, so it can be used without a copy. Otherwise returns a copy of
+ * normalized, which is also stored in *copy to be freed with g_free. */
+const char *otrng_plugin_message_peer(const char *who, const char *normalized,
+                                      char **copy);
+
+/* Replaces *message with out, which libotr-ng produced from it, taking
+ * ownership of out. A NULL out drops the message. If out is the same text
+ * as *message it is freed instead, and *message is left alone. */
+void otrng_plugin_message_replace(char **message, char *out);
+
+/* The calls into libotr-ng and libpurple the message paths make. The plugin
+ * uses otrng_plugin_message_ops; tests stand in their own. */
+typedef struct {
+  otrng_result (*receive)(char **tosend, char **todisplay,
+                          const char *message, const char *recipient,
+                          otrng_client_s *client, otrng_bool *should_ignore);
+  void (*inject)(PurpleAccount *account, const char *recipient,
+                 const char *message);
+  otrng_result (*send)(char **newmessage, const char *message,
+                       const char *recipient, otrng_client_s *client);
+  /* Sends message to recipient as an offline message if that is the way to
+   * reach them, returning TRUE if it did */
+  gboolean (*send_offline)(PurpleAccount *account, otrng_client_s *client,
+                           const char *recipient, const char *message);
+} otrng_plugin_message_ops_s;
+
+/* Handles *message, received by account from who, whose normalized form is
+ * normalized: it is decrypted by libotr-ng, any answer is injected back to
+ * the peer and *message is replaced by what is to be displayed. Returns TRUE
+ * if libpurple should ignore the message. */
+gboolean otrng_plugin_message_receive(const otrng_plugin_message_ops_s *ops,
+                                      PurpleAccount *account,
+                                      otrng_client_s *client, const char *who,
+                                      const char *normalized, char **message);
+
+/* Handles *message, sent by account to who, whose normalized form is
+ * normalized: it is either sent as an offline message or encrypted by
+ * libotr-ng, in which case *message is replaced by the encoded message. */
+void otrng_plugin_message_send(const otrng_plugin_message_ops_s *ops,
+                               PurpleAccount *account, otrng_client_s *client,
+                               const char *who, const char *normalized,
+                               char **message);
+
+void otrng_plugin_message_get_stats(otrng_plugin_message_stats_s *stats);
+void otrng_plugin_message_reset_stats(void);
+
+#endif // OTRNG_PIDGIN_PLUGIN_MESSAGES
@@ -0,0 +1,192 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include "prefix-index.h"
+
+typedef struct {
+  char *key;
+  gpointer value;
+  /* Removed entries stay in place, keeping the array sorted, until there
+   * are enough of them to be worth compacting away */
+  gboolean removed;
+} prefix_index_entry_s;
+
+struct otrng_prefix_index_s {
+  /* prefix_index_entry_s, sorted by key unless dirty */
+  GArray *entries;
+  gboolean dirty;
+  /* Number of entries that are removed */
+  guint removed;
+};
+
+otrng_prefix_index_s *otrng_prefix_index_new(void) {
+  otrng_prefix_index_s *index = g_new(otrng_prefix_index_s, 1);
+
+  index->entries = g_array_new(FALSE, FALSE, sizeof(prefix_index_entry_s));
+  index->dirty = FALSE;
+  index->removed = 0;
+
+  return index;
+}
+
+void otrng_prefix_index_free(otrng_prefix_index_s *index) {
+  guint i;
+
+  if (!index) {
+    return;
+  }
+
+  for (i = 0; i < index->entries->len; i++) {
+    g_free(g_array_index(index->entries, prefix_index_entry_s, i).key);
+  }
+  g_array_free(index->entries, TRUE);
+  g_free(index);
+}
+
+void otrng_prefix_index_add(otrng_prefix_index_s *index, const char *key,
+                            gpointer value) {
+  prefix_index_entry_s entry;
+
+  entry.key = g_ascii_strdown(key, -1);
+  entry.value = value;
+  entry.removed = FALSE;
+  g_array_append_val(index->entries, entry);
+  index->dirty = TRUE;
+}
+
+static gint compare_entries(gconstpointer a, gconstpointer b) {
+  return strcmp(((const prefix_index_entry_s *)a)->key,
+                ((const prefix_index_entry_s *)b)->key);
+}
+
+/* Drops the removed entries in a single pass, keeping the others in order */
+static void compact(otrng_prefix_index_s *index) {
+  guint i, kept = 0;
+
+  for (i = 0; i < index->entries->len; i++) {
+    prefix_index_entry_s *entry =
+        &g_array_index(index->entries, prefix_index_entry_s, i);
+
+    if (entry->removed) {
+      g_free(entry->key);
+    } else {
+      g_array_index(index->entries, prefix_index_entry_s, kept++) = *entry;
+    }
+  }
+
+  g_array_set_size(index->entries, kept);
+  index->removed = 0;
+}
+
+static void ensure_sorted(otrng_prefix_index_s *index) {
+  if (index->dirty) {
+    if (index->removed > 0) {
+      compact(index);
+    }
+    g_array_sort(index->entries, compare_entries);
+    index->dirty = FALSE;
+  }
+}
+
+/* Returns the position of the first key not below key */
+static guint lower_bound(const otrng_prefix_index_s *index, const char *key) {
+  guint low = 0, high = index->entries->len;
+
+  while (low < high) {
+    guint middle = low + (high - low) / 2;
+
+    if (strcmp(g_array_index(index->entries, prefix_index_entry_s, middle).key,
+               key) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+void otrng_prefix_index_remove(otrng_prefix_index_s *index, const char *key,
+                               gpointer value) {
+  char *folded = g_ascii_strdown(key, -1);
+  guint i;
+
+  ensure_sorted(index);
+
+  for (i = lower_bound(index, folded); i < index->entries->len; i++) {
+    prefix_index_entry_s *entry =
+        &g_array_index(index->entries, prefix_index_entry_s, i);
+
+    if (strcmp(entry->key, folded) != 0) {
+      break;
+    }
+
+    if (!entry->removed && entry->value == value) {
+      entry->removed = TRUE;
+      index->removed++;
+      break;
+    }
+  }
+
+  g_free(folded);
+
+  /* Removing every entry one by one then costs O(n log n), not O(n^2) */
+  if (index->removed > index->entries->len / 2) {
+    compact(index);
+  }
+}
+
+guint otrng_prefix_index_search(otrng_prefix_index_s *index,
+                                const char *prefix, GFunc func,
+                                gpointer data) {
+  char *folded = g_ascii_strdown(prefix, -1);
+  size_t len = strlen(folded);
+  guint i, found = 0;
+
+  ensure_sorted(index);
+
+  for (i = lower_bound(index, folded); i < index->entries->len; i++) {
+    prefix_index_entry_s *entry =
+        &g_array_index(index->entries, prefix_index_entry_s, i);
+
+    if (strncmp(entry->key, folded, len) != 0) {
+      break;
+    }
+
+    if (entry->removed) {
+      continue;
+    }
+
+    func(entry->value, data);
+    found++;
+  }
+
+  g_free(folded);
+
+  return found;
+}
+
+guint otrng_prefix_index_size(const otrng_prefix_index_s *index) {
+  return index->entries->len - index->removed;
+}
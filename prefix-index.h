@@ -0,0 +1,57 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef OTRNG_PIDGIN_PREFIX_INDEX
+#define OTRNG_PIDGIN_PREFIX_INDEX
+
+#include <glib.h>
+
+/* An index of string keys, to find every value whose key starts with a given
+ * prefix in O(log n + matches). Keys are compared without regard to ASCII
+ * case. Adding is cheap: the index is only sorted again by the first search
+ * after a change. */
+typedef struct otrng_prefix_index_s otrng_prefix_index_s;
+
+otrng_prefix_index_s *otrng_prefix_index_new(void);
+void otrng_prefix_index_free(otrng_prefix_index_s *index);
+
+/* Adds value under key, which is copied. A value may be added under several
+ * keys, and a key may hold several values. */
+void otrng_prefix_index_add(otrng_prefix_index_s *index, const char *key,
+                            gpointer value);
+
+/* Removes value from under key, if it is there. The entry is only marked
+ * as removed, and dropped along with the others later, so removing many
+ * entries does not move the rest of the index for each one. */
+void otrng_prefix_index_remove(otrng_prefix_index_s *index, const char *key,
+                               gpointer value);
+
+/* Calls func with every value that has a key starting with prefix, once per
+ * such key, and the given data. An empty prefix matches every key. Returns
+ * the number of calls. */
+guint otrng_prefix_index_search(otrng_prefix_index_s *index,
+                                const char *prefix, GFunc func,
+                                gpointer data);
+
+guint otrng_prefix_index_size(const otrng_prefix_index_s *index);
+
+#endif // OTRNG_PIDGIN_PREFIX_INDEX
@@ -22,14 +22,77 @@
 
 #include "prekey-discovery-jabber.h"
 
+#include "hex-codec.h"
+
+#include "connection.h"
+#include "debug.h"
+#include "eventloop.h"
 #include "signal.h"
 
 #include <stdio.h>
 #include <string.h>
 
+/* A discovery of the prekey servers of one domain, over one connection.
+ * Every lookup for the domain made over the connection while it is running
+ * joins it as a waiter instead of starting its own tree of IQs. */
+typedef struct {
+  PurpleConnection *pc;
+  char *domain;
+  /* discovery_waiter_s, in the order they joined */
+  GList *waiters;
+  /* otrng_plugin_prekey_server found so far, replayed to late waiters */
+  GList *found;
+  /* Items of the domain still waiting for their disco#info request */
+  GQueue pending_info;
+  guint info_in_flight;
+  guint iqs_in_flight;
+} discovery_s;
+
+typedef struct {
+  PrekeyServerResult result_cb;
+  void *context;
+} discovery_waiter_s;
+
+typedef struct {
+  char *id;
+  XmppIqCallback next;
+  discovery_s *discovery;
+  gboolean is_info;
+  /* Monotonic time, in microseconds, the IQ was sent at and is given up at */
+  gint64 sent;
+  gint64 deadline;
+  /* Link of this IQ in iq_deadlines */
+  GList *link;
+} pending_iq_s;
+
+/* id -> pending_iq_s, which owns the id */
 static GHashTable *iq_callbacks = NULL;
+/* Outstanding IQs ordered by deadline. They all get the same timeout, so
+ * this is the order they were sent in, and a single periodic tick only has
+ * to look at the head. */
+static GQueue iq_deadlines = G_QUEUE_INIT;
+static guint iq_tick = 0;
+/* discovery_s, keyed by their connection and domain */
+static GHashTable *discoveries = NULL;
 static gboolean iq_listening = FALSE;
 
+static gboolean send_iq_to_jabber(PurpleConnection *pc, xmlnode **iq) {
+  /* The account may have signed off while requests were queued */
+  if (!g_list_find(purple_connections_get_all(), pc)) {
+    return FALSE;
+  }
+
+  PurplePlugin *prpl = purple_plugins_find_with_id("prpl-jabber");
+  purple_signal_emit(prpl, "jabber-sending-xmlnode", pc, iq);
+  return TRUE;
+}
+
+static otrng_plugin_jabber_iq_sender send_iq_with = send_iq_to_jabber;
+
+void otrng_plugin_jabber_set_iq_sender(otrng_plugin_jabber_iq_sender sender) {
+  send_iq_with = sender ? sender : send_iq_to_jabber;
+}
+
 static char *generate_next_id() {
   static guint32 index = 0;
 
@@ -42,30 +105,80 @@ static char *generate_next_id() {
   return g_strdup_printf("otrngprekey%x", index++);
 }
 
-static unsigned char *hex_to_bytes(const char *hex, size_t len) {
-  size_t count;
-  char *pos = (char *)hex;
-  unsigned char *result = malloc(len / 2);
-  for (count = 0; count < len / 2; count++) {
-    sscanf(pos, "%2hhx", &result[count]);
-    pos += 2;
-  }
-  return result;
+static guint discovery_hash(gconstpointer key) {
+  const discovery_s *discovery = key;
+
+  return g_direct_hash(discovery->pc) ^ g_str_hash(discovery->domain);
+}
+
+static gboolean discovery_equal(gconstpointer a, gconstpointer b) {
+  const discovery_s *da = a, *db = b;
+
+  return da->pc == db->pc && strcmp(da->domain, db->domain) == 0;
 }
 
-static void
-report_found_prekey_server(otrng_plugin_prekey_discovery_status *iq_status,
-                           const char *jid, const char *fingerprint) {
-  unsigned char *bytefingerprint =
-      hex_to_bytes(fingerprint, FINGERPRINT_LENGTH * 2);
+static void discovery_free(discovery_s *discovery) {
+  GList *l;
 
+  for (l = discovery->found; l; l = l->next) {
+    otrng_plugin_prekey_server *srv = l->data;
+    g_free(srv->identity);
+    free(srv);
+  }
+  g_list_free(discovery->found);
+  g_list_free_full(discovery->waiters, g_free);
+  while (!g_queue_is_empty(&discovery->pending_info)) {
+    g_free(g_queue_pop_head(&discovery->pending_info));
+  }
+  g_free(discovery->domain);
+  g_free(discovery);
+}
+
+static void report_to_waiter(discovery_waiter_s *waiter,
+                             const otrng_plugin_prekey_server *srv) {
+  /* Every waiter gets its own copy, as it owns what it receives */
   otrng_plugin_prekey_server *res = malloc(sizeof(otrng_plugin_prekey_server));
-  res->identity = g_strdup(jid);
-  memcpy(res->fingerprint, bytefingerprint, FINGERPRINT_LENGTH);
+  if (!res) {
+    return;
+  }
+  res->identity = g_strdup(srv->identity);
+  memcpy(res->fingerprint, srv->fingerprint, FINGERPRINT_LENGTH);
 
-  iq_status->result_cb(res, iq_status->context);
+  waiter->result_cb(res, waiter->context);
+}
+
+static void report_found_prekey_server(discovery_s *discovery, const char *jid,
+                                       const char *fingerprint) {
+  otrng_plugin_prekey_server *srv;
+  uint8_t bytefingerprint[FINGERPRINT_LENGTH];
+  guint waiters = g_list_length(discovery->waiters);
+  GList *l;
+
+  for (l = discovery->found; l; l = l->next) {
+    srv = l->data;
+    if (purple_strequal(srv->identity, jid)) {
+      return;
+    }
+  }
+
+  if (!otrng_plugin_hex_decode(fingerprint, FINGERPRINT_LENGTH,
+                               bytefingerprint)) {
+    return;
+  }
 
-  free(bytefingerprint);
+  srv = malloc(sizeof(otrng_plugin_prekey_server));
+  if (!srv) {
+    return;
+  }
+  srv->identity = g_strdup(jid);
+  memcpy(srv->fingerprint, bytefingerprint, FINGERPRINT_LENGTH);
+
+  discovery->found = g_list_append(discovery->found, srv);
+
+  /* Waiters joining from a callback have srv replayed when they join */
+  for (l = discovery->waiters; l && waiters > 0; l = l->next, waiters--) {
+    report_to_waiter(l->data, srv);
+  }
 }
 
 static void receive_prekey_connection_information(PurpleConnection *pc,
@@ -93,10 +206,17 @@ static void receive_prekey_connection_information(PurpleConnection *pc,
   }
 }
 
-static void send_iq(PurpleConnection *pc, const char *to, const char *namespace,
-                    otrng_plugin_prekey_discovery_status *handle) {
+static gboolean iq_tick_cb(gpointer data);
+
+static void send_iq(discovery_s *discovery, const char *to,
+                    const char *namespace, XmppIqCallback next,
+                    gboolean is_info) {
   xmlnode *iq, *query;
-  char *id = generate_next_id();
+  char *id;
+  pending_iq_s *pending;
+
+  id = generate_next_id();
+
   iq = xmlnode_new("iq");
   xmlnode_set_attrib(iq, "type", "get");
   xmlnode_set_attrib(iq, "to", to);
@@ -105,26 +225,39 @@ static void send_iq(PurpleConnection *pc, const char *to, const char *namespace,
   query = xmlnode_new_child(iq, "query");
   xmlnode_set_namespace(query, namespace);
 
-  g_hash_table_insert(iq_callbacks, id, handle);
-
-  PurplePlugin *prpl = purple_plugins_find_with_id("prpl-jabber");
-  purple_signal_emit(prpl, "jabber-sending-xmlnode", pc, &iq);
+  if (!send_iq_with(discovery->pc, &iq)) {
+    if (iq != NULL) {
+      xmlnode_free(iq);
+    }
+    g_free(id);
+    return;
+  }
 
   if (iq != NULL) {
     xmlnode_free(iq);
   }
-}
 
-static void find_connection_information_for(
-    PurpleConnection *pc, const char *jid,
-    otrng_plugin_prekey_discovery_status *iq_status) {
-  otrng_plugin_prekey_discovery_status *new_iq_handle =
-      malloc(sizeof(otrng_plugin_prekey_discovery_status));
-  new_iq_handle->next = receive_prekey_connection_information;
-  new_iq_handle->result_cb = iq_status->result_cb;
-  new_iq_handle->context = iq_status->context;
+  pending = g_new0(pending_iq_s, 1);
+  pending->id = id;
+  pending->next = next;
+  pending->discovery = discovery;
+  pending->is_info = is_info;
+  pending->sent = g_get_monotonic_time();
+  pending->deadline =
+      pending->sent + (gint64)OTRNG_DISCOVERY_IQ_TIMEOUT * G_USEC_PER_SEC;
+  g_queue_push_tail(&iq_deadlines, pending);
+  pending->link = g_queue_peek_tail_link(&iq_deadlines);
+  g_hash_table_insert(iq_callbacks, id, pending);
+
+  if (!iq_tick) {
+    iq_tick = purple_timeout_add_seconds(OTRNG_DISCOVERY_IQ_TICK, iq_tick_cb,
+                                         NULL);
+  }
 
-  send_iq(pc, jid, NS_DISCO_ITEMS, new_iq_handle);
+  discovery->iqs_in_flight++;
+  if (is_info) {
+    discovery->info_in_flight++;
+  }
 }
 
 static void receive_server_info(PurpleConnection *pc, const char *type,
@@ -141,26 +274,28 @@ static void receive_server_info(PurpleConnection *pc, const char *type,
       idtype = xmlnode_get_attrib(identity, "type");
       if (purple_strequal(idcat, "auth") &&
           purple_strequal(idtype, "otr-prekey")) {
-        find_connection_information_for(pc, from, data);
+        send_iq(data, from, NS_DISCO_ITEMS,
+                receive_prekey_connection_information, FALSE);
       }
     }
   }
 }
 
-static void
-investigate_server_item(PurpleConnection *pc, const char *jid,
-                        otrng_plugin_prekey_discovery_status *iq_status) {
-  otrng_plugin_prekey_discovery_status *new_iq_handle =
-      malloc(sizeof(otrng_plugin_prekey_discovery_status));
-  new_iq_handle->next = receive_server_info;
-  new_iq_handle->result_cb = iq_status->result_cb;
-  new_iq_handle->context = iq_status->context;
-  send_iq(pc, jid, NS_DISCO_INFO, new_iq_handle);
+/* Sends disco#info requests for the queued items, keeping at most
+ * OTRNG_DISCOVERY_MAX_PARALLEL_INFO of them outstanding */
+static void pump_info_requests(discovery_s *discovery) {
+  while (discovery->info_in_flight < OTRNG_DISCOVERY_MAX_PARALLEL_INFO &&
+         !g_queue_is_empty(&discovery->pending_info)) {
+    char *jid = g_queue_pop_head(&discovery->pending_info);
+    send_iq(discovery, jid, NS_DISCO_INFO, receive_server_info, TRUE);
+    g_free(jid);
+  }
 }
 
 static void receive_server_items(PurpleConnection *pc, const char *type,
                                  const char *id, const char *from, xmlnode *iq,
                                  gpointer data) {
+  discovery_s *discovery = data;
   xmlnode *query;
 
   if (purple_strequal(type, "result") &&
@@ -170,30 +305,86 @@ static void receive_server_items(PurpleConnection *pc, const char *type,
     for (item = xmlnode_get_child(query, "item"); item;
          item = xmlnode_get_next_twin(item)) {
       const char *jid = xmlnode_get_attrib(item, "jid");
-      investigate_server_item(pc, jid, data);
+      if (jid) {
+        g_queue_push_tail(&discovery->pending_info, g_strdup(jid));
+      }
     }
   }
 }
 
-static gboolean xmpp_iq_received(PurpleConnection *pc, const char *type,
-                                 const char *id, const char *from,
-                                 xmlnode *iq) {
-  otrng_plugin_prekey_discovery_status *iq_status;
+/* Tells every waiter the lookup is over, whether or not anything was found,
+ * and frees the discovery */
+static void discovery_finish(discovery_s *discovery) {
+  GList *l;
 
-  iq_status = g_hash_table_lookup(iq_callbacks, id);
-  if (!iq_status) {
+  g_hash_table_steal(discoveries, discovery);
+
+  for (l = discovery->waiters; l; l = l->next) {
+    discovery_waiter_s *waiter = l->data;
+    waiter->result_cb(NULL, waiter->context);
+  }
+
+  discovery_free(discovery);
+}
+
+static void pending_iq_free(pending_iq_s *pending) {
+  g_hash_table_remove(iq_callbacks, pending->id);
+  g_queue_delete_link(&iq_deadlines, pending->link);
+  g_free(pending->id);
+  g_free(pending);
+}
+
+/* Accounts for an answered or expired IQ, sends what is queued behind it and
+ * ends the discovery once nothing is outstanding */
+static void iq_done(pending_iq_s *pending) {
+  discovery_s *discovery = pending->discovery;
+
+  discovery->iqs_in_flight--;
+  if (pending->is_info) {
+    discovery->info_in_flight--;
+  }
+  pending_iq_free(pending);
+
+  pump_info_requests(discovery);
+
+  if (discovery->iqs_in_flight == 0) {
+    discovery_finish(discovery);
+  }
+}
+
+void otrng_plugin_jabber_expire_iqs(gint64 now) {
+  pending_iq_s *pending;
+
+  while ((pending = g_queue_peek_head(&iq_deadlines)) != NULL &&
+         pending->deadline <= now) {
+    purple_debug_info("otr", "Prekey server discovery: no answer to %s\n",
+                      pending->id);
+    iq_done(pending);
+  }
+}
+
+static gboolean iq_tick_cb(gpointer data) {
+  otrng_plugin_jabber_expire_iqs(g_get_monotonic_time());
+
+  if (g_queue_is_empty(&iq_deadlines)) {
+    iq_tick = 0;
     return FALSE;
   }
 
-  otrng_plugin_prekey_discovery_status *copy =
-      malloc(sizeof(otrng_plugin_prekey_discovery_status));
-  copy->next = iq_status->next;
-  copy->result_cb = iq_status->result_cb;
-  copy->context = iq_status->context;
+  return TRUE;
+}
 
-  g_hash_table_remove(iq_callbacks, id);
+gboolean otrng_plugin_jabber_iq_received(PurpleConnection *pc,
+                                         const char *type, const char *id,
+                                         const char *from, xmlnode *iq) {
+  pending_iq_s *pending;
 
-  copy->next(pc, type, id, from, iq, copy);
+  if (!id || !(pending = g_hash_table_lookup(iq_callbacks, id))) {
+    return FALSE;
+  }
+
+  pending->next(pc, type, id, from, iq, pending->discovery);
+  iq_done(pending);
 
   return TRUE;
 }
@@ -233,6 +424,38 @@ char *get_domain_from_jid(const char *jid) {
   return result;
 }
 
+void otrng_plugin_jabber_discover(PurpleConnection *pc, const char *domain,
+                                  PrekeyServerResult result_cb,
+                                  void *context) {
+  discovery_s probe = {.pc = pc, .domain = (char *)domain};
+  discovery_s *discovery = g_hash_table_lookup(discoveries, &probe);
+  discovery_waiter_s *waiter = g_new0(discovery_waiter_s, 1);
+  waiter->result_cb = result_cb;
+  waiter->context = context;
+
+  if (discovery) {
+    GList *l;
+
+    /* Join the discovery already running for the domain */
+    discovery->waiters = g_list_append(discovery->waiters, waiter);
+    for (l = discovery->found; l; l = l->next) {
+      report_to_waiter(waiter, l->data);
+    }
+  } else {
+    discovery = g_new0(discovery_s, 1);
+    discovery->pc = pc;
+    discovery->domain = g_strdup(domain);
+    discovery->waiters = g_list_append(NULL, waiter);
+    g_queue_init(&discovery->pending_info);
+    g_hash_table_add(discoveries, discovery);
+
+    send_iq(discovery, domain, NS_DISCO_ITEMS, receive_server_items, FALSE);
+    if (discovery->iqs_in_flight == 0) {
+      discovery_finish(discovery);
+    }
+  }
+}
+
 int otrng_plugin_jabber_lookup_prekey_servers_for(PurpleAccount *account,
                                                   const char *who,
                                                   PrekeyServerResult result_cb,
@@ -255,19 +478,14 @@ int otrng_plugin_jabber_lookup_prekey_servers_for(PurpleAccount *account,
     return 0;
   }
 
-  otrng_plugin_prekey_discovery_status *iq_handle =
-      malloc(sizeof(otrng_plugin_prekey_discovery_status));
-  iq_handle->next = receive_server_items;
-  iq_handle->result_cb = result_cb;
-  iq_handle->context = context;
-
   if (!iq_listening) {
-    purple_signal_connect(prpl, "jabber-receiving-iq", iq_handle,
-                          PURPLE_CALLBACK(xmpp_iq_received), NULL);
+    purple_signal_connect(prpl, "jabber-receiving-iq", &iq_listening,
+                          PURPLE_CALLBACK(otrng_plugin_jabber_iq_received),
+                          NULL);
     iq_listening = TRUE;
   }
 
-  send_iq(pc, server, NS_DISCO_ITEMS, iq_handle);
+  otrng_plugin_jabber_discover(pc, server, result_cb, context);
 
   free(server);
   g_free(nwho);
@@ -280,10 +498,59 @@ char *otrng_plugin_jabber_prekey_domain_for(PurpleAccount *account,
 }
 
 void otrng_plugin_prekey_discovery_jabber_load() {
-  iq_callbacks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  iq_callbacks = g_hash_table_new(g_str_hash, g_str_equal);
+  discoveries = g_hash_table_new_full(discovery_hash, discovery_equal,
+                                      (GDestroyNotify)discovery_free, NULL);
+}
+
+void otrng_plugin_jabber_get_iq_stats(otrng_plugin_jabber_iq_stats_s *stats) {
+  pending_iq_s *oldest = g_queue_peek_head(&iq_deadlines);
+
+  stats->pending = g_queue_get_length(&iq_deadlines);
+  stats->oldest_age_ms =
+      oldest ? (g_get_monotonic_time() - oldest->sent) / 1000 : 0;
 }
 
 void otrng_plugin_prekey_discovery_jabber_unload() {
+  otrng_plugin_jabber_iq_stats_s stats;
+  pending_iq_s *pending;
+  GHashTableIter iter;
+  gpointer value;
+
+  otrng_plugin_jabber_get_iq_stats(&stats);
+  if (stats.pending > 0) {
+    purple_debug_info("otr",
+                      "Prekey server discovery: dropping %u unanswered IQs, "
+                      "the oldest sent %" G_GINT64_FORMAT " ms ago\n",
+                      stats.pending, stats.oldest_age_ms);
+  }
+
+  if (iq_listening) {
+    purple_signals_disconnect_by_handle(&iq_listening);
+    iq_listening = FALSE;
+  }
+
+  if (iq_tick) {
+    purple_timeout_remove(iq_tick);
+    iq_tick = 0;
+  }
+  while ((pending = g_queue_peek_head(&iq_deadlines)) != NULL) {
+    pending_iq_free(pending);
+  }
   g_hash_table_destroy(iq_callbacks);
   iq_callbacks = NULL;
+
+  /* Whoever is still waiting gets told the lookup failed */
+  g_hash_table_iter_init(&iter, discoveries);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    discovery_s *discovery = value;
+    GList *l;
+
+    for (l = discovery->waiters; l; l = l->next) {
+      discovery_waiter_s *waiter = l->data;
+      waiter->result_cb(NULL, waiter->context);
+    }
+  }
+  g_hash_table_destroy(discoveries);
+  discoveries = NULL;
 }
@@ -33,11 +33,21 @@ typedef void (*XmppIqCallback)(PurpleConnection *pc, const char *type,
                                const char *id, const char *from, xmlnode *iq,
                                gpointer data);
 
+/* Number of disco#info requests a discovery keeps outstanding at once */
+#define OTRNG_DISCOVERY_MAX_PARALLEL_INFO 4
+
+/* Seconds after which an unanswered IQ is given up on, and how often (in
+ * seconds) outstanding IQs are checked against their deadline while there
+ * are any */
+#define OTRNG_DISCOVERY_IQ_TIMEOUT 30
+#define OTRNG_DISCOVERY_IQ_TICK 1
+
 typedef struct {
-  XmppIqCallback next;
-  PrekeyServerResult result_cb;
-  void *context;
-} otrng_plugin_prekey_discovery_status;
+  /* Number of IQs sent that were neither answered nor given up on yet */
+  guint pending;
+  /* Age in milliseconds of the oldest of them, 0 if there are none */
+  gint64 oldest_age_ms;
+} otrng_plugin_jabber_iq_stats_s;
 
 // returns 1 on success and 0 on failure
 int otrng_plugin_jabber_lookup_prekey_servers_for(PurpleAccount *account,
@@ -48,6 +58,30 @@ int otrng_plugin_jabber_lookup_prekey_servers_for(PurpleAccount *account,
 char *otrng_plugin_jabber_prekey_domain_for(PurpleAccount *account,
                                             const char *who);
 
+void otrng_plugin_jabber_get_iq_stats(otrng_plugin_jabber_iq_stats_s *stats);
+
+/* Hands an IQ to the connection. Returns FALSE if it could not be sent. */
+typedef gboolean (*otrng_plugin_jabber_iq_sender)(PurpleConnection *pc,
+                                                  xmlnode **iq);
+
+/* Lets the tests see the IQs instead of sending them. NULL goes back to
+ * sending them to the jabber prpl. */
+void otrng_plugin_jabber_set_iq_sender(otrng_plugin_jabber_iq_sender sender);
+
+/* Starts discovering the prekey servers of domain over pc, or joins the
+ * discovery already running for it over pc */
+void otrng_plugin_jabber_discover(PurpleConnection *pc, const char *domain,
+                                  PrekeyServerResult result_cb, void *context);
+
+/* Handles an IQ received over pc. Returns TRUE if it answered one of ours. */
+gboolean otrng_plugin_jabber_iq_received(PurpleConnection *pc,
+                                         const char *type, const char *id,
+                                         const char *from, xmlnode *iq);
+
+/* Gives up on every IQ whose deadline is at or before now, a monotonic time
+ * in microseconds */
+void otrng_plugin_jabber_expire_iqs(gint64 now);
+
 void otrng_plugin_prekey_discovery_jabber_load();
 void otrng_plugin_prekey_discovery_jabber_unload();
 
@@ -23,6 +23,17 @@
 #include "prekey-discovery.h"
 #include "prekey-discovery-jabber.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include <util.h>
+
+#include "hex-codec.h"
+#include "persistance.h"
+
 int otrng_plugin_lookup_prekey_servers_for_self(PurpleAccount *account,
                                                 PrekeyServerResult result_cb,
                                                 void *context) {
@@ -60,10 +71,185 @@ char *otrng_plugin_prekey_domain_for(PurpleAccount *account, const char *who) {
   return NULL;
 }
 
+typedef struct {
+  char *identity;
+  char fingerprint[FINGERPRINT_LENGTH];
+  time_t expires;
+} known_prekey_server_s;
+
+/* domain -> known_prekey_server_s, mirrored in PREKEY_SERVERS_FILE_NAME */
+static GHashTable *known_servers = NULL;
+
+/* Domains whose known server was already looked up again this session */
+static GHashTable *revalidated_domains = NULL;
+
+static void known_prekey_server_free(gpointer data) {
+  known_prekey_server_s *known = data;
+
+  g_free(known->identity);
+  g_free(known);
+}
+
+static gchar *known_servers_filename(void) {
+  return g_build_filename(purple_user_dir(), PREKEY_SERVERS_FILE_NAME, NULL);
+}
+
+/* The file has one line per domain:
+ *
+ *   domain \t identity \t fingerprint (hex) \t expiry (unix time)
+ */
+static void read_known_servers(void) {
+  gchar *filename = known_servers_filename();
+  gchar *contents = NULL;
+  gchar **lines;
+  int i;
+  time_t now = time(NULL);
+
+  if (!g_file_get_contents(filename, &contents, NULL, NULL)) {
+    g_free(filename);
+    return;
+  }
+  g_free(filename);
+
+  lines = g_strsplit(contents, "\n", -1);
+  g_free(contents);
+
+  for (i = 0; lines[i]; i++) {
+    gchar **fields = g_strsplit(lines[i], "\t", 4);
+    known_prekey_server_s *known;
+
+    if (g_strv_length(fields) != 4) {
+      g_strfreev(fields);
+      continue;
+    }
+
+    known = g_new0(known_prekey_server_s, 1);
+    known->expires = (time_t)g_ascii_strtoll(fields[3], NULL, 10);
+    if (known->expires <= now ||
+        strlen(fields[2]) != FINGERPRINT_LENGTH * 2 ||
+        !otrng_plugin_hex_decode(fields[2], FINGERPRINT_LENGTH,
+                                 (uint8_t *)known->fingerprint)) {
+      g_free(known);
+      g_strfreev(fields);
+      continue;
+    }
+    known->identity = g_strdup(fields[1]);
+    g_hash_table_replace(known_servers, g_strdup(fields[0]), known);
+
+    g_strfreev(fields);
+  }
+
+  g_strfreev(lines);
+}
+
+static void write_known_servers(void) {
+  gchar *filename = known_servers_filename();
+  gchar *tmp_filename = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  int failed = 0;
+  FILE *fp = persistance_open_temp(filename, &tmp_filename);
+
+  if (!fp) {
+    g_free(filename);
+    return;
+  }
+
+  g_hash_table_iter_init(&iter, known_servers);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    known_prekey_server_s *known = value;
+    char hex[FINGERPRINT_LENGTH * 2 + 1];
+
+    otrng_plugin_hex_encode((const uint8_t *)known->fingerprint,
+                            FINGERPRINT_LENGTH, hex);
+    if (fprintf(fp, "%s\t%s\t%s\t%" G_GINT64_FORMAT "\n", (const char *)key,
+                known->identity, hex, (gint64)known->expires) < 0) {
+      failed = 1;
+      break;
+    }
+  }
+
+  persistance_commit_temp(fp, tmp_filename, filename, failed);
+  g_free(filename);
+}
+
+otrng_plugin_prekey_server *
+otrng_plugin_prekey_server_known_for(const char *domain) {
+  known_prekey_server_s *known;
+  otrng_plugin_prekey_server *srv;
+
+  if (!known_servers || !domain) {
+    return NULL;
+  }
+
+  known = g_hash_table_lookup(known_servers, domain);
+  if (!known || known->expires <= time(NULL)) {
+    return NULL;
+  }
+
+  srv = malloc(sizeof(otrng_plugin_prekey_server));
+  if (!srv) {
+    return NULL;
+  }
+  srv->identity = g_strdup(known->identity);
+  memcpy(srv->fingerprint, known->fingerprint, FINGERPRINT_LENGTH);
+
+  return srv;
+}
+
+void otrng_plugin_prekey_server_remember(
+    const char *domain, const otrng_plugin_prekey_server *srv) {
+  known_prekey_server_s *known;
+
+  if (!known_servers || !domain || !srv || !srv->identity) {
+    return;
+  }
+
+  known = g_new0(known_prekey_server_s, 1);
+  known->identity = g_strdup(srv->identity);
+  memcpy(known->fingerprint, srv->fingerprint, FINGERPRINT_LENGTH);
+  known->expires = time(NULL) + OTRNG_PREKEY_SERVER_CACHE_TTL;
+  g_hash_table_replace(known_servers, g_strdup(domain), known);
+
+  write_known_servers();
+}
+
+void otrng_plugin_prekey_server_forget(const char *domain) {
+  if (!known_servers || !domain) {
+    return;
+  }
+
+  if (g_hash_table_remove(known_servers, domain)) {
+    write_known_servers();
+  }
+}
+
+int otrng_plugin_prekey_server_needs_revalidation(const char *domain) {
+  if (!revalidated_domains || !domain ||
+      g_hash_table_lookup(revalidated_domains, domain)) {
+    return 0;
+  }
+
+  g_hash_table_insert(revalidated_domains, g_strdup(domain),
+                      GINT_TO_POINTER(1));
+  return 1;
+}
+
 void otrng_plugin_prekey_discovery_load() {
   otrng_plugin_prekey_discovery_jabber_load();
+
+  known_servers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        known_prekey_server_free);
+  revalidated_domains =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  read_known_servers();
 }
 
 void otrng_plugin_prekey_discovery_unload() {
   otrng_plugin_prekey_discovery_jabber_unload();
+
+  g_hash_table_destroy(known_servers);
+  known_servers = NULL;
+  g_hash_table_destroy(revalidated_domains);
+  revalidated_domains = NULL;
 }
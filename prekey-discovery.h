@@ -27,6 +27,12 @@
 
 #define FINGERPRINT_LENGTH 56
 
+#define PREKEY_SERVERS_FILE_NAME "otr4.prekey_servers"
+
+/* How long (in seconds) a discovered prekey server is trusted to still serve
+ * its domain, before it has to be looked up again */
+#define OTRNG_PREKEY_SERVER_CACHE_TTL (7 * 24 * 60 * 60)
+
 typedef struct {
   char *identity;
   char fingerprint[FINGERPRINT_LENGTH];
@@ -37,7 +43,8 @@ typedef void (*PrekeyServerResult)(otrng_plugin_prekey_server *, void *);
 /**
  * This function will try to look up prekey servers for the account
  * given. If any failure is encountered, it will return 0.
- * The given result_cb will be called once for each prekey server found.
+ * The given result_cb will be called once for each prekey server found,
+ * and once with NULL when the lookup is over.
  * The argument given to the callback is owned by the receiver, including
  * the values inside.
  */
@@ -50,7 +57,8 @@ int otrng_plugin_lookup_prekey_servers_for_self(PurpleAccount *account,
  * If any failure is encountered, it will return 0.
  * The given result_cb will be called once for each prekey server found.
  * The argument given to the callback is owned by the receiver, including
- * the values inside.
+ * the values inside. Once the lookup is over, found anything or not, the
+ * callback is called one last time with NULL.
  */
 int otrng_plugin_lookup_prekey_servers_for(PurpleAccount *account,
                                            const char *who,
@@ -59,6 +67,32 @@ int otrng_plugin_lookup_prekey_servers_for(PurpleAccount *account,
 
 char *otrng_plugin_prekey_domain_for(PurpleAccount *account, const char *who);
 
+/**
+ * Returns the prekey server last found for domain, if it has not expired,
+ * or NULL. The result is owned by the caller, like the ones given to
+ * PrekeyServerResult callbacks.
+ */
+otrng_plugin_prekey_server *
+otrng_plugin_prekey_server_known_for(const char *domain);
+
+/**
+ * Remembers srv as the prekey server of domain, across restarts.
+ */
+void otrng_plugin_prekey_server_remember(const char *domain,
+                                         const otrng_plugin_prekey_server *srv);
+
+/**
+ * Forgets the prekey server remembered for domain, once looking it up again
+ * found none.
+ */
+void otrng_plugin_prekey_server_forget(const char *domain);
+
+/**
+ * Returns TRUE the first time it is called for domain in this session, when
+ * a server known from a previous session should be looked up again.
+ */
+int otrng_plugin_prekey_server_needs_revalidation(const char *domain);
+
 /**
  * Has to be called to initialize this part of the plugin.
  */
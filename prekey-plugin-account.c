@@ -29,8 +29,10 @@
 #include <libotr-ng/deserialize.h>
 #include <libotr-ng/messaging.h>
 
+#include "persistance.h"
 #include "pidgin-helpers.h"
 #include "prekey-discovery.h"
+#include "prekey-plugin-pool.h"
 
 /* If we're using glib on Windows, we need to use g_fopen to open files.
  * On other platforms, it's also safe to use it.  If we're not using
@@ -115,6 +117,7 @@ static void publishing_after_server_identity(PurpleAccount *account,
 void low_prekey_messages_in_storage_cb(otrng_client_s *client, void *ctx) {
   otrng_debug_enter("low_prekey_messages_in_storage_cb");
   otrng_client_ensure_correct_state(client);
+  /* Publishing drains the prekey pool */
   trigger_potential_publishing(client);
   otrng_debug_exit("low_prekey_messages_in_storage_cb");
 }
@@ -126,7 +129,12 @@ int build_prekey_publication_message_cb(otrng_client_s *client,
 
   otrng_client_ensure_correct_state(client);
 
-  otrng_prekey_add_prekey_messages_for_publication(client, msg);
+  /* Prekey messages only go out when the server asked for them, and never
+   * more than it asked for */
+  if (!otrng_prekey_pool_take(client, msg,
+                              client->prekey_msgs_num_to_publish)) {
+    otrng_prekey_add_prekey_messages_for_publication(client, msg);
+  }
 
   if (msg->num_prekey_messages > 0) {
     otrng_debug_fprintf(stderr,
@@ -175,6 +183,7 @@ static void account_signed_on_after_server_identity(PurpleAccount *account,
     return;
   }
   otrng_client_ensure_correct_state(client);
+  otrng_prekey_pool_refill(client);
 
   otrng_debug_fprintf(stderr, "Requesting Storage Information. \n");
   // TODO: handle error here
@@ -196,9 +205,10 @@ static void account_signed_on_after_server_identity(PurpleAccount *account,
 static void account_signed_on_cb(PurpleConnection *conn, void *data) {
   otrng_debug_enter("account_signed_on_cb");
   PurpleAccount *account = purple_connection_get_account(conn);
+  persistance_load_client(otrng_state, purple_account_to_otrng_client(account));
   otrng_plugin_ensure_server_identity(
       account, purple_account_get_username(account),
-      account_signed_on_after_server_identity, NULL);
+      account_signed_on_after_server_identity, NULL, NULL);
   otrng_debug_exit("account_signed_on_cb");
 }
 
@@ -217,7 +227,7 @@ static void maybe_publish_prekey_data(void *client_pre, void *ignored) {
   PurpleAccount *account = client_id_to_purple_account(client->client_id);
   otrng_plugin_ensure_server_identity(
       account, purple_account_get_username(account),
-      publishing_after_server_identity, account);
+      publishing_after_server_identity, NULL, account);
   otrng_debug_exit("maybe_publish_prekey_data");
 }
 
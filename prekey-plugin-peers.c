@@ -22,6 +22,9 @@
 
 #include "prekey-plugin-peers.h"
 
+#include <string.h>
+#include <time.h>
+
 #include "prekey-plugin-shared.h"
 
 #include <libotr-ng/alloc.h>
@@ -30,26 +33,32 @@
 #include <libotr-ng/deserialize.h>
 #include <libotr-ng/messaging.h>
 
+#include "dialogs.h"
+#include "i18n.h"
 #include "pidgin-helpers.h"
 #include "prekey-discovery.h"
+#include "prekey-plugin-waiting.h"
 
 extern otrng_global_state_s *otrng_state;
 
+/* Upper bound on how long a retrieved ensemble is kept, even if its profiles
+ * are valid for longer, since the peer may have dropped the prekey by then */
+#define OTRNG_PREKEY_ENSEMBLE_CACHE_MAX_TTL (60 * 60)
+
+/* Upper bound on the number of ensembles cached, across every peer */
+#define OTRNG_PREKEY_ENSEMBLE_CACHE_MAX 256
+
+/* Seconds between retrievals for messages no ensemble could be used for, and
+ * how many retrievals they get before they are dropped */
+#define OTRNG_PREKEY_RETRY_INTERVAL 30
+#define OTRNG_PREKEY_RETRY_MAX 3
+
 typedef struct message_waiting_ctx {
   PurpleAccount *account;
   char *message;
   char *recipient;
-
-  struct message_waiting_ctx *next;
 } message_waiting_ctx;
 
-typedef struct messages_waiting_ctx {
-  const otrng_client_s *client;
-  message_waiting_ctx *msg;
-
-  struct messages_waiting_ctx *next;
-} messages_waiting_ctx;
-
 void no_prekey_in_storage_received_cb(otrng_client_s *client,
                                       const char *identity) {
   otrng_debug_fprintf(
@@ -59,31 +68,43 @@ void no_prekey_in_storage_received_cb(otrng_client_s *client,
       client->client_id.account);
 }
 
-static void send_offline_messages_to_each_ensemble(
-    prekey_ensemble_s *const *const ensembles, uint8_t num_ensembles,
-    message_waiting_ctx *ctx) {
-
-  PurpleAccount *account = ctx->account;
-  const char *message = ctx->message;
-  const char *recipient = ctx->recipient;
+static void send_encrypted(otrng_client_s *client, PurpleAccount *account,
+                           const char *recipient, const char *message) {
+  char *to_send = NULL;
 
-  otrng_client_s *client =
-      otrng_client_get(otrng_state, purple_account_to_client_id(account));
-  if (!client) {
+  if (otrng_failed(otrng_client_send(&to_send, message, recipient, client))) {
+    // TODO: error
     return;
   }
+
+  send_message(account, recipient, to_send);
+  free(to_send);
+}
+
+/* Starts a non-interactive DAKE through every valid ensemble, and sends
+ * message in each of the conversations set up. Returns FALSE if none of the
+ * ensembles could be used. */
+static gboolean send_to_each_ensemble(otrng_client_s *client,
+                                      PurpleAccount *account,
+                                      const char *recipient,
+                                      prekey_ensemble_s *const *const ensembles,
+                                      uint8_t num_ensembles,
+                                      const char *message) {
+  gboolean sent = FALSE;
+  int i;
+
   otrng_client_ensure_correct_state(client);
   trigger_potential_publishing(client);
 
-  int i;
   for (i = 0; i < num_ensembles; i++) {
+    char *to_send = NULL;
+
     if (!otrng_prekey_ensemble_validate(ensembles[i])) {
       otrng_debug_fprintf(stderr, "[%s] The Prekey Ensemble %d is not valid\n",
                           client->client_id.account, i);
       continue;
     }
 
-    char *to_send = NULL;
     if (otrng_failed(otrng_client_send_non_interactive_auth(
             &to_send, ensembles[i], recipient, client))) {
       // TODO: error
@@ -93,100 +114,332 @@ static void send_offline_messages_to_each_ensemble(
     send_message(account, recipient, to_send);
     free(to_send);
 
-    if (otrng_failed(otrng_client_send(&to_send, message, recipient, client))) {
-      // TODO: error
-      continue;
-    }
-
-    send_message(account, recipient, to_send);
-    free(to_send);
+    send_encrypted(client, account, recipient, message);
+    sent = TRUE;
   }
 
-  // 1. Build a offline message for each received ensemble
-  // 2. Send each message through the network
-  // 3. Send a single query message (dependencia na outra direção).
+  return sent;
 }
 
-static messages_waiting_ctx *prekey_waiting_to_send_messages = NULL;
+typedef struct {
+  prekey_ensemble_s *ensemble;
+  time_t expires;
+} cached_ensemble_s;
+
+/* client -> recipient -> instance tag -> cached_ensemble_s. Only ensembles
+ * nobody was waiting for when they arrived are kept. Every ensemble carries a
+ * single prekey message, so an entry is removed as soon as it is used. */
+static GHashTable *prekey_ensemble_cache = NULL;
+static guint cached_ensembles = 0;
 
-static messages_waiting_ctx *
-find_messages_waiting_for_client(const otrng_client_s *client) {
-  messages_waiting_ctx *curr = prekey_waiting_to_send_messages;
+static void cached_ensemble_free(gpointer data) {
+  cached_ensemble_s *cached = data;
 
-  for (; curr != NULL; curr = curr->next) {
-    if (curr->client == client) {
-      return curr;
+  otrng_prekey_ensemble_free(cached->ensemble);
+  free(cached);
+  cached_ensembles--;
+}
+
+static GHashTable *ensembles_for(const otrng_client_s *client,
+                                 const char *recipient, gboolean create) {
+  GHashTable *peers = g_hash_table_lookup(prekey_ensemble_cache, client);
+  GHashTable *by_instance;
+
+  if (!peers) {
+    if (!create) {
+      return NULL;
     }
+    peers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  (GDestroyNotify)g_hash_table_destroy);
+    g_hash_table_insert(prekey_ensemble_cache, (gpointer)client, peers);
   }
 
-  return NULL;
+  by_instance = g_hash_table_lookup(peers, recipient);
+  if (!by_instance && create) {
+    by_instance = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                        cached_ensemble_free);
+    g_hash_table_insert(peers, g_strdup(recipient), by_instance);
+  }
+
+  return by_instance;
 }
 
-static message_waiting_ctx *
-pop_waiting_message_for(const otrng_client_s *client, const char *recipient) {
-  message_waiting_ctx *curr = NULL, *prev = NULL;
-  messages_waiting_ctx *msgs = find_messages_waiting_for_client(client);
+static time_t ensemble_expiry(const prekey_ensemble_s *ensemble, time_t now) {
+  time_t expires = now + OTRNG_PREKEY_ENSEMBLE_CACHE_MAX_TTL;
 
-  if (msgs == NULL) {
-    return NULL;
+  if ((time_t)ensemble->client_profile->expires < expires) {
+    expires = ensemble->client_profile->expires;
+  }
+  if ((time_t)ensemble->prekey_profile->expires < expires) {
+    expires = ensemble->prekey_profile->expires;
   }
 
-  for (curr = msgs->msg; curr != NULL; curr = curr->next) {
-    if (strcmp(curr->recipient, recipient) == 0) {
-      if (prev == NULL) {
-        msgs->msg = curr->next;
-      } else {
-        prev->next = curr->next;
+  return expires;
+}
+
+/* Drops every expired ensemble from the cache */
+static void expire_cached_ensembles(time_t now) {
+  GHashTableIter clients, peers, instances;
+  gpointer value;
+
+  g_hash_table_iter_init(&clients, prekey_ensemble_cache);
+  while (g_hash_table_iter_next(&clients, NULL, &value)) {
+    g_hash_table_iter_init(&peers, value);
+    while (g_hash_table_iter_next(&peers, NULL, &value)) {
+      g_hash_table_iter_init(&instances, value);
+      while (g_hash_table_iter_next(&instances, NULL, &value)) {
+        if (((cached_ensemble_s *)value)->expires <= now) {
+          g_hash_table_iter_remove(&instances);
+        }
       }
-      curr->next = NULL;
-      return curr;
     }
-    prev = curr;
   }
-
-  return NULL;
 }
 
-static void free_waiting_message(message_waiting_ctx *head) {
-  message_waiting_ctx *curr = head, *next = NULL;
+/* Validates the received ensembles and takes them over into the cache. A
+ * newer ensemble replaces the one cached for the same instance tag. */
+static void cache_ensembles(const otrng_client_s *client, const char *recipient,
+                            prekey_ensemble_s *const *const ensembles,
+                            uint8_t num_ensembles) {
+  GHashTable *by_instance = NULL;
+  time_t now = time(NULL);
+  int i;
+
+  if (cached_ensembles + num_ensembles > OTRNG_PREKEY_ENSEMBLE_CACHE_MAX) {
+    expire_cached_ensembles(now);
+  }
+
+  for (i = 0; i < num_ensembles; i++) {
+    cached_ensemble_s *cached;
+
+    if (cached_ensembles >= OTRNG_PREKEY_ENSEMBLE_CACHE_MAX) {
+      otrng_debug_fprintf(stderr, "[%s] Prekey ensemble cache is full\n",
+                          client->client_id.account);
+      return;
+    }
+
+    if (!otrng_prekey_ensemble_validate(ensembles[i])) {
+      otrng_debug_fprintf(stderr, "[%s] The Prekey Ensemble %d is not valid\n",
+                          client->client_id.account, i);
+      continue;
+    }
+
+    if (!by_instance) {
+      by_instance = ensembles_for(client, recipient, TRUE);
+    }
+
+    cached = otrng_xmalloc_z(sizeof(cached_ensemble_s));
+    cached->expires = ensemble_expiry(ensembles[i], now);
+
+    /* libotr-ng frees the ensembles once this callback returns, so move their
+     * contents out instead of copying every profile */
+    cached->ensemble = otrng_xmalloc_z(sizeof(prekey_ensemble_s));
+    *cached->ensemble = *ensembles[i];
+    memset(ensembles[i], 0, sizeof(prekey_ensemble_s));
 
-  for (; curr != NULL; curr = next) {
-    next = curr->next;
-    free(curr->message);
-    free(curr->recipient);
-    free(curr);
+    cached_ensembles++;
+    g_hash_table_replace(
+        by_instance,
+        GUINT_TO_POINTER(cached->ensemble->client_profile->sender_instance_tag),
+        cached);
   }
 }
 
-static void free_all_waiting_messages() {
-  messages_waiting_ctx *curr = prekey_waiting_to_send_messages, *next = NULL;
+gboolean otrng_prekey_plugin_send_with_cached_ensembles(
+    otrng_client_s *client, PurpleAccount *account, const char *recipient,
+    const char *message) {
+  GHashTable *by_instance;
+  GHashTableIter iter;
+  gpointer value;
+  time_t now = time(NULL);
+  gboolean sent = FALSE;
+
+  if (!client || !prekey_ensemble_cache) {
+    return FALSE;
+  }
+
+  by_instance = ensembles_for(client, recipient, FALSE);
+  if (!by_instance || g_hash_table_size(by_instance) == 0) {
+    return FALSE;
+  }
+
+  otrng_client_ensure_correct_state(client);
+  trigger_potential_publishing(client);
+
+  g_hash_table_iter_init(&iter, by_instance);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    cached_ensemble_s *cached = value;
+    char *to_send = NULL;
 
-  for (; curr != NULL; curr = next) {
-    next = curr->next;
-    free_waiting_message(curr->msg);
-    free(curr);
+    if (cached->expires > now &&
+        otrng_succeeded(otrng_client_send_non_interactive_auth(
+            &to_send, cached->ensemble, recipient, client))) {
+      send_message(account, recipient, to_send);
+      free(to_send);
+
+      send_encrypted(client, account, recipient, message);
+      sent = TRUE;
+    }
+
+    /* Used or expired, the prekey message can not be used again */
+    g_hash_table_iter_remove(&iter);
   }
+
+  return sent;
+}
+
+/* Messages waiting for a prekey ensemble, by client and recipient */
+static otrng_waiting_queue_s *prekey_waiting_to_send_messages = NULL;
+
+static void free_waiting_message(gpointer data) {
+  message_waiting_ctx *ctx = data;
+
+  free(ctx->message);
+  free(ctx->recipient);
+  free(ctx);
 }
 
 void otrng_prekey_plugin_add_to_mapped_prekey_ensembles_responses(
     const otrng_client_s *client, PurpleAccount *account, char *message,
     char *recipient) {
   message_waiting_ctx *ctx = malloc(sizeof(message_waiting_ctx));
-  messages_waiting_ctx *msgs = find_messages_waiting_for_client(client);
-
-  if (msgs == NULL) {
-    msgs = malloc(sizeof(messages_waiting_ctx));
-    msgs->client = client;
-    msgs->msg = NULL;
-    msgs->next = prekey_waiting_to_send_messages;
-    prekey_waiting_to_send_messages = msgs;
+  if (!ctx) {
+    free(recipient);
+    return;
   }
 
   ctx->account = account;
   ctx->message = g_strdup(message);
   ctx->recipient = recipient;
-  ctx->next = msgs->msg;
-  msgs->msg = ctx;
+
+  otrng_waiting_queue_push(prekey_waiting_to_send_messages, client, recipient,
+                           ctx);
+}
+
+/* Retrievals made again for messages no received ensemble could be used for.
+ * The messages stay in the waiting queue meanwhile. */
+typedef struct {
+  otrng_client_s *client;
+  PurpleAccount *account;
+  char *recipient;
+  int attempts;
+  guint timer;
+} retrieval_retry_s;
+
+static GList *retrieval_retries = NULL;
+
+static retrieval_retry_s *find_retry(const otrng_client_s *client,
+                                     const char *recipient) {
+  GList *l;
+
+  for (l = retrieval_retries; l; l = l->next) {
+    retrieval_retry_s *retry = l->data;
+    if (retry->client == client && strcmp(retry->recipient, recipient) == 0) {
+      return retry;
+    }
+  }
+
+  return NULL;
+}
+
+static void retry_free(retrieval_retry_s *retry) {
+  if (retry->timer) {
+    purple_timeout_remove(retry->timer);
+  }
+  g_free(retry->recipient);
+  g_free(retry);
+}
+
+static void forget_retry(const otrng_client_s *client, const char *recipient) {
+  retrieval_retry_s *retry = find_retry(client, recipient);
+
+  if (retry) {
+    retrieval_retries = g_list_remove(retrieval_retries, retry);
+    retry_free(retry);
+  }
+}
+
+static void schedule_retry(otrng_client_s *client, PurpleAccount *account,
+                           const char *recipient);
+
+static gboolean retry_retrieval_cb(gpointer data) {
+  retrieval_retry_s *retry = data;
+  char *domain =
+      otrng_plugin_prekey_domain_for(retry->account, retry->recipient);
+  otrng_prekey_server_s *si =
+      domain ? otrng_prekey_get_server_identity_for(retry->client, domain)
+             : NULL;
+  char *query = NULL;
+
+  retry->timer = 0;
+  retry->attempts++;
+
+  if (si) {
+    otrng_prekey_retrieve_prekeys(&query, retry->client, retry->recipient,
+                                  "4");
+  }
+  g_free(domain);
+
+  if (query) {
+    send_message(retry->account, si->identity, query);
+    free(query);
+  } else {
+    /* No response will come to try again from */
+    schedule_retry(retry->client, retry->account, retry->recipient);
+  }
+
+  return FALSE;
+}
+
+/* Tells the user about every message still waiting for recipient, and drops
+ * them */
+static void drop_waiting_messages(otrng_client_s *client,
+                                  const char *recipient) {
+  message_waiting_ctx *msg;
+
+  while ((msg = otrng_waiting_queue_pop(prekey_waiting_to_send_messages,
+                                        client, recipient)) != NULL) {
+    /* Empty messages only start an offline conversation */
+    if (msg->message[0] != '\0') {
+      char *text = g_strdup_printf(
+          _("The offline message to %s could not be sent: none of the "
+            "prekey ensembles received could be used."),
+          recipient);
+      otrng_dialog_display_otr_message(
+          purple_account_get_username(msg->account),
+          purple_account_get_protocol_id(msg->account), recipient, text, 1);
+      g_free(text);
+    }
+    free_waiting_message(msg);
+  }
+}
+
+/* Retrieves ensembles again later for the messages waiting for recipient,
+ * or gives up on them once that was tried often enough */
+static void schedule_retry(otrng_client_s *client, PurpleAccount *account,
+                           const char *recipient) {
+  retrieval_retry_s *retry = find_retry(client, recipient);
+
+  if (!retry) {
+    retry = g_new0(retrieval_retry_s, 1);
+    retry->client = client;
+    retry->account = account;
+    retry->recipient = g_strdup(recipient);
+    retrieval_retries = g_list_prepend(retrieval_retries, retry);
+  }
+
+  if (retry->timer) {
+    return;
+  }
+
+  if (retry->attempts >= OTRNG_PREKEY_RETRY_MAX) {
+    drop_waiting_messages(client, recipient);
+    forget_retry(client, recipient);
+    return;
+  }
+
+  retry->timer = purple_timeout_add_seconds(OTRNG_PREKEY_RETRY_INTERVAL,
+                                            retry_retrieval_cb, retry);
 }
 
 void prekey_ensembles_received_cb(otrng_client_s *client,
@@ -197,20 +450,75 @@ void prekey_ensembles_received_cb(otrng_client_s *client,
 
   if (!identity) {
     otrng_debug_fprintf(stderr, "Invalid NULL identity\n");
+    return;
+  }
+
+  /* Every message waiting for this recipient is sent now: the first one
+   * through the ensembles, which are single use, and the rest over the
+   * conversations they set up. If the ensembles could not be used, the
+   * messages wait for a retrieval to be retried. Ensembles nobody was
+   * waiting for are cached for the next send. */
+  GQueue unsent = G_QUEUE_INIT;
+  PurpleAccount *account = NULL;
+  message_waiting_ctx *msg;
+  gboolean sent = FALSE;
+  gboolean waiting = FALSE;
+  while ((msg = otrng_waiting_queue_pop(prekey_waiting_to_send_messages,
+                                        client, identity)) != NULL) {
+    waiting = TRUE;
+    account = msg->account;
+    if (sent) {
+      send_encrypted(client, msg->account, identity, msg->message);
+    } else if (g_queue_is_empty(&unsent) &&
+               send_to_each_ensemble(client, msg->account, identity, ensembles,
+                                     num_ensembles, msg->message)) {
+      sent = TRUE;
+    } else {
+      g_queue_push_tail(&unsent, msg);
+      continue;
+    }
+    free_waiting_message(msg);
+  }
+
+  if (!waiting) {
+    cache_ensembles(client, identity, ensembles, num_ensembles);
+    return;
+  }
+
+  if (g_queue_is_empty(&unsent)) {
+    forget_retry(client, identity);
+    return;
   }
 
-  message_waiting_ctx *msg = pop_waiting_message_for(client, identity);
-  send_offline_messages_to_each_ensemble(ensembles, num_ensembles, msg);
+  otrng_debug_fprintf(stderr,
+                      "[%s] Prekey Server: no usable ensemble, %u messages "
+                      "keep waiting\n",
+                      client->client_id.account, g_queue_get_length(&unsent));
 
-  free(msg->message);
-  free(msg->recipient);
-  free(msg);
+  while ((msg = g_queue_pop_head(&unsent)) != NULL) {
+    otrng_waiting_queue_push(prekey_waiting_to_send_messages, client, identity,
+                             msg);
+  }
+  schedule_retry(client, account, identity);
 }
 
-gboolean otrng_prekey_plugin_peers_load(PurplePlugin *handle) { return TRUE; }
+gboolean otrng_prekey_plugin_peers_load(PurplePlugin *handle) {
+  prekey_waiting_to_send_messages =
+      otrng_waiting_queue_new(free_waiting_message);
+  prekey_ensemble_cache =
+      g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                            (GDestroyNotify)g_hash_table_destroy);
+
+  return TRUE;
+}
 
 gboolean otrng_prekey_plugin_peers_unload(PurplePlugin *handle) {
-  free_all_waiting_messages();
+  g_list_free_full(retrieval_retries, (GDestroyNotify)retry_free);
+  retrieval_retries = NULL;
+  otrng_waiting_queue_free(prekey_waiting_to_send_messages);
+  prekey_waiting_to_send_messages = NULL;
+  g_hash_table_destroy(prekey_ensemble_cache);
+  prekey_ensemble_cache = NULL;
 
   return TRUE;
 }
@@ -31,6 +31,12 @@
 void otrng_prekey_plugin_add_to_mapped_prekey_ensembles_responses(
     const otrng_client_s *client, PurpleAccount *account, char *message,
     char *recipient);
+/* Sends message to recipient through the unused prekey ensembles cached for
+ * it, one non-interactive DAKE per instance tag. Returns FALSE, sending
+ * nothing, if no cached ensemble is left and a retrieval is needed. */
+gboolean otrng_prekey_plugin_send_with_cached_ensembles(
+    otrng_client_s *client, PurpleAccount *account, const char *recipient,
+    const char *message);
 void no_prekey_in_storage_received_cb(otrng_client_s *client,
                                       const char *identity);
 void prekey_ensembles_received_cb(otrng_client_s *client,
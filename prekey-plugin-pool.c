@@ -0,0 +1,227 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "prekey-plugin-pool.h"
+
+#include <libotr-ng/alloc.h>
+#include <libotr-ng/client_orchestration.h>
+#include <libotr-ng/debug.h>
+#include <libotr-ng/messaging.h>
+#include <libotr-ng/prekey_message.h>
+
+#include "persistance.h"
+
+extern otrng_global_state_s *otrng_state;
+
+/* Building prekey messages means generating an ECDH and a DH keypair for
+ * each of them. Instead of doing that in a burst when the prekey server asks
+ * for more, batches are built ahead of time, one per idle callback, and
+ * publishing just hands a batch over. A batch holds as many messages as the
+ * server last asked for.
+ *
+ * The messages of a batch are in the client's storage as soon as they are
+ * built. Those that end up not being published are deleted from it again, or
+ * they would be kept and persisted forever. */
+
+typedef struct {
+  otrng_client_s *client;
+  /* Of otrng_prekey_publication_message_s, holding only prekey messages */
+  GQueue batches;
+} prekey_pool;
+
+static GHashTable *pools = NULL;
+/* Clients whose pool is being refilled, served round robin */
+static GQueue refill_queue = G_QUEUE_INIT;
+static guint refill_id = 0;
+
+static void batch_free(gpointer data) {
+  otrng_prekey_publication_message_destroy(data);
+  free(data);
+}
+
+/* Deletes the messages of batch from the given one on */
+static void discard_messages(otrng_client_s *client,
+                             otrng_prekey_publication_message_s *batch,
+                             unsigned int from) {
+  unsigned int i;
+
+  if (from >= batch->num_prekey_messages) {
+    return;
+  }
+
+  for (i = from; i < batch->num_prekey_messages; i++) {
+    prekey_message_s *message = batch->prekey_messages[i];
+
+    if (message) {
+      otrng_client_delete_my_prekey_message_by_id(message->id, client);
+      otrng_prekey_message_free(message);
+      batch->prekey_messages[i] = NULL;
+    }
+  }
+
+  batch->num_prekey_messages = from;
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_PREKEY_MESSAGES);
+}
+
+static void prekey_pool_free(gpointer data) {
+  prekey_pool *pool = data;
+  otrng_prekey_publication_message_s *batch;
+
+  while ((batch = g_queue_pop_head(&pool->batches))) {
+    discard_messages(pool->client, batch, 0);
+    batch_free(batch);
+  }
+  g_free(pool);
+}
+
+static prekey_pool *get_pool(otrng_client_s *client) {
+  prekey_pool *pool = g_hash_table_lookup(pools, client);
+
+  if (!pool) {
+    pool = g_new0(prekey_pool, 1);
+    pool->client = client;
+    g_queue_init(&pool->batches);
+    g_hash_table_insert(pools, client, pool);
+  }
+
+  return pool;
+}
+
+static otrng_prekey_publication_message_s *build_batch(otrng_client_s *client) {
+  otrng_prekey_publication_message_s *batch;
+
+  /* libotr-ng builds as many messages as the server last asked for. Until
+   * it asks, there is nothing to build. */
+  if (client->prekey_msgs_num_to_publish == 0) {
+    return NULL;
+  }
+
+  batch = otrng_xmalloc_z(sizeof(otrng_prekey_publication_message_s));
+  otrng_prekey_add_prekey_messages_for_publication(client, batch);
+
+  if (batch->num_prekey_messages == 0) {
+    batch_free(batch);
+    return NULL;
+  }
+
+  return batch;
+}
+
+static gboolean refill_step_cb(gpointer data) {
+  otrng_client_s *client = g_queue_pop_head(&refill_queue);
+  prekey_pool *pool;
+
+  if (client) {
+    pool = get_pool(client);
+
+    if (g_queue_get_length(&pool->batches) < OTRNG_PREKEY_POOL_MAX_BATCHES) {
+      otrng_prekey_publication_message_s *batch = build_batch(client);
+      if (batch) {
+        g_queue_push_tail(&pool->batches, batch);
+        otrng_debug_fprintf(stderr,
+                            "[%s] Prekey pool: %u batches ready\n",
+                            client->client_id.account,
+                            g_queue_get_length(&pool->batches));
+      }
+
+      if (batch &&
+          g_queue_get_length(&pool->batches) < OTRNG_PREKEY_POOL_MAX_BATCHES) {
+        g_queue_push_tail(&refill_queue, client);
+      }
+    }
+  }
+
+  if (g_queue_is_empty(&refill_queue)) {
+    refill_id = 0;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+void otrng_prekey_pool_refill(otrng_client_s *client) {
+  if (!pools || !client) {
+    return;
+  }
+
+  if (g_queue_get_length(&get_pool(client)->batches) >=
+          OTRNG_PREKEY_POOL_LOW_BATCHES ||
+      g_queue_find(&refill_queue, client)) {
+    return;
+  }
+
+  g_queue_push_tail(&refill_queue, client);
+
+  if (!refill_id) {
+    refill_id = g_idle_add_full(G_PRIORITY_LOW, refill_step_cb, NULL, NULL);
+  }
+}
+
+gboolean otrng_prekey_pool_take(otrng_client_s *client,
+                                otrng_prekey_publication_message_s *msg,
+                                unsigned int wanted) {
+  otrng_prekey_publication_message_s *batch;
+
+  if (!pools || wanted == 0) {
+    return FALSE;
+  }
+
+  batch = g_queue_pop_head(&get_pool(client)->batches);
+  otrng_prekey_pool_refill(client);
+
+  if (!batch) {
+    return FALSE;
+  }
+
+  /* The server may want fewer than when the batch was built. If it wants
+   * more, it asks for the rest once it has these. */
+  discard_messages(client, batch, wanted);
+
+  /* The batch was built by the same libotr-ng call on an empty message, so
+   * moving it over the empty msg is the same as building it in place */
+  *msg = *batch;
+  free(batch);
+
+  return TRUE;
+}
+
+gboolean otrng_prekey_plugin_pool_load(PurplePlugin *handle) {
+  pools = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                prekey_pool_free);
+  return TRUE;
+}
+
+gboolean otrng_prekey_plugin_pool_unload(PurplePlugin *handle) {
+  if (refill_id) {
+    g_source_remove(refill_id);
+    refill_id = 0;
+  }
+
+  g_queue_clear(&refill_queue);
+
+  if (pools) {
+    g_hash_table_destroy(pools);
+    pools = NULL;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,50 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef OTRNG_PIDGIN_PREKEY_PLUGIN_POOL
+#define OTRNG_PIDGIN_PREKEY_PLUGIN_POOL
+
+#include <glib.h>
+#include <plugin.h>
+
+#include <libotr-ng/client.h>
+
+/* Ready-made batches kept per client, and the number below which the pool is
+ * refilled */
+#define OTRNG_PREKEY_POOL_MAX_BATCHES 3
+#define OTRNG_PREKEY_POOL_LOW_BATCHES 2
+
+/* Fills the pool of client from the main loop's idle time, if it is below
+ * its low watermark */
+void otrng_prekey_pool_refill(otrng_client_s *client);
+
+/* Moves a ready-made batch of at most wanted prekey messages into msg.
+ * Returns FALSE if the pool is empty or nothing is wanted, in which case the
+ * messages have to be built on demand. */
+gboolean otrng_prekey_pool_take(otrng_client_s *client,
+                                otrng_prekey_publication_message_s *msg,
+                                unsigned int wanted);
+
+gboolean otrng_prekey_plugin_pool_load(PurplePlugin *handle);
+gboolean otrng_prekey_plugin_pool_unload(PurplePlugin *handle);
+
+#endif // OTRNG_PIDGIN_PREKEY_PLUGIN_POOL
@@ -68,14 +68,34 @@ static void
 found_plugin_prekey_server_for_server_identity(otrng_plugin_prekey_server *srv,
                                                void *ctx) {
   lookup_prekey_server_for_server_identity_ctx_s *cc = ctx;
+
+  if (!srv) {
+    /* The lookup is over */
+    if (cc->found == 0 && cc->revalidating) {
+      /* The known server is gone, do not keep using it in later sessions */
+      otrng_plugin_prekey_server_forget(cc->domain);
+    } else if (cc->found == 0) {
+      otrng_debug_fprintf(stderr, "No prekey server found for domain %s\n",
+                          cc->domain);
+      if (cc->failed) {
+        cc->failed(cc->account, cc->client, cc->ctx);
+      }
+    }
+    free(cc->domain);
+    free(cc);
+    return;
+  }
+
   otrng_debug_fprintf(
       stderr, "We received server identity for domain %s - prekey server %s\n",
       cc->domain, srv->identity);
   otrng_prekey_provide_server_identity_for(
       cc->client, cc->domain, srv->identity, (uint8_t *)srv->fingerprint);
+  otrng_plugin_prekey_server_remember(cc->domain, srv);
+  g_free(srv->identity);
   free(srv);
 
-  if (cc->found == 0) {
+  if (cc->found == 0 && cc->next) {
     cc->next(cc->account, cc->client, cc->ctx);
   }
   cc->found++;
@@ -83,12 +103,40 @@ found_plugin_prekey_server_for_server_identity(otrng_plugin_prekey_server *srv,
 
 void otrng_plugin_ensure_server_identity(PurpleAccount *account,
                                          const char *username,
-                                         AfterServerIdentity cb, void *uctx) {
+                                         AfterServerIdentity cb,
+                                         NoServerIdentity failed, void *uctx) {
   otrng_debug_enter("otrng_plugin_ensure_server_identity");
-  otrng_client_s *client =
-      otrng_client_get(otrng_state, purple_account_to_client_id(account));
+  otrng_client_s *client = purple_account_to_otrng_client(account);
   otrng_prekey_plugin_ensure_prekey_manager(client);
   char *domain = otrng_plugin_prekey_domain_for(account, username);
+  otrng_plugin_prekey_server *known = NULL;
+
+  if (otrng_prekey_has_server_identity_for(client, domain) != otrng_true &&
+      (known = otrng_plugin_prekey_server_known_for(domain)) != NULL) {
+    /* Known from a previous session: use it right away and look it up again
+     * in the background, instead of making this caller wait for discovery */
+    otrng_prekey_provide_server_identity_for(client, domain, known->identity,
+                                             (uint8_t *)known->fingerprint);
+    g_free(known->identity);
+    free(known);
+
+    if (otrng_plugin_prekey_server_needs_revalidation(domain)) {
+      lookup_prekey_server_for_server_identity_ctx_s *lctx =
+          otrng_xmalloc_z(sizeof(*lctx));
+      lctx->account = account;
+      lctx->client = client;
+      /* The caller is served below, so results only refresh the identity */
+      lctx->revalidating = TRUE;
+      lctx->domain = g_strdup(domain);
+      if (!otrng_plugin_lookup_prekey_servers_for(
+              account, username,
+              found_plugin_prekey_server_for_server_identity, lctx)) {
+        free(lctx->domain);
+        free(lctx);
+      }
+    }
+  }
+
   if (otrng_prekey_has_server_identity_for(client, domain) != otrng_true) {
     lookup_prekey_server_for_server_identity_ctx_s *lctx =
         otrng_xmalloc_z(sizeof(lookup_prekey_server_for_server_identity_ctx_s));
@@ -96,14 +144,21 @@ void otrng_plugin_ensure_server_identity(PurpleAccount *account,
     lctx->client = client;
     lctx->found = 0;
     lctx->next = cb;
+    lctx->failed = failed;
     lctx->ctx = uctx;
     lctx->domain = domain;
-    // TODO: take care of error here
-    otrng_plugin_lookup_prekey_servers_for(
-        account, username, found_plugin_prekey_server_for_server_identity,
-        lctx);
+    if (!otrng_plugin_lookup_prekey_servers_for(
+            account, username, found_plugin_prekey_server_for_server_identity,
+            lctx)) {
+      free(lctx->domain);
+      free(lctx);
+      if (failed) {
+        failed(account, client, uctx);
+      }
+    }
     otrng_debug_exit("otrng_plugin_ensure_server_identity");
   } else {
+    free(domain);
     cb(account, client, uctx);
     otrng_debug_exit("otrng_plugin_ensure_server_identity");
   }
@@ -29,12 +29,19 @@
 
 typedef void (*AfterServerIdentity)(PurpleAccount *, otrng_client_s *, void *);
 
+/* Called instead of the AfterServerIdentity callback when no prekey server
+ * could be found, so the caller can give up on what was waiting for it */
+typedef void (*NoServerIdentity)(PurpleAccount *, otrng_client_s *, void *);
+
 typedef struct {
   PurpleAccount *account;
   otrng_client_s *client;
   int found;
+  /* Looking up a server known from a previous session again */
+  gboolean revalidating;
   char *domain;
   AfterServerIdentity next;
+  NoServerIdentity failed;
   void *ctx;
 } lookup_prekey_server_for_server_identity_ctx_s;
 
@@ -43,8 +50,11 @@ void trigger_potential_publishing(otrng_client_s *client);
 void send_message(PurpleAccount *account, const char *recipient,
                   const char *message);
 
+/* Calls cb once a prekey server is known for the domain of username, or
+ * failed, which may be NULL, if none can be found. */
 void otrng_plugin_ensure_server_identity(PurpleAccount *account,
                                          const char *username,
-                                         AfterServerIdentity cb, void *uctx);
+                                         AfterServerIdentity cb,
+                                         NoServerIdentity failed, void *uctx);
 
 #endif // OTRNG_PIDGIN_PREKEY_PLUGIN_SHARED
@@ -0,0 +1,140 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "prekey-plugin-waiting.h"
+
+#include <string.h>
+
+typedef struct {
+  const void *client;
+  char *recipient;
+} waiting_key_s;
+
+struct otrng_waiting_queue_s {
+  /* waiting_key_s -> GQueue. Empty queues are removed, so the table only
+   * holds recipients that are actually waiting for something. */
+  GHashTable *queues;
+  GDestroyNotify free_item;
+  guint size;
+};
+
+static guint waiting_key_hash(gconstpointer data) {
+  const waiting_key_s *key = data;
+  return g_direct_hash(key->client) ^ g_str_hash(key->recipient);
+}
+
+static gboolean waiting_key_equal(gconstpointer a, gconstpointer b) {
+  const waiting_key_s *ka = a, *kb = b;
+  return ka->client == kb->client && strcmp(ka->recipient, kb->recipient) == 0;
+}
+
+static void waiting_key_free(gpointer data) {
+  waiting_key_s *key = data;
+  g_free(key->recipient);
+  g_free(key);
+}
+
+otrng_waiting_queue_s *otrng_waiting_queue_new(GDestroyNotify free_item) {
+  otrng_waiting_queue_s *queue = g_new0(otrng_waiting_queue_s, 1);
+
+  queue->queues = g_hash_table_new_full(waiting_key_hash, waiting_key_equal,
+                                        waiting_key_free, NULL);
+  queue->free_item = free_item;
+
+  return queue;
+}
+
+void otrng_waiting_queue_free(otrng_waiting_queue_s *queue) {
+  GHashTableIter iter;
+  gpointer value;
+
+  if (!queue) {
+    return;
+  }
+
+  g_hash_table_iter_init(&iter, queue->queues);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    GQueue *items = value;
+    gpointer item;
+
+    while ((item = g_queue_pop_head(items)) != NULL) {
+      if (queue->free_item) {
+        queue->free_item(item);
+      }
+    }
+    g_queue_free(items);
+  }
+
+  g_hash_table_destroy(queue->queues);
+  g_free(queue);
+}
+
+void otrng_waiting_queue_push(otrng_waiting_queue_s *queue, const void *client,
+                              const char *recipient, gpointer item) {
+  waiting_key_s lookup = {client, (char *)recipient};
+  GQueue *items;
+
+  g_return_if_fail(recipient != NULL && item != NULL);
+
+  items = g_hash_table_lookup(queue->queues, &lookup);
+  if (!items) {
+    waiting_key_s *key = g_new(waiting_key_s, 1);
+    key->client = client;
+    key->recipient = g_strdup(recipient);
+
+    items = g_queue_new();
+    g_hash_table_insert(queue->queues, key, items);
+  }
+
+  g_queue_push_tail(items, item);
+  queue->size++;
+}
+
+gpointer otrng_waiting_queue_pop(otrng_waiting_queue_s *queue,
+                                 const void *client, const char *recipient) {
+  waiting_key_s lookup = {client, (char *)recipient};
+  GQueue *items;
+  gpointer item;
+
+  if (!recipient) {
+    return NULL;
+  }
+
+  items = g_hash_table_lookup(queue->queues, &lookup);
+  if (!items) {
+    return NULL;
+  }
+
+  item = g_queue_pop_head(items);
+  queue->size--;
+
+  if (g_queue_is_empty(items)) {
+    g_hash_table_remove(queue->queues, &lookup);
+    g_queue_free(items);
+  }
+
+  return item;
+}
+
+guint otrng_waiting_queue_size(const otrng_waiting_queue_s *queue) {
+  return queue->size;
+}
@@ -0,0 +1,48 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef OTRNG_PIDGIN_PREKEY_PLUGIN_WAITING
+#define OTRNG_PIDGIN_PREKEY_PLUGIN_WAITING
+
+#include <glib.h>
+
+/* Messages waiting for a prekey ensemble, kept in one FIFO queue per client
+ * and recipient. The client is only used as a key and is never dereferenced,
+ * so this does not depend on libotr-ng. */
+typedef struct otrng_waiting_queue_s otrng_waiting_queue_s;
+
+/* free_item is called on the items still queued when the queue is freed */
+otrng_waiting_queue_s *otrng_waiting_queue_new(GDestroyNotify free_item);
+void otrng_waiting_queue_free(otrng_waiting_queue_s *queue);
+
+void otrng_waiting_queue_push(otrng_waiting_queue_s *queue, const void *client,
+                              const char *recipient, gpointer item);
+
+/* Returns the oldest item waiting for recipient of client, or NULL if there
+ * is none */
+gpointer otrng_waiting_queue_pop(otrng_waiting_queue_s *queue,
+                                 const void *client, const char *recipient);
+
+/* Number of items waiting, across every client and recipient */
+guint otrng_waiting_queue_size(const otrng_waiting_queue_s *queue);
+
+#endif // OTRNG_PIDGIN_PREKEY_PLUGIN_WAITING
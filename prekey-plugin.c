@@ -23,6 +23,7 @@
 #include "prekey-plugin.h"
 #include "prekey-plugin-account.h"
 #include "prekey-plugin-peers.h"
+#include "prekey-plugin-pool.h"
 #include "prekey-plugin-shared.h"
 
 /* If we're using glib on Windows, we need to use g_fopen to open files.
@@ -124,8 +125,7 @@ static gboolean receive_prekey_protocol_message(char **tosend,
                                                 const char *server,
                                                 const char *message,
                                                 PurpleAccount *account) {
-  otrng_client_s *client =
-      otrng_client_get(otrng_state, purple_account_to_client_id(account));
+  otrng_client_s *client = purple_account_to_otrng_client(account);
   if (!client) {
     return FALSE;
   }
@@ -173,6 +173,7 @@ gboolean otrng_prekey_plugin_load(PurplePlugin *handle) {
   purple_signal_connect(purple_conversations_get_handle(), "receiving-im-msg",
                         handle, PURPLE_CALLBACK(receiving_im_msg_cb), NULL);
 
+  otrng_prekey_plugin_pool_load(handle);
   otrng_prekey_plugin_account_load(handle);
   otrng_prekey_plugin_peers_load(handle);
 
@@ -186,6 +187,7 @@ gboolean otrng_prekey_plugin_unload(PurplePlugin *handle) {
   otrng_debug_enter("otrng_prekey_plugin_unload");
   otrng_prekey_plugin_peers_unload(handle);
   otrng_prekey_plugin_account_unload(handle);
+  otrng_prekey_plugin_pool_unload(handle);
 
   purple_signal_disconnect(purple_conversations_get_handle(),
                            "receiving-im-msg", handle,
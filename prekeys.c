@@ -30,11 +30,11 @@
 extern otrng_global_state_s *otrng_state;
 
 static void load_prekey_messages(otrng_client_s *client) {
-  persistance_read_prekey_messages(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_PREKEY_MESSAGES);
 }
 
 static void store_prekey_messages(otrng_client_s *client) {
-  persistance_write_prekey_messages(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_PREKEY_MESSAGES);
 }
 
 void prekeys_set_callbacks(otrng_client_callbacks_s *callbacks) {
@@ -33,7 +33,7 @@ static void create_client_profile(otrng_client_s *client) {
 }
 
 static void load_client_profile(otrng_client_s *client) {
-  persistance_read_client_profile(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_CLIENT_PROFILE);
 }
 
 static void create_prekey_profile(otrng_client_s *client) {
@@ -41,31 +41,31 @@ static void create_prekey_profile(otrng_client_s *client) {
 }
 
 static void load_prekey_profile(otrng_client_s *client) {
-  persistance_read_prekey_profile(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_PREKEY_PROFILE);
 }
 
 static void store_client_profile(otrng_client_s *client) {
-  persistance_write_client_profile_FILEp(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_CLIENT_PROFILE);
 }
 
 static void store_prekey_profile(otrng_client_s *client) {
-  persistance_write_prekey_profile_FILEp(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_PREKEY_PROFILE);
 }
 
 static void store_expired_client_profile(otrng_client_s *client) {
-  persistance_write_expired_client_profile(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_EXP_CLIENT_PROFILE);
 }
 
 static void load_expired_client_profile(otrng_client_s *client) {
-  persistance_read_expired_client_profile(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_EXP_CLIENT_PROFILE);
 }
 
 static void store_expired_prekey_profile(otrng_client_s *client) {
-  persistance_write_expired_prekey_profile(otrng_state);
+  persistance_mark_dirty(otrng_state, client, PERSISTANCE_EXP_PREKEY_PROFILE);
 }
 
 static void load_expired_prekey_profile(otrng_client_s *client) {
-  persistance_read_expired_prekey_profile(otrng_state);
+  persistance_read_store(otrng_state, client, PERSISTANCE_EXP_PREKEY_PROFILE);
 }
 
 void profiles_set_callbacks(otrng_client_callbacks_s *callbacks) {
@@ -22,13 +22,54 @@
 
 #include <glib.h>
 
+#include "test_gtk_keylist.c"
+#include "test_hex_codec.c"
+#include "test_persistance.c"
 #include "test_plugin.c"
+#include "test_plugin_messages.c"
+#include "test_prefix_index.c"
 #include "test_prekey_discovery_jabber.c"
+#include "test_prekey_plugin_waiting.c"
+#include "test_trust_icons.c"
 
 int main(int argc, char **argv) {
   g_test_init(&argc, &argv, NULL);
 
   g_test_add_func("/prekey_discovery/jabber/get_domain_from_jid", test_get_domain_from_jid);
+  g_test_add_func("/prekey_discovery/jabber/shared_and_throttled",
+                  test_prekey_discovery_jabber_shared_and_throttled);
+  g_test_add_func("/prekey_discovery/jabber/expiry",
+                  test_prekey_discovery_jabber_expiry);
+  g_test_add_func("/prekey_discovery/jabber/per_connection",
+                  test_prekey_discovery_jabber_per_connection);
+  g_test_add_func("/gtk_keylist/update_and_search",
+                  test_gtk_keylist_update_and_search);
+  g_test_add_func("/hex_codec/round_trip", test_hex_codec_round_trip);
+  g_test_add_func("/persistance/commit_replaces_file",
+                  test_persistance_commit_replaces_file);
+  g_test_add_func("/persistance/failed_commit_keeps_file",
+                  test_persistance_failed_commit_keeps_file);
+  g_test_add_func("/plugin_messages/replace", test_plugin_messages_replace);
+  g_test_add_func("/prefix_index/search", test_prefix_index_search);
+  g_test_add_func("/prekey_plugin/waiting_queue/fifo_per_recipient",
+                  test_waiting_queue_fifo_per_recipient);
+  g_test_add_func("/prekey_plugin/waiting_queue/stress",
+                  test_waiting_queue_stress);
+  g_test_add_func("/trust_icons/shared", test_trust_icons_shared);
+
+  if (g_test_perf()) {
+    g_test_add_func("/gtk_keylist/speed", test_gtk_keylist_speed);
+    g_test_add_func("/hex_codec/decode_speed", test_hex_codec_decode_speed);
+    g_test_add_func("/persistance/flush_latency",
+                    test_persistance_flush_latency);
+    g_test_add_func("/plugin_messages/receive_allocations",
+                    test_plugin_messages_receive_allocations);
+    g_test_add_func("/plugin_messages/send_allocations",
+                    test_plugin_messages_send_allocations);
+    g_test_add_func("/prefix_index/speed", test_prefix_index_speed);
+    g_test_add_func("/trust_icons/refresh_speed",
+                    test_trust_icons_refresh_speed);
+  }
 
   return g_test_run();
 }
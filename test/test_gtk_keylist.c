@@ -0,0 +1,177 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "../gtk-keylist.h"
+
+static otrng_known_fingerprint_s *make_fingerprints(guint count) {
+  otrng_known_fingerprint_s *fps = g_new0(otrng_known_fingerprint_s, count);
+  guint i;
+
+  for (i = 0; i < count; i++) {
+    fps[i].username = g_strdup_printf("user%06u@example.org", i);
+    memset(fps[i].fp, 0xee, sizeof(fps[i].fp));
+    fps[i].fp[0] = i >> 24;
+    fps[i].fp[1] = i >> 16;
+    fps[i].fp[2] = i >> 8;
+    fps[i].fp[3] = i;
+  }
+
+  return fps;
+}
+
+static void free_fingerprints(otrng_known_fingerprint_s *fps, guint count) {
+  guint i;
+
+  for (i = 0; i < count; i++) {
+    g_free(fps[i].username);
+  }
+  g_free(fps);
+}
+
+/* Goes through the first count fingerprints as otrng_gtk_ui_update_keylist
+ * does through the known ones */
+static void update_keylist(otrng_keylist_s *keylist,
+                           otrng_known_fingerprint_s *fps, guint count,
+                           const char *status) {
+  otrng_client_id_s client_id = {
+      .protocol = "prpl-jabber",
+      .account = "alice@example.org",
+  };
+  guint i;
+
+  otrng_keylist_begin_update(keylist);
+  for (i = 0; i < count; i++) {
+    otrng_keylist_update_row(keylist, client_id, &fps[i], &fps[i], NULL,
+                             status, "No");
+  }
+  otrng_keylist_end_update(keylist);
+}
+
+static gint shown_rows(otrng_keylist_s *keylist) {
+  return gtk_tree_model_iter_n_children(keylist->filter, NULL);
+}
+
+static gboolean hide_odd_rows(const otrng_keylist_row_s *row, void *data) {
+  return (row->fingerprint[3] & 1) == 0;
+}
+
+void test_gtk_keylist_update_and_search(void) {
+  otrng_known_fingerprint_s *fps = make_fingerprints(4);
+  otrng_keylist_s *keylist = otrng_keylist_new(NULL, NULL);
+  otrng_keylist_row_s *row;
+  gchar *status = NULL;
+
+  update_keylist(keylist, fps, 3, "Private");
+  g_assert_cmpint(shown_rows(keylist), ==, 3);
+  row = g_hash_table_lookup(keylist->rows, &fps[1]);
+  g_assert(row != NULL);
+
+  /* A changed state is set on the row in place */
+  update_keylist(keylist, fps, 3, "Finished");
+  g_assert(g_hash_table_lookup(keylist->rows, &fps[1]) == row);
+  gtk_tree_model_get(GTK_TREE_MODEL(keylist->store), &row->iter,
+                     KEYLIST_COLUMN_STATUS, &status, -1);
+  g_assert_cmpstr(status, ==, "Finished");
+  g_free(status);
+
+  otrng_keylist_search(keylist, " USER000001");
+  g_assert_cmpint(shown_rows(keylist), ==, 1);
+
+  /* Fingerprints are searched as written, in groups */
+  otrng_keylist_search(keylist, "00000002 EEEE");
+  g_assert_cmpint(shown_rows(keylist), ==, 1);
+
+  /* A fingerprint added while searching shows up if it matches */
+  otrng_keylist_search(keylist, "user00000");
+  g_assert_cmpint(shown_rows(keylist), ==, 3);
+  update_keylist(keylist, fps, 4, "Finished");
+  g_assert_cmpint(shown_rows(keylist), ==, 4);
+
+  otrng_keylist_search(keylist, "carol");
+  g_assert_cmpint(shown_rows(keylist), ==, 0);
+
+  /* Forgotten fingerprints lose their row and their keys */
+  otrng_keylist_search(keylist, "");
+  update_keylist(keylist, fps, 2, "Finished");
+  g_assert_cmpint(shown_rows(keylist), ==, 2);
+  g_assert_cmpuint(otrng_prefix_index_size(keylist->search), ==, 4);
+
+  otrng_keylist_free(keylist);
+
+  keylist = otrng_keylist_new(hide_odd_rows, NULL);
+  update_keylist(keylist, fps, 4, "Private");
+  g_assert_cmpint(shown_rows(keylist), ==, 2);
+  otrng_keylist_free(keylist);
+
+  free_fingerprints(fps, 4);
+}
+
+/* Fills the fingerprint manager's keylist with 100k fingerprints, updates
+ * it as a refresh does, searches it and drops half of it, on the models the
+ * fingerprint manager shows. Needs no display. Only runs with -m perf. */
+void test_gtk_keylist_speed(void) {
+  const guint rows = 100000;
+  otrng_known_fingerprint_s *fps = make_fingerprints(rows);
+  otrng_keylist_s *keylist = otrng_keylist_new(NULL, NULL);
+  double populate, refresh, changed, search, clear, forget;
+
+  g_test_timer_start();
+  update_keylist(keylist, fps, rows, "Private");
+  populate = g_test_timer_elapsed();
+
+  g_test_timer_start();
+  update_keylist(keylist, fps, rows, "Private");
+  refresh = g_test_timer_elapsed();
+
+  g_test_timer_start();
+  update_keylist(keylist, fps, rows, "Finished");
+  changed = g_test_timer_elapsed();
+
+  g_test_timer_start();
+  otrng_keylist_search(keylist, "USER0123");
+  search = g_test_timer_elapsed();
+  g_assert_cmpint(shown_rows(keylist), ==, 100);
+
+  g_test_timer_start();
+  otrng_keylist_search(keylist, "");
+  clear = g_test_timer_elapsed();
+  g_assert_cmpint(shown_rows(keylist), ==, rows);
+
+  g_test_timer_start();
+  update_keylist(keylist, fps, rows / 2, "Finished");
+  forget = g_test_timer_elapsed();
+  g_assert_cmpint(shown_rows(keylist), ==, rows / 2);
+
+  g_test_message("%u rows: populate %.3f ms, refresh %.3f ms, refresh with "
+                 "every state changed %.3f ms",
+                 rows, populate * 1000, refresh * 1000, changed * 1000);
+  g_test_message("search and refilter %.3f ms, clear search %.3f ms, forget "
+                 "half %.3f ms",
+                 search * 1000, clear * 1000, forget * 1000);
+  g_test_minimized_result(refresh, "refresh: %.3f s", refresh);
+
+  otrng_keylist_free(keylist);
+  free_fingerprints(fps, rows);
+}
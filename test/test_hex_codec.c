@@ -0,0 +1,92 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hex-codec.h"
+
+static const char *test_fingerprint_hex =
+    "00112233445566778899aabbccddeeff0123456789ABCDEFfedcba9876543210"
+    "0f1e2d3c4b5a69788796a5b4c3d2e1f0deadbeefcafebabe";
+
+void test_hex_codec_round_trip(void) {
+  uint8_t bytes[56];
+  char hex[56 * 2 + 1];
+  char human[OTRNG_PLUGIN_HUMAN_LEN(56)];
+
+  g_assert(otrng_plugin_hex_decode(test_fingerprint_hex, 56, bytes));
+  g_assert_cmpint(bytes[0], ==, 0x00);
+  g_assert_cmpint(bytes[10], ==, 0xaa);
+  g_assert_cmpint(bytes[23], ==, 0xef);
+
+  otrng_plugin_hex_encode(bytes, 56, hex);
+  g_assert(g_ascii_strcasecmp(hex, test_fingerprint_hex) == 0);
+
+  otrng_plugin_fingerprint_to_human(human, bytes, 4 * 3);
+  g_assert_cmpstr(human, ==, "00112233 44556677 8899AABB");
+  g_assert_cmpint(OTRNG_PLUGIN_HUMAN_LEN(56), ==, 126);
+
+  /* Not hex, or too short */
+  g_assert(!otrng_plugin_hex_decode("0g", 1, bytes));
+  g_assert(!otrng_plugin_hex_decode("001", 2, bytes));
+  g_assert(!otrng_plugin_hex_decode("", 1, bytes));
+}
+
+/* The decoder discovery used before the shared codec */
+static unsigned char *legacy_hex_to_bytes(const char *hex, size_t len) {
+  size_t count;
+  char *pos = (char *)hex;
+  unsigned char *result = malloc(len / 2);
+  for (count = 0; count < len / 2; count++) {
+    sscanf(pos, "%2hhx", &result[count]);
+    pos += 2;
+  }
+  return result;
+}
+
+/* Compares decoding a prekey server fingerprint with the codec and with
+ * sscanf. Only runs with -m perf. */
+void test_hex_codec_decode_speed(void) {
+  const int rounds = 100000;
+  uint8_t bytes[56];
+  double legacy, table;
+  int i;
+
+  g_test_timer_start();
+  for (i = 0; i < rounds; i++) {
+    free(legacy_hex_to_bytes(test_fingerprint_hex, 56 * 2));
+  }
+  legacy = g_test_timer_elapsed();
+
+  g_test_timer_start();
+  for (i = 0; i < rounds; i++) {
+    g_assert(otrng_plugin_hex_decode(test_fingerprint_hex, 56, bytes));
+  }
+  table = g_test_timer_elapsed();
+
+  g_test_message("decode of %d fingerprints: sscanf %.3f ms, table %.3f ms",
+                 rounds, legacy * 1000, table * 1000);
+  g_test_minimized_result(table, "table decode: %.3f s", table);
+}
@@ -0,0 +1,139 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../persistance.h"
+
+/* persistance.c reads the stores through this one, but the tests never do */
+otrng_client_id_s protocol_and_account_to_purple_conversation(FILE *privf) {
+  otrng_client_id_s null_result = {
+      .protocol = NULL,
+      .account = NULL,
+  };
+  return null_result;
+}
+
+static gchar *read_whole_file(const gchar *filename) {
+  gchar *contents = NULL;
+  g_assert(g_file_get_contents(filename, &contents, NULL, NULL));
+  return contents;
+}
+
+static void write_fingerprints(FILE *fp, int count) {
+  int i;
+  for (i = 0; i < count; i++) {
+    fprintf(fp,
+            "bob%d@example.org\talice@example.org\tprpl-jabber\t"
+            "%056x%056x\tverified\n",
+            i, i, i);
+  }
+}
+
+void test_persistance_commit_replaces_file(void) {
+  gchar *dir = g_dir_make_tmp("otrng-test-XXXXXX", NULL);
+  gchar *filename = g_build_filename(dir, "otr4.fingerprints", NULL);
+  gchar *tmp = NULL;
+
+  g_assert(g_file_set_contents(filename, "old\n", -1, NULL));
+
+  FILE *fp = persistance_open_temp(filename, &tmp);
+  g_assert(fp != NULL);
+  fputs("new\n", fp);
+
+  g_assert_cmpint(persistance_commit_temp(fp, tmp, filename, 0), ==, 0);
+
+  gchar *contents = read_whole_file(filename);
+  g_assert_cmpstr(contents, ==, "new\n");
+  g_free(contents);
+
+  g_unlink(filename);
+  g_rmdir(dir);
+  g_free(filename);
+  g_free(dir);
+}
+
+void test_persistance_failed_commit_keeps_file(void) {
+  gchar *dir = g_dir_make_tmp("otrng-test-XXXXXX", NULL);
+  gchar *filename = g_build_filename(dir, "otr4.fingerprints", NULL);
+  gchar *tmp = NULL;
+  gchar *tmp_name;
+
+  g_assert(g_file_set_contents(filename, "old\n", -1, NULL));
+
+  FILE *fp = persistance_open_temp(filename, &tmp);
+  g_assert(fp != NULL);
+  tmp_name = g_strdup(tmp);
+  fputs("half written", fp);
+
+  g_assert_cmpint(persistance_commit_temp(fp, tmp, filename, 1), ==, -1);
+
+  gchar *contents = read_whole_file(filename);
+  g_assert_cmpstr(contents, ==, "old\n");
+  g_assert(!g_file_test(tmp_name, G_FILE_TEST_EXISTS));
+  g_free(contents);
+  g_free(tmp_name);
+
+  g_unlink(filename);
+  g_rmdir(dir);
+  g_free(filename);
+  g_free(dir);
+}
+
+/* Measures how long flushing a store with 10k fingerprints takes under each
+ * of the sync policies. Only runs with -m perf. */
+void test_persistance_flush_latency(void) {
+  const int fingerprints = 10000;
+  const int rounds = 20;
+  const char *names[] = {"none", "fdatasync", "fsync"};
+  gchar *dir = g_dir_make_tmp("otrng-test-XXXXXX", NULL);
+  gchar *filename = g_build_filename(dir, "otr4.fingerprints", NULL);
+  int policy, i;
+
+  for (policy = PERSISTANCE_SYNC_NONE; policy <= PERSISTANCE_SYNC_FSYNC;
+       policy++) {
+    GTimer *timer = g_timer_new();
+    persistance_set_sync_policy(policy);
+
+    for (i = 0; i < rounds; i++) {
+      gchar *tmp = NULL;
+      FILE *fp = persistance_open_temp(filename, &tmp);
+      g_assert(fp != NULL);
+      write_fingerprints(fp, fingerprints);
+      g_assert_cmpint(persistance_commit_temp(fp, tmp, filename, 0), ==, 0);
+    }
+
+    g_test_message("flush of %d fingerprints with %s: %.3f ms", fingerprints,
+                   names[policy], g_timer_elapsed(timer, NULL) * 1000 / rounds);
+    g_timer_destroy(timer);
+  }
+
+  persistance_set_sync_policy(PERSISTANCE_SYNC_FSYNC);
+
+  g_unlink(filename);
+  g_rmdir(dir);
+  g_free(filename);
+  g_free(dir);
+}
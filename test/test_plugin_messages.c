@@ -0,0 +1,253 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The plugin's message code is built into this file with its allocation
+ * calls routed through the counting one below, so what it allocates can be
+ * counted without touching the allocator of anything else. g_strdup is all
+ * it allocates with; whatever else it comes to call belongs here too. */
+static gboolean counting_allocations = FALSE;
+static unsigned long allocations_seen = 0;
+
+static gchar *counted_g_strdup(const gchar *s) {
+  if (counting_allocations) {
+    allocations_seen++;
+  }
+  return g_strdup(s);
+}
+
+#undef g_strdup
+#define g_strdup counted_g_strdup
+#include "../plugin-messages.c"
+#undef g_strdup
+
+static void start_counting_allocations(void) { counting_allocations = TRUE; }
+
+static void stop_counting_allocations(void) { counting_allocations = FALSE; }
+
+/* Stands in for otrng_client_receive: plaintext comes back as a copy, OTR
+ * messages are "decrypted" into a new buffer, and a query gets an answer and
+ * nothing to display */
+static otrng_result fake_receive(char **tosend, char **todisplay,
+                                 const char *message, const char *recipient,
+                                 otrng_client_s *client,
+                                 otrng_bool *should_ignore) {
+  if (g_str_has_prefix(message, "?OTRv4?")) {
+    *tosend = strdup("?OTR:identity.");
+    *should_ignore = otrng_true;
+    return OTRNG_SUCCESS;
+  }
+
+  if (g_str_has_prefix(message, "?OTR")) {
+    *todisplay = strdup(message + 4);
+  } else {
+    *todisplay = strdup(message);
+  }
+
+  return OTRNG_SUCCESS;
+}
+
+static int injected = 0;
+
+/* Stands in for otrng_plugin_inject_message */
+static void fake_inject(PurpleAccount *account, const char *recipient,
+                        const char *message) {
+  g_assert_cmpstr(recipient, ==, "bob@example.org");
+  injected++;
+}
+
+/* Stands in for otrng_client_send, which encodes into a new buffer */
+static otrng_result fake_send(char **newmessage, const char *message,
+                              const char *recipient, otrng_client_s *client) {
+  *newmessage = malloc(strlen(message) + 7);
+  sprintf(*newmessage, "?OTR:%s.", message);
+  return OTRNG_SUCCESS;
+}
+
+static gboolean peer_offline = FALSE;
+static int sent_offline = 0;
+
+/* Stands in for the offline check of the plugin */
+static gboolean fake_send_offline(PurpleAccount *account,
+                                  otrng_client_s *client,
+                                  const char *recipient, const char *message) {
+  g_assert_cmpstr(recipient, ==, "bob@example.org");
+  if (peer_offline) {
+    sent_offline++;
+  }
+  return peer_offline;
+}
+
+static const otrng_plugin_message_ops_s fake_ops = {
+    fake_receive,
+    fake_inject,
+    fake_send,
+    fake_send_offline,
+};
+
+/* Runs otrng_plugin_message_receive over rounds messages and returns the
+ * number of heap allocations it made. What the stubbed libotr-ng and
+ * libpurple calls allocate is left out. */
+static unsigned long receive_messages(int rounds, const char *who,
+                                      const char *normalized,
+                                      const char *text) {
+  int i;
+
+  allocations_seen = 0;
+  for (i = 0; i < rounds; i++) {
+    char *message = strdup(text);
+    gboolean ignore;
+
+    start_counting_allocations();
+    ignore = otrng_plugin_message_receive(&fake_ops, NULL, NULL, who,
+                                          normalized, &message);
+    stop_counting_allocations();
+
+    g_assert(ignore == (message == NULL));
+    free(message);
+  }
+
+  return allocations_seen;
+}
+
+void test_plugin_messages_replace(void) {
+  otrng_plugin_message_stats_s stats;
+  char *message = strdup("hello");
+  char *original = message;
+  char *passthrough = strdup("hello");
+  char *decrypted = strdup("decrypted");
+
+  otrng_plugin_message_reset_stats();
+  allocations_seen = 0;
+  start_counting_allocations();
+
+  /* Passthrough keeps the buffer libpurple gave us */
+  otrng_plugin_message_replace(&message, passthrough);
+  g_assert(message == original);
+
+  /* Anything else is adopted without a copy */
+  otrng_plugin_message_replace(&message, decrypted);
+  g_assert(message == decrypted);
+
+  otrng_plugin_message_replace(&message, NULL);
+  g_assert(message == NULL);
+
+  stop_counting_allocations();
+
+  otrng_plugin_message_get_stats(&stats);
+  g_assert_cmpuint(allocations_seen, ==, 0);
+  g_assert_cmpuint(stats.passed_through, ==, 1);
+  g_assert_cmpuint(stats.adopted, ==, 2);
+}
+
+/* Counts the heap allocations otrng_plugin_message_receive makes for 10k
+ * messages. Only runs with -m perf. */
+void test_plugin_messages_receive_allocations(void) {
+  const int rounds = 10000;
+  unsigned long plaintext, decrypted, resource, query;
+  double elapsed;
+
+  g_test_timer_start();
+  plaintext = receive_messages(rounds, "bob@example.org", "bob@example.org",
+                               "hello there");
+  decrypted = receive_messages(rounds, "bob@example.org", "bob@example.org",
+                               "?OTRhello there");
+  resource = receive_messages(rounds, "bob@example.org/phone",
+                              "bob@example.org", "hello there");
+  injected = 0;
+  query = receive_messages(rounds, "bob@example.org/phone", "bob@example.org",
+                           "?OTRv4? query");
+  elapsed = g_test_timer_elapsed();
+
+  g_assert_cmpuint(plaintext, ==, 0);
+  g_assert_cmpuint(decrypted, ==, 0);
+  g_assert_cmpuint(resource, ==, rounds);
+  g_assert_cmpuint(query, ==, rounds);
+  g_assert_cmpint(injected, ==, rounds);
+
+  g_test_message("allocations per %d received messages: plaintext %lu, "
+                 "decrypted %lu, sender with resource %lu, answered query "
+                 "%lu (%.3f ms)",
+                 rounds, plaintext, decrypted, resource, query,
+                 elapsed * 1000);
+}
+
+/* Runs otrng_plugin_message_send over rounds messages and returns the
+ * number of heap allocations it made */
+static unsigned long send_messages(int rounds, const char *who,
+                                   const char *normalized) {
+  int i;
+
+  allocations_seen = 0;
+  for (i = 0; i < rounds; i++) {
+    char *message = strdup("hello there");
+
+    start_counting_allocations();
+    otrng_plugin_message_send(&fake_ops, NULL, NULL, who, normalized,
+                              &message);
+    stop_counting_allocations();
+
+    if (peer_offline) {
+      g_assert_cmpstr(message, ==, "hello there");
+    } else {
+      g_assert_cmpstr(message, ==, "?OTR:hello there.");
+    }
+    free(message);
+  }
+
+  return allocations_seen;
+}
+
+/* Counts the heap allocations otrng_plugin_message_send makes for 10k
+ * messages. Only runs with -m perf. */
+void test_plugin_messages_send_allocations(void) {
+  const int rounds = 10000;
+  otrng_plugin_message_stats_s stats;
+  unsigned long canonical, resource, offline;
+  double elapsed;
+
+  otrng_plugin_message_reset_stats();
+  g_test_timer_start();
+  canonical = send_messages(rounds, "bob@example.org", "bob@example.org");
+  resource = send_messages(rounds, "bob@example.org/phone", "bob@example.org");
+  peer_offline = TRUE;
+  sent_offline = 0;
+  offline = send_messages(rounds, "bob@example.org", "bob@example.org");
+  peer_offline = FALSE;
+  elapsed = g_test_timer_elapsed();
+  otrng_plugin_message_get_stats(&stats);
+
+  /* Only a peer that is not in its canonical form costs a copy */
+  g_assert_cmpuint(canonical, ==, 0);
+  g_assert_cmpuint(resource, ==, rounds);
+  g_assert_cmpuint(offline, ==, 0);
+  g_assert_cmpint(sent_offline, ==, rounds);
+  g_assert_cmpuint(stats.adopted, ==, 2 * rounds);
+
+  g_test_message("allocations per %d sent messages: canonical peer %lu, "
+                 "peer with resource %lu, offline peer %lu (%.3f ms)",
+                 rounds, canonical, resource, offline, elapsed * 1000);
+}
@@ -0,0 +1,140 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+
+#include "../prefix-index.h"
+
+static void count_value(gpointer value, gpointer data) {
+  (*(int *)data) += GPOINTER_TO_INT(value);
+}
+
+void test_prefix_index_search(void) {
+  otrng_prefix_index_s *index = otrng_prefix_index_new();
+  int sum = 0;
+
+  otrng_prefix_index_add(index, "Alice@example.org", GINT_TO_POINTER(1));
+  otrng_prefix_index_add(index, "alfred@example.org", GINT_TO_POINTER(10));
+  otrng_prefix_index_add(index, "bob@example.org", GINT_TO_POINTER(100));
+  otrng_prefix_index_add(index, "a1b2c3d4", GINT_TO_POINTER(1000));
+
+  g_assert_cmpuint(otrng_prefix_index_search(index, "AL", count_value, &sum),
+                   ==, 2);
+  g_assert_cmpint(sum, ==, 11);
+
+  sum = 0;
+  g_assert_cmpuint(otrng_prefix_index_search(index, "A1B2", count_value, &sum),
+                   ==, 1);
+  g_assert_cmpint(sum, ==, 1000);
+
+  sum = 0;
+  g_assert_cmpuint(otrng_prefix_index_search(index, "carol", count_value, &sum),
+                   ==, 0);
+  g_assert_cmpint(sum, ==, 0);
+
+  otrng_prefix_index_remove(index, "ALICE@example.org", GINT_TO_POINTER(1));
+  g_assert_cmpuint(otrng_prefix_index_size(index), ==, 3);
+
+  sum = 0;
+  g_assert_cmpuint(otrng_prefix_index_search(index, "", count_value, &sum), ==,
+                   3);
+  g_assert_cmpint(sum, ==, 1110);
+
+  /* A value removed and added again under the same key is found once */
+  otrng_prefix_index_remove(index, "bob@example.org", GINT_TO_POINTER(100));
+  otrng_prefix_index_remove(index, "bob@example.org", GINT_TO_POINTER(100));
+  g_assert_cmpuint(otrng_prefix_index_size(index), ==, 2);
+  otrng_prefix_index_add(index, "bob@example.org", GINT_TO_POINTER(100));
+
+  sum = 0;
+  g_assert_cmpuint(otrng_prefix_index_search(index, "bob", count_value, &sum),
+                   ==, 1);
+  g_assert_cmpint(sum, ==, 100);
+
+  otrng_prefix_index_remove(index, "alfred@example.org", GINT_TO_POINTER(10));
+  otrng_prefix_index_remove(index, "a1b2c3d4", GINT_TO_POINTER(1000));
+  g_assert_cmpuint(otrng_prefix_index_size(index), ==, 1);
+
+  sum = 0;
+  g_assert_cmpuint(otrng_prefix_index_search(index, "", count_value, &sum), ==,
+                   1);
+  g_assert_cmpint(sum, ==, 100);
+
+  otrng_prefix_index_free(index);
+}
+
+static void stamp_row(gpointer value, gpointer data) {
+  ((guint *)data)[GPOINTER_TO_UINT(value)]++;
+}
+
+/* Fills the index the way the fingerprint manager does with 100k
+ * fingerprints, each under its username and its hex fingerprint, then
+ * searches it and removes every entry. Only the index is timed, not the
+ * manager's GTK models. A search has to answer within a frame (16 ms).
+ * Only runs with -m perf. */
+void test_prefix_index_speed(void) {
+  const guint rows = 100000;
+  otrng_prefix_index_s *index = otrng_prefix_index_new();
+  guint *stamps = g_new0(guint, rows);
+  char **hex = g_new(char *, rows);
+  char key[64];
+  double populate, search, remove;
+  guint i, found;
+
+  g_test_timer_start();
+  for (i = 0; i < rows; i++) {
+    g_snprintf(key, sizeof(key), "user%06u@example.org", i);
+    otrng_prefix_index_add(index, key, GUINT_TO_POINTER(i));
+    hex[i] = g_strdup_printf("%08x%032x", g_random_int(), i);
+    otrng_prefix_index_add(index, hex[i], GUINT_TO_POINTER(i));
+  }
+  /* The first search sorts the index */
+  otrng_prefix_index_search(index, "-", stamp_row, stamps);
+  populate = g_test_timer_elapsed();
+
+  g_test_timer_start();
+  found = otrng_prefix_index_search(index, "USER0123", stamp_row, stamps);
+  search = g_test_timer_elapsed();
+  g_assert_cmpuint(found, ==, 100);
+
+  /* As when a refresh finds every fingerprint gone */
+  g_test_timer_start();
+  for (i = 0; i < rows; i++) {
+    g_snprintf(key, sizeof(key), "user%06u@example.org", i);
+    otrng_prefix_index_remove(index, key, GUINT_TO_POINTER(i));
+    otrng_prefix_index_remove(index, hex[i], GUINT_TO_POINTER(i));
+  }
+  remove = g_test_timer_elapsed();
+  g_assert_cmpuint(otrng_prefix_index_size(index), ==, 0);
+
+  g_test_message("%u rows: fill %.3f ms, search %.3f ms, remove all %.3f ms",
+                 rows, populate * 1000, search * 1000, remove * 1000);
+  g_assert_cmpfloat(search, <, 1.0 / 60);
+  g_test_minimized_result(search, "search: %.3f s", search);
+
+  for (i = 0; i < rows; i++) {
+    g_free(hex[i]);
+  }
+  g_free(hex);
+  otrng_prefix_index_free(index);
+  g_free(stamps);
+}
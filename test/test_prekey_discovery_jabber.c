@@ -24,6 +24,11 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <eventloop.h>
+#include <xmlnode.h>
+
+#include "../prekey-discovery-jabber.h"
+
 char *get_domain_from_jid(const char *jid);
 
 void test_get_domain_from_jid(void) {
@@ -37,3 +42,199 @@ void test_get_domain_from_jid(void) {
   char *res1 = get_domain_from_jid(NULL);
   g_assert(res1 == NULL);
 }
+
+static PurpleEventLoopUiOps test_eventloop_ops = {
+    g_timeout_add, g_source_remove, NULL, NULL, NULL, g_timeout_add_seconds,
+    NULL,          NULL,            NULL};
+
+/* The IQs "sent", in order, and the connections they were sent over */
+static GPtrArray *sent_iqs = NULL;
+static GPtrArray *sent_over = NULL;
+
+static gboolean record_iq(PurpleConnection *pc, xmlnode **iq) {
+  g_ptr_array_add(sent_iqs, xmlnode_copy(*iq));
+  g_ptr_array_add(sent_over, pc);
+  return TRUE;
+}
+
+typedef struct {
+  int found;
+  int finished;
+} lookup_result;
+
+static void count_result(otrng_plugin_prekey_server *srv, void *context) {
+  lookup_result *result = context;
+
+  if (!srv) {
+    result->finished++;
+    return;
+  }
+
+  result->found++;
+  g_free(srv->identity);
+  free(srv);
+}
+
+static void discovery_test_start(void) {
+  purple_eventloop_set_ui_ops(&test_eventloop_ops);
+  sent_iqs = g_ptr_array_new_with_free_func((GDestroyNotify)xmlnode_free);
+  sent_over = g_ptr_array_new();
+  otrng_plugin_jabber_set_iq_sender(record_iq);
+  otrng_plugin_prekey_discovery_jabber_load();
+}
+
+static void discovery_test_end(void) {
+  otrng_plugin_prekey_discovery_jabber_unload();
+  otrng_plugin_jabber_set_iq_sender(NULL);
+  g_ptr_array_free(sent_iqs, TRUE);
+  sent_iqs = NULL;
+  g_ptr_array_free(sent_over, TRUE);
+  sent_over = NULL;
+}
+
+static const char *sent_namespace(guint i) {
+  xmlnode *query = xmlnode_get_child(g_ptr_array_index(sent_iqs, i), "query");
+  return xmlnode_get_namespace(query);
+}
+
+/* Answers the i-th IQ sent with the given children of its query */
+static gboolean answer(guint i, const char *type, const char *children) {
+  xmlnode *sent = g_ptr_array_index(sent_iqs, i);
+  const char *id = xmlnode_get_attrib(sent, "id");
+  const char *to = xmlnode_get_attrib(sent, "to");
+  char *text = g_strdup_printf("<iq type='%s' id='%s' from='%s'>"
+                               "<query xmlns='%s'>%s</query></iq>",
+                               type, id, to, sent_namespace(i), children);
+  xmlnode *iq = xmlnode_from_str(text, -1);
+  gboolean handled =
+      otrng_plugin_jabber_iq_received(NULL, type, id, to, iq);
+
+  xmlnode_free(iq);
+  g_free(text);
+  return handled;
+}
+
+static const char six_items[] =
+    "<item jid='a.example.org'/><item jid='b.example.org'/>"
+    "<item jid='c.example.org'/><item jid='d.example.org'/>"
+    "<item jid='e.example.org'/><item jid='f.example.org'/>";
+
+void test_prekey_discovery_jabber_shared_and_throttled(void) {
+  lookup_result first = {0, 0}, second = {0, 0}, late = {0, 0};
+  otrng_plugin_jabber_iq_stats_s stats;
+  char *fingerprint;
+  guint i;
+
+  discovery_test_start();
+
+  /* Lookups for a domain being discovered share its IQs */
+  otrng_plugin_jabber_discover(NULL, "example.org", count_result, &first);
+  otrng_plugin_jabber_discover(NULL, "example.org", count_result, &second);
+  g_assert_cmpuint(sent_iqs->len, ==, 1);
+  g_assert_cmpstr(sent_namespace(0), ==, NS_DISCO_ITEMS);
+
+  /* Only so many disco#info requests are out at once */
+  g_assert(answer(0, "result", six_items));
+  g_assert_cmpuint(sent_iqs->len, ==, 1 + OTRNG_DISCOVERY_MAX_PARALLEL_INFO);
+  otrng_plugin_jabber_get_iq_stats(&stats);
+  g_assert_cmpuint(stats.pending, ==, OTRNG_DISCOVERY_MAX_PARALLEL_INFO);
+
+  /* An answer lets the next queued one go */
+  g_assert(answer(1, "result",
+                  "<identity category='conference' type='text'/>"));
+  g_assert_cmpuint(sent_iqs->len, ==, 2 + OTRNG_DISCOVERY_MAX_PARALLEL_INFO);
+
+  /* b.example.org is a prekey server: its items are asked for first */
+  g_assert(answer(2, "result",
+                  "<identity category='auth' type='otr-prekey'/>"));
+  g_assert_cmpuint(sent_iqs->len, ==, 4 + OTRNG_DISCOVERY_MAX_PARALLEL_INFO);
+  i = 2 + OTRNG_DISCOVERY_MAX_PARALLEL_INFO;
+  g_assert_cmpstr(sent_namespace(i), ==, NS_DISCO_ITEMS);
+  g_assert_cmpstr(xmlnode_get_attrib(g_ptr_array_index(sent_iqs, i), "to"),
+                  ==, "b.example.org");
+
+  fingerprint = g_strdup_printf(
+      "<item jid='b.example.org' node='fingerprint' name='%0112d'/>", 0);
+  g_assert(answer(i, "result", fingerprint));
+  g_free(fingerprint);
+  g_assert_cmpint(first.found, ==, 1);
+  g_assert_cmpint(second.found, ==, 1);
+
+  /* A late lookup gets what was found so far, without any new IQ */
+  otrng_plugin_jabber_discover(NULL, "example.org", count_result, &late);
+  g_assert_cmpint(late.found, ==, 1);
+  g_assert_cmpuint(sent_iqs->len, ==, 4 + OTRNG_DISCOVERY_MAX_PARALLEL_INFO);
+  g_assert_cmpint(first.finished, ==, 0);
+
+  /* Every other server fails to answer; the last one ends the lookup */
+  for (i = 0; i < sent_iqs->len; i++) {
+    answer(i, "error", "");
+  }
+  g_assert_cmpuint(sent_iqs->len, ==, 1 + 6 + 1);
+  otrng_plugin_jabber_get_iq_stats(&stats);
+  g_assert_cmpuint(stats.pending, ==, 0);
+  g_assert_cmpint(first.finished, ==, 1);
+  g_assert_cmpint(second.finished, ==, 1);
+  g_assert_cmpint(late.finished, ==, 1);
+  g_assert_cmpint(first.found, ==, 1);
+
+  discovery_test_end();
+}
+
+void test_prekey_discovery_jabber_expiry(void) {
+  lookup_result first = {0, 0}, second = {0, 0};
+  otrng_plugin_jabber_iq_stats_s stats;
+
+  discovery_test_start();
+
+  otrng_plugin_jabber_discover(NULL, "example.org", count_result, &first);
+  otrng_plugin_jabber_discover(NULL, "example.org", count_result, &second);
+  g_assert(answer(0, "result", six_items));
+
+  /* Nothing is due yet */
+  otrng_plugin_jabber_expire_iqs(g_get_monotonic_time());
+  otrng_plugin_jabber_get_iq_stats(&stats);
+  g_assert_cmpuint(stats.pending, ==, OTRNG_DISCOVERY_MAX_PARALLEL_INFO);
+  g_assert_cmpint(first.finished, ==, 0);
+
+  /* Expiring the IQs lets the queued ones go, and those expire too */
+  otrng_plugin_jabber_expire_iqs(G_MAXINT64);
+  g_assert_cmpuint(sent_iqs->len, ==, 1 + 6);
+  otrng_plugin_jabber_get_iq_stats(&stats);
+  g_assert_cmpuint(stats.pending, ==, 0);
+  g_assert_cmpint(first.finished, ==, 1);
+  g_assert_cmpint(second.finished, ==, 1);
+  g_assert_cmpint(first.found, ==, 0);
+
+  /* An answer after the deadline is not ours anymore */
+  g_assert(!answer(1, "result",
+                   "<identity category='auth' type='otr-prekey'/>"));
+  g_assert_cmpuint(sent_iqs->len, ==, 1 + 6);
+  g_assert_cmpint(first.finished, ==, 1);
+
+  discovery_test_end();
+}
+
+void test_prekey_discovery_jabber_per_connection(void) {
+  PurpleConnection *pc1 = GINT_TO_POINTER(1), *pc2 = GINT_TO_POINTER(2);
+  lookup_result first = {0, 0}, second = {0, 0};
+
+  discovery_test_start();
+
+  /* Two accounts on one server each discover it over their own connection */
+  otrng_plugin_jabber_discover(pc1, "example.org", count_result, &first);
+  otrng_plugin_jabber_discover(pc2, "example.org", count_result, &second);
+  g_assert_cmpuint(sent_iqs->len, ==, 2);
+  g_assert(g_ptr_array_index(sent_over, 0) == pc1);
+  g_assert(g_ptr_array_index(sent_over, 1) == pc2);
+
+  /* Ending one leaves the other running */
+  g_assert(answer(0, "error", ""));
+  g_assert_cmpint(first.finished, ==, 1);
+  g_assert_cmpint(second.finished, ==, 0);
+
+  g_assert(answer(1, "error", ""));
+  g_assert_cmpint(second.finished, ==, 1);
+
+  discovery_test_end();
+}
@@ -0,0 +1,96 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+
+#include "../prekey-plugin-waiting.h"
+
+static int freed_items = 0;
+
+static void count_free(gpointer item) {
+  freed_items++;
+  g_free(item);
+}
+
+void test_waiting_queue_fifo_per_recipient(void) {
+  otrng_waiting_queue_s *queue = otrng_waiting_queue_new(count_free);
+  int client_a, client_b;
+
+  otrng_waiting_queue_push(queue, &client_a, "bob@example.org", g_strdup("1"));
+  otrng_waiting_queue_push(queue, &client_b, "bob@example.org", g_strdup("2"));
+  otrng_waiting_queue_push(queue, &client_a, "bob@example.org", g_strdup("3"));
+  otrng_waiting_queue_push(queue, &client_a, "eve@example.org", g_strdup("4"));
+  g_assert_cmpuint(otrng_waiting_queue_size(queue), ==, 4);
+
+  char *item = otrng_waiting_queue_pop(queue, &client_a, "bob@example.org");
+  g_assert_cmpstr(item, ==, "1");
+  g_free(item);
+  item = otrng_waiting_queue_pop(queue, &client_a, "bob@example.org");
+  g_assert_cmpstr(item, ==, "3");
+  g_free(item);
+  item = otrng_waiting_queue_pop(queue, &client_a, "bob@example.org");
+  g_assert(item == NULL);
+  g_assert(otrng_waiting_queue_pop(queue, &client_a, NULL) == NULL);
+  g_assert_cmpuint(otrng_waiting_queue_size(queue), ==, 2);
+
+  freed_items = 0;
+  otrng_waiting_queue_free(queue);
+  g_assert_cmpint(freed_items, ==, 2);
+}
+
+void test_waiting_queue_stress(void) {
+  const int clients = 4, recipients = 250, per_recipient = 8;
+  otrng_waiting_queue_s *queue = otrng_waiting_queue_new(NULL);
+  int client_ids[4];
+  char recipient[32];
+  int c, r, i;
+
+  for (i = 0; i < per_recipient; i++) {
+    for (c = 0; c < clients; c++) {
+      for (r = 0; r < recipients; r++) {
+        g_snprintf(recipient, sizeof(recipient), "peer%d@example.org", r);
+        otrng_waiting_queue_push(queue, &client_ids[c], recipient,
+                                 GINT_TO_POINTER(i + 1));
+      }
+    }
+  }
+  g_assert_cmpuint(otrng_waiting_queue_size(queue), ==,
+                   clients * recipients * per_recipient);
+
+  /* Drain in the reverse recipient order; each recipient still sees its
+   * messages in the order they were queued */
+  for (r = recipients - 1; r >= 0; r--) {
+    g_snprintf(recipient, sizeof(recipient), "peer%d@example.org", r);
+    for (c = 0; c < clients; c++) {
+      for (i = 0; i < per_recipient; i++) {
+        gpointer item =
+            otrng_waiting_queue_pop(queue, &client_ids[c], recipient);
+        g_assert_cmpint(GPOINTER_TO_INT(item), ==, i + 1);
+      }
+      g_assert(otrng_waiting_queue_pop(queue, &client_ids[c], recipient) ==
+               NULL);
+    }
+  }
+  g_assert_cmpuint(otrng_waiting_queue_size(queue), ==, 0);
+
+  otrng_waiting_queue_free(queue);
+}
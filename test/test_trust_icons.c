@@ -0,0 +1,84 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+
+#include "../trust-icons.h"
+
+void test_trust_icons_shared(void) {
+  GdkPixbuf *private_icon = otrng_trust_icon(TRUST_PRIVATE);
+
+  g_assert(private_icon != NULL);
+  g_assert(otrng_trust_icon(TRUST_PRIVATE) == private_icon);
+  g_assert(otrng_trust_icon(TRUST_UNVERIFIED) != private_icon);
+  g_assert_cmpint(gdk_pixbuf_get_width(private_icon), ==, 16);
+
+  otrng_trust_icons_unload();
+}
+
+/* Opens and then refreshes a few hundred conversation tabs, decoding the
+ * icon every time as before, and with the shared icons. Only runs with
+ * -m perf. */
+void test_trust_icons_refresh_speed(void) {
+  const int tabs = 500, refreshes = 20;
+  double decode_startup, decode_refresh, shared_startup, shared_refresh;
+  int i, j;
+
+  g_test_timer_start();
+  for (i = 0; i < tabs; i++) {
+    g_object_unref(otrng_trust_icon_decode(TRUST_NOT_PRIVATE));
+  }
+  decode_startup = g_test_timer_elapsed();
+
+  g_test_timer_start();
+  for (j = 0; j < refreshes; j++) {
+    for (i = 0; i < tabs; i++) {
+      g_object_unref(otrng_trust_icon_decode((i + j) % 4));
+    }
+  }
+  decode_refresh = g_test_timer_elapsed();
+
+  g_test_timer_start();
+  otrng_trust_icons_load();
+  for (i = 0; i < tabs; i++) {
+    g_assert(otrng_trust_icon(TRUST_NOT_PRIVATE) != NULL);
+  }
+  shared_startup = g_test_timer_elapsed();
+
+  g_test_timer_start();
+  for (j = 0; j < refreshes; j++) {
+    for (i = 0; i < tabs; i++) {
+      g_assert(otrng_trust_icon((i + j) % 4) != NULL);
+    }
+  }
+  shared_refresh = g_test_timer_elapsed();
+
+  otrng_trust_icons_unload();
+
+  g_test_message("%d tabs: startup decoding %.3f ms, shared %.3f ms", tabs,
+                 decode_startup * 1000, shared_startup * 1000);
+  g_test_message("%d refreshes: decoding %.3f ms, shared %.3f ms",
+                 tabs * refreshes, decode_refresh * 1000,
+                 shared_refresh * 1000);
+  g_test_minimized_result(shared_refresh, "shared refresh: %.3f s",
+                          shared_refresh);
+}
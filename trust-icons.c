@@ -0,0 +1,82 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "trust-icons.h"
+
+#include "icons/finished.xpm"
+#include "icons/not_private.xpm"
+#include "icons/private.xpm"
+#include "icons/unverified.xpm"
+
+#define TRUST_LEVELS (TRUST_FINISHED + 1)
+
+static GdkPixbuf *trust_icons[TRUST_LEVELS];
+
+GdkPixbuf *otrng_trust_icon_decode(TrustLevel level) {
+  const char **data = NULL;
+
+  switch (level) {
+  case TRUST_NOT_PRIVATE:
+    data = otrng_not_private_icon;
+    break;
+  case TRUST_UNVERIFIED:
+    data = otrng_unverified_icon;
+    break;
+  case TRUST_PRIVATE:
+    data = otrng_private_icon;
+    break;
+  case TRUST_FINISHED:
+    data = otrng_finished_icon;
+    break;
+  }
+
+  return gdk_pixbuf_new_from_xpm_data(data);
+}
+
+void otrng_trust_icons_load(void) {
+  int level;
+
+  for (level = 0; level < TRUST_LEVELS; level++) {
+    if (!trust_icons[level]) {
+      trust_icons[level] = otrng_trust_icon_decode(level);
+    }
+  }
+}
+
+void otrng_trust_icons_unload(void) {
+  int level;
+
+  for (level = 0; level < TRUST_LEVELS; level++) {
+    if (trust_icons[level]) {
+      g_object_unref(G_OBJECT(trust_icons[level]));
+      trust_icons[level] = NULL;
+    }
+  }
+}
+
+GdkPixbuf *otrng_trust_icon(TrustLevel level) {
+  if (!trust_icons[level]) {
+    otrng_trust_icons_load();
+  }
+
+  return trust_icons[level];
+}
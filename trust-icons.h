@@ -0,0 +1,44 @@
+/*
+ *  Off-the-Record Messaging plugin for pidgin
+ *  Copyright (C) 2004-2018  Ian Goldberg, Rob Smits,
+ *                           Chris Alexander, Willy Lew,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *                           The pidgin-otrng contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef OTRNG_PIDGIN_TRUST_ICONS
+#define OTRNG_PIDGIN_TRUST_ICONS
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "plugin-all.h"
+
+/* Decodes the icons of the trust levels. Every conversation tab shows one
+ * and changes it on every status refresh, so they are decoded once and
+ * shared instead. */
+void otrng_trust_icons_load(void);
+void otrng_trust_icons_unload(void);
+
+/* Returns the icon for level, decoding the icons if they are not loaded. The
+ * pixbuf belongs to the cache: take a reference to keep it past unloading. */
+GdkPixbuf *otrng_trust_icon(TrustLevel level);
+
+/* Decodes a new copy of the icon for level, to be unreferenced by the
+ * caller */
+GdkPixbuf *otrng_trust_icon_decode(TrustLevel level);
+
+#endif // OTRNG_PIDGIN_TRUST_ICONS
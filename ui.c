@@ -48,6 +48,7 @@
 #include <libotr/privkey.h>
 
 /* pidgin-otrng headers */
+#include "conversation-index.h"
 #include "dialogs.h"
 #include "pidgin-helpers.h"
 #include "plugin-all.h"
@@ -97,7 +98,7 @@ void otrng_ui_disconnect_connection(otrng_plugin_conversation *conv) {
   }
 
   otrng_conversation_s *otr_conv =
-      otrng_client_get_conversation(0, conv->peer, client);
+      otrng_plugin_client_get_conversation(0, conv->peer, client);
 
   /* Don't do anything with fingerprints other than the active one
    * if we're in the ENCRYPTED state */
@@ -153,7 +154,6 @@ void otrng_ui_forget_fingerprint(otrng_client_id_s cid,
   }
 
   otrng_plugin_fingerprint_forget(client, fingerprint);
-  otrng_plugin_write_fingerprints();
 
   otrng_ui_update_keylist();
 }